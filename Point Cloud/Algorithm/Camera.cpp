@@ -10,6 +10,7 @@ void vcc::Camera::setInput(DataMgr* pData)
   if (!pData->isModelEmpty())
   {
     target = pData->getCurrentModel();
+    target_bvh = pData->getModelBVH();
     original = pData->getCurrentOriginal();
     //scan candidates for initialing
     scan_count = pData->getScanCount();
@@ -35,6 +36,8 @@ void vcc::Camera::setInput(DataMgr* pData)
       / global_paraMgr.camera.getDouble("Predicted Model Size");
 
     resolution = global_paraMgr.camera.getDouble("Camera Resolution");
+
+    RayTriangle::setISA((RayTriangle::ISA)global_paraMgr.camera.getInt("Ray Kernel ISA"));
   }else
   {
     cout<<"ERROR: Camera::setInput empty!!" << endl;
@@ -66,57 +69,113 @@ void vcc::Camera::run()
   }
 }
 
+//same generator as GlobalFun::tinyrand, but the state is owned by the caller,
+//so every scanline has its own sequence and the noise doesn't depend on thread scheduling
+static float scanRand(unsigned& state)
+{
+  state = 1664525u * state + 1013904223u;
+  return (float) state / 4294967296.0f;
+}
+
 void vcc::Camera::runVirtualScan()
 {
   //point current_scanned_mesh to a new address
   current_scanned_mesh = new CMesh;
-  double max_displacement = resolution * 0.0f; //8.0f;//global_paraMgr.nbv.getDouble("Max Displacement"); //resolution * 2; //for adding noise
   computeUpAndRight();
-  Point3f viewray = direction.Normalize();
+  virtualScan(pos, direction, current_scanned_mesh, *scan_count);
+
+  //increase the scan count;
+  (*scan_count)++;
+  std::cout<<"scan count right after virtual scan: "<<*scan_count <<std::endl;
+}
+
+void vcc::Camera::virtualScan(const Point3f& view_pos, const Point3f& view_dir, CMesh* scanned_mesh, unsigned noise_seed) const
+{
+  double max_displacement = resolution * 0.0f; //8.0f;//global_paraMgr.nbv.getDouble("Max Displacement"); //resolution * 2; //for adding noise
+  //the brute force path is kept for A/B comparison
+  bool use_bvh = para->getBool("Use BVH Ray Casting") && target_bvh != NULL && !target_bvh->isEmpty();
+  TriangleSoA target_faces;
+  if (!use_bvh) target_faces.setFaces(*target);
+
+  Point3f view_up, view_right;
+  computeUpAndRight(view_dir, view_up, view_right);
+  Point3f viewray = view_dir;
+  viewray.Normalize();
   //compute the end point of viewray
-  Point3f viewray_end = pos + viewray * far_distance;
+  Point3f viewray_end = view_pos + viewray * far_distance;
 
-  //sweep and scan
+  //sweep and scan, one scanline per i, each scanline writes its own buffer
   int n_point_hr_half  = static_cast<int>(0.5 * far_horizon_dist / resolution);
   int n_point_ver_half = static_cast<int>(0.5 * far_vertical_dist / resolution);
-  int index = 0; 
-  for (int i = - n_point_hr_half; i < n_point_hr_half; ++i)
+  int n_scanline = 2 * n_point_hr_half;
+  vector<vector<CVertex> > scanlines(n_scanline);
+
+  auto scanLine = [&](int line)
   {
+    int i = line - n_point_hr_half;
     double i_res = i * resolution;
+    unsigned rand_state = noise_seed * 2654435761u + line;
+    vector<CVertex>& scanned_points = scanlines[line];
+    scanned_points.reserve(2 * n_point_ver_half);
     for (int j = - n_point_ver_half; j < n_point_ver_half; ++j)
     {
-      Point3f viewray_end_iter = viewray_end + right * i_res + up * (j * resolution);
-      Point3f viewray_iter = viewray_end_iter - pos;
+      Point3f viewray_end_iter = viewray_end + view_right * i_res + view_up * (j * resolution);
+      Point3f viewray_iter = viewray_end_iter - view_pos;
       //line direction vector
       Point3f line_dir = viewray_iter.Normalize();
       Point3f intersect_point;
       Point3f intersect_point_normal;
       bool is_barely_visible = false;
-      double dist = GlobalFun::computeMeshLineIntersectPoint(target, pos, line_dir, intersect_point, intersect_point_normal, is_barely_visible);
+      double dist = use_bvh ? target_bvh->computeLineIntersectPoint(view_pos, line_dir, intersect_point, intersect_point_normal, far_distance)
+        : GlobalFun::computeMeshLineIntersectPoint(target, target_faces, view_pos, line_dir, intersect_point, intersect_point_normal, is_barely_visible);
       if ( dist <= far_distance && dist >= near_distance)
       {
         //add some random noise
-        //srand(time(NULL)); 
-        double rndax = (double(2.0f * rand()) / RAND_MAX - 1.0f ) * max_displacement;
-        double rnday = (double(2.0f * rand()) / RAND_MAX - 1.0f ) * max_displacement;
-        double rndaz = (double(2.0f * rand()) / RAND_MAX - 1.0f ) * max_displacement;
+        double rndax = (2.0f * scanRand(rand_state) - 1.0f ) * max_displacement;
+        double rnday = (2.0f * scanRand(rand_state) - 1.0f ) * max_displacement;
+        double rndaz = (2.0f * scanRand(rand_state) - 1.0f ) * max_displacement;
 
         CVertex t;
         t.is_scanned = true;
         t.is_barely_visible= is_barely_visible;
-         
-        t.m_index = index++;
         t.P() = intersect_point + Point3f(rndax, rnday, rndaz);//noise 1
         t.N() = intersect_point_normal; //set out direction as approximate normal
-        current_scanned_mesh->vert.push_back(t);
-        current_scanned_mesh->bbox.Add(t.P());
+        scanned_points.push_back(t);
       }
     }
+  };
+
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n_scanline), 
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    for (size_t line = r.begin(); line < r.end(); ++line)
+      scanLine(line);
+  });
+#else
+  for (int line = 0; line < n_scanline; ++line)
+    scanLine(line);
+#endif
+
+  //merge the scanlines in order, so the result doesn't depend on the scheduling
+  int n_scanned = 0;
+  for (int line = 0; line < n_scanline; ++line)
+    n_scanned += scanlines[line].size();
+  scanned_mesh->vert.reserve(scanned_mesh->vert.size() + n_scanned);
+
+  int index = 0; 
+  for (int line = 0; line < n_scanline; ++line)
+  {
+    vector<CVertex>& scanned_points = scanlines[line];
+    for (int k = 0; k < scanned_points.size(); ++k)
+    {
+      CVertex& t = scanned_points[k];
+      t.m_index = index++;
+      scanned_mesh->vert.push_back(t);
+      scanned_mesh->bbox.Add(t.P());
+    }
   }
-  current_scanned_mesh->vn = current_scanned_mesh->vert.size();
-  //increase the scan count;
-  (*scan_count)++;
-  std::cout<<"scan count right after virtual scan: "<<*scan_count <<std::endl;
+  scanned_mesh->vn = scanned_mesh->vert.size();
 }
 
 void vcc::Camera::runInitialScan()
@@ -171,6 +230,39 @@ void vcc::Camera::runInitialScan()
 
 }
 
+void vcc::Camera::virtualScanBatch(const vector<ScanCandidate>& views, vector<CMesh* >& scanned_meshes,
+                                   unsigned first_seed, vector<double>* view_seconds) const
+{
+  int n_view = views.size();
+  scanned_meshes.resize(n_view, NULL);
+  for (int i = 0; i < n_view; ++i)
+  {
+    if (scanned_meshes[i] == NULL) scanned_meshes[i] = new CMesh;
+  }
+  if (view_seconds != NULL) view_seconds->assign(n_view, 0.0);
+
+  //views are independent, the scanlines inside each view are split again by virtualScan
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n_view), 
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    for (size_t i = r.begin(); i < r.end(); ++i)
+    {
+      tbb::tick_count start = tbb::tick_count::now();
+      virtualScan(views[i].first, views[i].second, scanned_meshes[i], first_seed + i);
+      if (view_seconds != NULL) (*view_seconds)[i] = (tbb::tick_count::now() - start).seconds();
+    }
+  });
+#else
+  for (int i = 0; i < n_view; ++i)
+  {
+    clock_t start = clock();
+    virtualScan(views[i].first, views[i].second, scanned_meshes[i], first_seed + i);
+    if (view_seconds != NULL) (*view_seconds)[i] = (clock() - start) / double(CLOCKS_PER_SEC);
+  }
+#endif
+}
+
 void vcc::Camera::runNBVScan()
 {
   //release scanned_result
@@ -185,23 +277,33 @@ void vcc::Camera::runNBVScan()
   }
   scanned_results->clear();
 
-  //traverse the scan_candidates and do virtual scan
-  vector<ScanCandidate>::iterator it = scan_candidates->begin();
+  //scan all the candidates in one batch
   cout<<"scan candidates size: " <<scan_candidates->size() <<endl;
-  int i = 1;
-  for (; it != scan_candidates->end(); ++it)
+  if (scan_candidates->empty()) return;
+
+  Timer timer;
+  timer.start("NBV Batch Scan");
+  vector<CMesh* > view_meshes;
+  vector<double> view_seconds;
+  virtualScanBatch(*scan_candidates, view_meshes, *scan_count, &view_seconds);
+  timer.end();
+
+  for (int i = 0; i < scan_candidates->size(); ++i)
   {
-    pos = it->first;
-    direction = it->second;
-    /********* call runVirtualScan() *******/
-    cout<< i << "th candidate Begins!" <<endl;
-    runVirtualScan();
-    cout<< i++ << "th candidate Ends!" <<endl;
+    cout<< i + 1 << "th candidate scanned points:  " << view_meshes[i]->vert.size() 
+      << "  time used: " << view_seconds[i] << " seconds." << endl;
 
-    scan_history->push_back(*it);
-    scanned_results->push_back(current_scanned_mesh);
-    cout << "scanned points:  " << current_scanned_mesh->vert.size() << endl;
+    scan_history->push_back((*scan_candidates)[i]);
+    scanned_results->push_back(view_meshes[i]);
   }
+
+  //keep the state a serial scan of the candidates would leave behind
+  pos = scan_candidates->back().first;
+  direction = scan_candidates->back().second;
+  computeUpAndRight();
+  current_scanned_mesh = view_meshes.back();
+  (*scan_count) += scan_candidates->size();
+  std::cout<<"scan count right after NBV scan: "<<*scan_count <<std::endl;
 }
 
 void vcc::Camera::runOneKeyNewScan()
@@ -210,24 +312,31 @@ void vcc::Camera::runOneKeyNewScan()
 }
 
 void vcc::Camera::computeUpAndRight()
+{
+  direction.Normalize();
+  computeUpAndRight(direction, up, right);
+}
+
+void vcc::Camera::computeUpAndRight(const Point3f& view_dir, Point3f& view_up, Point3f& view_right)
 {
   Point3f x_axis(1.0f, 0.0f, 0.0f);
   Point3f z_axis(0.0f, 0.0f, 1.0f);
 
-  Point3f viewray = direction.Normalize();
+  Point3f viewray = view_dir;
+  viewray.Normalize();
   if (viewray.Z() > 0)
   {
-    up = viewray ^ x_axis;
+    view_up = viewray ^ x_axis;
   }else if (fabs(viewray.Z()) < EPS_SUN)
   {
-    up = viewray ^ z_axis;
+    view_up = viewray ^ z_axis;
   }else
   {
-    up = x_axis ^ viewray;
+    view_up = x_axis ^ viewray;
   }
   //compute the right vector
-  right = viewray ^ up;
+  view_right = viewray ^ view_up;
 
-  up = up.Normalize();
-  right = right.Normalize();
+  view_up = view_up.Normalize();
+  view_right = view_right.Normalize();
 }
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 #include <iostream>
 #include <algorithm>
+#include <tbb/parallel_for.h>
+#include <tbb/tick_count.h>
 #include "GlobalFunction.h"
 #include "PointCloudAlgorithm.h"
+#include "MeshBVH.h"
 
 namespace vcc{
   using namespace std;
@@ -17,7 +20,7 @@ namespace vcc{
     }
 
     Camera(RichParameterSet* _para);
-    ~Camera(){target = NULL; current_scanned_mesh = NULL; scanned_results = NULL;}
+    ~Camera(){target = NULL; target_bvh = NULL; current_scanned_mesh = NULL; scanned_results = NULL;}
 
     void setInput(DataMgr* pData);
     void setParameterSet(RichParameterSet* _para){ para = _para;}
@@ -26,10 +29,17 @@ namespace vcc{
     void clear() {}
 
     void computeUpAndRight();
+    static void computeUpAndRight(const Point3f& view_dir, Point3f& view_up, Point3f& view_right);
+    //scan from one view into scanned_mesh, thread safe, the result only depends on the view and noise_seed
+    void virtualScan(const Point3f& view_pos, const Point3f& view_dir, CMesh* scanned_mesh, unsigned noise_seed) const;
+    //scan all views at once, view i goes to scanned_meshes[i] with noise seed first_seed + i
+    void virtualScanBatch(const vector<ScanCandidate>& views, vector<CMesh* >& scanned_meshes,
+                          unsigned first_seed, vector<double>* view_seconds = NULL) const;
 
   public:
     RichParameterSet*        para;
     CMesh*                   target;
+    MeshBVH*                 target_bvh;
     CMesh*                   original;
     vector<ScanCandidate>*   init_scan_candidates;//for initialization
     vector<ScanCandidate>*   scan_candidates;     
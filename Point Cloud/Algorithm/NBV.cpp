@@ -1,8 +1,171 @@
 #include "NBV.h"
+#include <atomic>
 
 typedef tbb::queuing_mutex CMEshMutexType;
 CMEshMutexType CMeshMutex;
 
+//what one propagation thread owns. visited_stamp[i] == stamp marks the grids already reached
+//from the current iso point, so nothing has to be cleared between iso points
+struct PropagateThreadState
+{
+  vector<unsigned int> visited_stamp;
+  unsigned int         stamp;
+
+  PropagateThreadState() : stamp(0) {}
+
+  void init(int n_grid)
+  {
+    visited_stamp.assign(n_grid, 0);
+    stamp = 0;
+  }
+
+  void nextStamp()
+  {
+    if (++stamp == 0)
+    {
+      std::fill(visited_stamp.begin(), visited_stamp.end(), 0);
+      stamp = 1;
+    }
+  }
+};
+
+//the values of the grids, one copy shared by all the propagation threads. best holds either
+//the best (confidence, iso point) packed into one integer, high word the float bits, low word
+//the inverted iso index so ties go to the lower index, kept with a compare-and-swap max, or a
+//fixed point confidence sum kept with an atomic add. both end at the same value in any order.
+//for incremental propagation second keeps the second best, from another iso point
+struct PropagateGrid
+{
+  vector<std::atomic<long long> > best;
+  vector<std::atomic<long long> > second;
+
+  void init(int n_grid, bool keep_second = false)
+  {
+    vector<std::atomic<long long> >(n_grid).swap(best);
+    vector<std::atomic<long long> >(keep_second ? n_grid : 0).swap(second);
+    for (int i = 0; i < n_grid; ++i)
+    {
+      best[i].store(0, std::memory_order_relaxed);
+      if (keep_second)  second[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  //an iso point reaches a grid once per trace, so every value put in is from another iso point.
+  //whatever best doesn't keep, or lets go of later, goes on to second, which ends up with the
+  //largest of them
+  void keepMax(int index, float confidence, int iso_index)
+  {
+    if (!(confidence > 0.0f))  return;
+    unsigned int bits;
+    memcpy(&bits, &confidence, sizeof(bits));
+    long long packed = withIsoIndex((long long)bits << 32, iso_index);
+    long long rest = atomicMax(best[index], packed);
+    if (!second.empty() && rest > 0)  atomicMax(second[index], rest);
+  }
+
+  void add(int index, double confidence)
+  {
+    best[index].fetch_add((long long)(confidence * FIXED_POINT_SCALE), std::memory_order_relaxed);
+  }
+
+  //returns the value that lost, the one held before or packed itself
+  static long long atomicMax(std::atomic<long long>& target, long long packed)
+  {
+    long long current = target.load(std::memory_order_relaxed);
+    while (packed > current)
+    {
+      if (target.compare_exchange_weak(current, packed, std::memory_order_relaxed))  return current;
+    }
+    return packed;
+  }
+
+  //the same for one thread, to merge with the values kept from the last propagation
+  static void keepTwo(long long& best, long long& second, long long packed)
+  {
+    if (packed <= 0)  return;
+    if (packed > best)
+    {
+      second = best;
+      best = packed;
+    }
+    else if (packed > second)
+    {
+      second = packed;
+    }
+  }
+
+  static float unpackMax(long long packed, int& iso_index)
+  {
+    unsigned int bits = (unsigned int)(packed >> 32);
+    iso_index = (int)(0xFFFFFFFFu - (unsigned int)(packed & 0xFFFFFFFF));
+    float confidence;
+    memcpy(&confidence, &bits, sizeof(confidence));
+    return confidence;
+  }
+
+  static int unpackIsoIndex(long long packed)
+  {
+    return (int)(0xFFFFFFFFu - (unsigned int)(packed & 0xFFFFFFFF));
+  }
+
+  //the same confidence for another iso point
+  static long long withIsoIndex(long long packed, int iso_index)
+  {
+    return (packed & ~0xFFFFFFFFLL) | (0xFFFFFFFFu - (unsigned int)iso_index);
+  }
+
+  static float unpackSum(long long sum)
+  {
+    return sum / FIXED_POINT_SCALE;
+  }
+
+  static const double FIXED_POINT_SCALE;
+};
+const double PropagateGrid::FIXED_POINT_SCALE = 4294967296.0; //2^32
+
+const double PropagationCache::MAX_UNCERTAIN_FRACTION = 0.01;
+
+bool PropagationCache::isValidFor(const VoxelGrid& grid, const vector<double>& _settings) const
+{
+  if (best.size() != grid.size() || settings != _settings)
+    return false;
+  //unless buildGrid() kept it, a sparse grid follows the iso points, its cells may be stored elsewhere now
+  if (brick_slots != grid.getBrickSlots())
+    return false;
+  //too many grids may be lower than a full trace would make them
+  if (uncertain_cells > reached_cells * MAX_UNCERTAIN_FRACTION)
+    return false;
+
+  for (int i = 0; i < grid.size(); ++i)
+  {
+    if (ray_stop[i] != grid.flag(VoxelGrid::RAY_STOP, i))  return false;
+  }
+  return true;
+}
+
+void PropagationCache::remember(const VoxelGrid& grid, const vector<double>& _settings)
+{
+  settings = _settings;
+  brick_slots = grid.getBrickSlots();
+  ray_stop.resize(grid.size());
+  for (int i = 0; i < grid.size(); ++i)
+    ray_stop[i] = grid.flag(VoxelGrid::RAY_STOP, i);
+}
+
+void PropagationCache::clear()
+{
+  uncertain_cells = reached_cells = 0;
+  vector<long long>().swap(best);
+  vector<long long>().swap(second);
+  vector<char>().swap(unknown);
+  positions.clear();
+  normals.clear();
+  confidences.clear();
+  settings.clear();
+  vector<int>().swap(brick_slots);
+  vector<bool>().swap(ray_stop);
+}
+
 NBV::NBV(RichParameterSet *_para)
 {
   cout<<"NBV constructed!"<<endl;
@@ -10,6 +173,7 @@ NBV::NBV(RichParameterSet *_para)
   original = NULL;
   iso_points = NULL;
   field_points = NULL;
+  neighbor_search = NULL;
 }
 
 NBV::~NBV()
@@ -172,6 +336,7 @@ void NBV::setInput(DataMgr *pData)
     //model = _model;
     original = _original;
     field_points = pData->getCurrentFieldPoints();
+    neighbor_search = pData->getNeighborSearch();
   }else
   {
     cout<<"ERROR: NBV::setInput empty!"<<endl;
@@ -201,8 +366,6 @@ void NBV::buildGrid()
     return ;
   }
 
-  GlobalFun::clearCMesh(*view_grid_points);
-
   bool use_grid_segment = para->getBool("Run Grid Segment");
   //fix: this should be model->bbox.max
   Point3f bbox_max = iso_points->bbox.max;
@@ -232,120 +395,218 @@ void NBV::buildGrid()
   int all_max = std::max(std::max(x_max, y_max), z_max);
   x_max = y_max =z_max = all_max+1; // wsh 12-11
 
-  //preallocate the memory
-  int max_index = x_max * y_max * z_max;
-  view_grid_points->vert.resize(max_index);
-  //increase from whole_space_box_min
-  for (int i = 0; i < x_max; ++i)
+  //incremental propagation remembers its values per cell, so the cells are kept where they are
+  //as long as the space and the step stay the same. only the values and the flags are reset
+  bool use_sparse_grid = para->getBool("Use Sparse View Grid") && !iso_points->vert.empty();
+  bool keep_grid = para->getBool("Run Incremental Propagation") && !view_grid_points->empty()
+    && view_grid_points->getKind() == VoxelGrid::VIEW_GRID && view_grid_points->isSparse() == use_sparse_grid
+    && view_grid_points->getOrigin() == whole_space_box_min && view_grid_points->getStep() == float(grid_step_size);
+
+  //grid (i, j, k) is at whole_space_box_min + grid_step_size * (i, j, k)
+  if (use_sparse_grid)
   {
-    for (int j = 0; j < y_max; ++j)
+    //only the bricks a propagated ray can get to, those closer to an iso point than the longest ray.
+    //a brick is kept when the ball around its center that holds its cells gets that close
+    int max_steps = static_cast<int>(camera_max_dist / grid_step_size);
+    max_steps *= para->getDouble("Max Ray Steps Para");
+    double max_ray_dist = (max_steps + 2) * grid_step_size * sqrt(3.0);
+    double brick_radius = (VoxelGrid::BRICK_SIZE - 1) * grid_step_size * sqrt(3.0) / 2;
+    double keep_dist = max_ray_dist + brick_radius;
+
+    int brick_x = VoxelGrid::bricks(x_max), brick_y = VoxelGrid::bricks(y_max), brick_z = VoxelGrid::bricks(z_max);
+    vector<char> keep_bricks(brick_x * brick_y * brick_z, 0);
+    const PointKdTree *kd_tree = neighbor_search->getTree(iso_points);
+    auto selectBricks = [&](int begin, int end)
     {
-      for (int k = 0; k < z_max; ++k)
+      int   nn_idx;
+      float dist2;
+      for (int b = begin; b < end; ++b)
       {
-        //add the grid
-        int index = i * y_max * z_max + j * z_max + k;
-        //add the center point of the grid
-        CVertex t;
-        t.P()[0] = whole_space_box_min.X() + i * grid_step_size;
-        t.P()[1] = whole_space_box_min.Y() + j * grid_step_size;
-        t.P()[2] = whole_space_box_min.Z() + k * grid_step_size;
-        t.m_index = index;
-        t.is_view_grid = true;
-        view_grid_points->vert[index] = t;
-        view_grid_points->bbox.Add(t.P());
+        int bi = b / (brick_y * brick_z), bj = b / brick_z % brick_y, bk = b % brick_z;
+        Point3f center = whole_space_box_min + Point3f(bi, bj, bk) * (VoxelGrid::BRICK_SIZE * grid_step_size)
+          + Point3f(1, 1, 1) * ((VoxelGrid::BRICK_SIZE - 1) * grid_step_size / 2);
+        kd_tree->knn(center, 1, &nn_idx, &dist2);
+        keep_bricks[b] = dist2 <= keep_dist * keep_dist;
       }
+    };
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, keep_bricks.size()), 
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      selectBricks(r.begin(), r.end());
+    });
+#else
+    selectBricks(0, keep_bricks.size());
+#endif
+
+    //a kept sparse grid has to hold every brick the rays can get to now, the extra ones stay empty
+    for (int b = 0; keep_grid && b < keep_bricks.size(); ++b)
+    {
+      if (keep_bricks[b] && view_grid_points->getBrickSlots()[b] < 0)  keep_grid = false;
     }
+    if (keep_grid)
+      view_grid_points->reset();
+    else
+      view_grid_points->resizeSparse(VoxelGrid::VIEW_GRID, whole_space_box_min, grid_step_size, x_max, y_max, z_max, keep_bricks);
+    x_max = view_grid_points->resX();
+    y_max = view_grid_points->resY();
+    z_max = view_grid_points->resZ();
+  }
+  else if (keep_grid)
+  {
+    view_grid_points->reset();
   }
-  view_grid_points->vn = max_index;
+  else
+  {
+    view_grid_points->resize(VoxelGrid::VIEW_GRID, whole_space_box_min, grid_step_size, x_max, y_max, z_max);
+  }
+  int max_index = view_grid_points->size();
   cout << "all grid points: " << max_index << endl;
   cout << "resolution: " << x_max << endl;
 
   bool test_field_segment = para->getBool("Test Other Inside Segment");
-  if (field_points->vert.empty())
+  bool use_distance_transform = para->getBool("Use Distance Transform Segment");
+  if (field_points->empty())
   {
     test_field_segment = false;
     cout << "field points empty" << endl;
   }
+  if (use_distance_transform && view_grid_points->isSparse())
+  {
+    use_distance_transform = false;
+    cout << "distance transform segment needs a dense view grid, using the kd-tree" << endl;
+  }
   //distinguish the inside or outside grid
 
   Timer timer;
-  timer.start("compute ANN");
+  timer.start("compute nearest iso point");
   if (test_field_segment)
   {
-    GlobalFun::computeAnnNeigbhors(field_points->vert, view_grid_points->vert, 1, false, "runGridNearestIsoPoint");
-  }
-  else
-  {
-    GlobalFun::computeAnnNeigbhors(iso_points->vert, view_grid_points->vert, 1, false, "runGridNearestIsoPoint");
+    //the field is a grid as well, its nearest cell is found directly
+    for (int i = 0; i < max_index; ++i)
+    {
+      int nearest = field_points->nearestCell(view_grid_points->position(i));
+      if (nearest >= 0 && field_points->confidence(nearest) > 0)
+      {
+        view_grid_points->setFlag(VoxelGrid::RAY_STOP, i, true);
+      }
+    }
   }
-  timer.end();
-
-  double grid_step_size2 = grid_step_size * grid_step_size;
-  for (int i = 0; i < view_grid_points->vert.size(); ++i)
+  else if (!iso_points->vert.empty())
   {
-    Point3f &t = view_grid_points->vert[i].P();
-    if (!view_grid_points->vert[i].neighbors.empty())
+    //a grid point stops rays if it is behind the surface at its nearest iso point, and close to it
+    double grid_step_size2 = grid_step_size * grid_step_size;
+    auto isRayStop = [&](const Point3f& t, const CVertex& nearest)
+    {
+      Point3f l = t - nearest.P();
+      return nearest.N() * l < 0.0f && l.SquaredNorm() < grid_step_size2 * 4;
+    };
+
+    //both ways take the nearest iso point of a cell. computeAnnNeigbhors(iso_points, grids, 1), used
+    //before, dropped the first hit as if the grid points were iso points, and so took the second nearest
+    vector<int> seed_start, seed_iso, nearest_seed;
+    const PointKdTree *kd_tree = NULL;
+    if (use_distance_transform)
     {
-      if (test_field_segment)
+      //every iso point is rasterized into its nearest cell, the seeds of a cell are its iso points
+      //(by index), and the feature transform gives every cell the nearest seed cell. the cell then
+      //takes the nearest of the iso points in the 3x3x3 cells around that one. the nearest seed cell
+      //is only nearest at cell resolution, the ring catches most of the iso points it misses
+      int n_iso = iso_points->vert.size();
+      vector<int> iso_cell(n_iso);
+      seed_start.assign(max_index + 1, 0);
+      for (int i = 0; i < n_iso; ++i)
       {
-        CVertex &nearest = field_points->vert[view_grid_points->vert[i].neighbors[0]];
-        if (nearest.eigen_confidence > 0)
-        {
-          view_grid_points->vert[i].is_ray_stop = true; 
-        }
+        iso_cell[i] = view_grid_points->nearestCell(iso_points->vert[i].P());
+        if (iso_cell[i] >= 0) seed_start[iso_cell[i] + 1]++;
       }
-      else
+      for (int c = 0; c < max_index; ++c)
+        seed_start[c + 1] += seed_start[c];
+      seed_iso.resize(seed_start[max_index]);
+      vector<int> fill(seed_start.begin(), seed_start.end() - 1);
+      for (int i = 0; i < n_iso; ++i)
       {
-        CVertex &nearest = iso_points->vert[view_grid_points->vert[i].neighbors[0]];
-        Point3f &v = nearest.P();
-        double dist2 = GlobalFun::computeEulerDistSquare(t, v);
-        Point3f n = nearest.N();
-        Point3f l = view_grid_points->vert[i].P() - nearest.P();
-        if (n * l < 0.0f && dist2 < grid_step_size2 * 4)
-        {
-          view_grid_points->vert[i].is_ray_stop = true; 
-        }  
+        if (iso_cell[i] >= 0) seed_iso[fill[iso_cell[i]]++] = i;
+      }
+
+      nearest_seed.assign(max_index, -1);
+      for (int c = 0; c < max_index; ++c)
+      {
+        if (seed_start[c + 1] > seed_start[c]) nearest_seed[c] = c;
       }
+      view_grid_points->featureTransform(nearest_seed);
+    }
+    else
+    {
+      kd_tree = neighbor_search->getTree(iso_points);
     }
-  }
 
-  for (int i = 0; i < view_grid_points->vert.size(); ++i)
-  {
-    Point3f &t = view_grid_points->vert[i].P();
-    if (!view_grid_points->vert[i].neighbors.empty())
+    //cells of one flag word go to the same thread
+    auto segment = [&](int word_begin, int word_end)
     {
-      if (test_field_segment)
+      int   nn_idx;
+      float dist2;
+      int end = std::min(word_end * 32, max_index);
+      for (int i = word_begin * 32; i < end; ++i)
       {
-        CVertex &nearest = field_points->vert[view_grid_points->vert[i].neighbors[0]];
-        if (nearest.eigen_confidence > 0)
+        Point3f t = view_grid_points->position(i);
+        int nearest = -1;
+        if (use_distance_transform)
+        {
+          int seed = nearest_seed[i];
+          int si = 0, sj = 0, sk = 0;
+          if (seed >= 0) view_grid_points->coords(seed, si, sj, sk);
+          double nearest_dist2 = 0;
+          for (int c = 0; seed >= 0 && c < 27; ++c)
+          {
+            int ci = si + c / 9 - 1, cj = sj + c / 3 % 3 - 1, ck = sk + c % 3 - 1;
+            int cell = view_grid_points->isInside(ci, cj, ck) ? view_grid_points->index(ci, cj, ck) : -1;
+            if (cell < 0) continue;
+
+            for (int s = seed_start[cell]; s < seed_start[cell + 1]; ++s)
+            {
+              double d2 = GlobalFun::computeEulerDistSquare(t, iso_points->vert[seed_iso[s]].P());
+              if (nearest < 0 || d2 < nearest_dist2 || (d2 == nearest_dist2 && seed_iso[s] < nearest))
+              {
+                nearest = seed_iso[s];
+                nearest_dist2 = d2;
+              }
+            }
+          }
+        }
+        else
         {
-          view_grid_points->vert[i].is_ray_stop = true; 
+          kd_tree->knn(t, 1, &nn_idx, &dist2);
+          nearest = nn_idx;
         }
-      }
-      else
-      {
-        CVertex &nearest = iso_points->vert[view_grid_points->vert[i].neighbors[0]];
-        Point3f &v = nearest.P();
-        double dist = GlobalFun::computeEulerDist(t, v);
-        Point3f n = nearest.N();
-        Point3f l = view_grid_points->vert[i].P() - nearest.P();
-        if ((n * l < 0.0f && dist < grid_step_size * 2)
-          /*|| (test_other_segment && dist < grid_step_size / 2)*/) //wsh change
+
+        if (nearest >= 0 && isRayStop(t, iso_points->vert[nearest]))
         {
-          view_grid_points->vert[i].is_ray_stop = true; 
-        }  
+          view_grid_points->setFlag(VoxelGrid::RAY_STOP, i, true);
+        }
       }
-    }
+    };
+
+    int n_words = (max_index + 31) / 32;
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n_words), 
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      segment(r.begin(), r.end());
+    });
+#else
+    segment(0, n_words);
+#endif
   }
+  timer.end();
+
   if (use_grid_segment)
   {
-    for (int i = 0; i < view_grid_points->vert.size(); ++i)
+    for (int i = 0; i < max_index; ++i)
     {
-      CVertex &t = view_grid_points->vert[i];
-
-      if (!t.is_ray_stop)
+      if (!view_grid_points->flag(VoxelGrid::RAY_STOP, i))
       {
-        t.is_ignore = true;
+        view_grid_points->setFlag(VoxelGrid::IGNORED, i, true);
       }
     }
   }
@@ -365,12 +626,11 @@ void NBV::propagate()
 
   if (view_grid_points)
   {
-    for (int i = 0; i < view_grid_points->vert.size(); i++)
+    for (int i = 0; i < view_grid_points->size(); i++)
     {
-      CVertex& t = view_grid_points->vert[i];
-      t.eigen_confidence = 0.0;
-      t.N() = Point3f(0., 0., 0.);
-      t.weight_sum = 0.0;
+      view_grid_points->confidence(i) = 0.0;
+      view_grid_points->setNormal(i, Point3f(0., 0., 0.));
+      view_grid_points->setIsoIndex(i, 0);
     }
   }
   if (nbv_candidates) 
@@ -413,249 +673,259 @@ void NBV::propagate()
   double angle_delta = (grid_step_size * ray_resolution_para) / camera_max_dist;
   cout << "Angle Delta/resolution:  " << angle_delta << " , " << PI / angle_delta << endl;
 
-#ifdef LINKED_WITH_TBB
-  //tbb::mutex _mutex;
-  tbb::parallel_for(tbb::blocked_range<size_t>(0, iso_points_size), 
-    [&](const tbb::blocked_range<size_t>& r)
-  {
-    for (size_t i = r.begin(); i < r.end(); ++i)
-    {
-      vector<int> hit_grid_indexes;
-      CVertex &v = iso_points->vert[i];
-
-      if (use_propagate_one_point && v.m_index != target_index)
-        continue;
+  //the threads only keep their own visited stamps, the values go to one shared grid.
+  //nothing in view_grid_points is written while tracing
+  int n_grid = view_grid_points->size();
+  PropagateGrid grid_values;
 
-      v.is_ray_hit = true;
-      //get the x,y,z index of each iso_points
-      int t_indexX = static_cast<int>( ceil((v.P()[0] - whole_space_box_min.X()) / grid_step_size ));
-      int t_indexY = static_cast<int>( ceil((v.P()[1] - whole_space_box_min.Y()) / grid_step_size ));
-      int t_indexZ = static_cast<int>( ceil((v.P()[2] - whole_space_box_min.Z()) / grid_step_size ));
-      //next point index along the ray, pay attention , index should be stored in double ,used in integer
-      double n_indexX, n_indexY, n_indexZ;
-      //compute the delta of a,b so as to traverse the whole sphere
-      //loop for a, b
-      double a = 0.0f, b = 0.0f;
-      double l = 0.0f;
-      double x = 0.0f, y = 0.f, z = 0.0f;
-      //for DDA algorithm
-      double length = 0.0f;
-      double deltaX, deltaY, deltaZ;
-      //1. for each point, propagate to all discrete directions
-      for (a = 0.0f; a < PI; a += angle_delta)
-      {
-        l = sin(a); y = cos(a);
-        for (b = 0.0f; b < 2 * PI; b += angle_delta)
-        {
-          //now the propagate direction is Point3f(x, y, z)
-          x = l * cos(b); z = l * sin(b);
-          //reset the next grid indexes
-          n_indexX = t_indexX; n_indexY = t_indexY; n_indexZ = t_indexZ;
-          //2. compute the next grid indexes
-          length = GlobalFun::getAbsMax(x, y, z);
-          deltaX = x / length; 
-          deltaY = y / length;
-          deltaZ = z / length;
-
-          for (int k = 0; k <= max_steps; ++k)     
-          {
-            n_indexX = n_indexX + deltaX;
-            n_indexY = n_indexY + deltaY;
-            n_indexZ = n_indexZ + deltaZ;
-            int index = round(n_indexX) * y_max * z_max + round(n_indexY) * z_max + round(n_indexZ);
-
-            if (index >= view_grid_points->vert.size())  break;
-            //if the direction is into the model, or has been hit, then stop tracing
-            if (view_grid_points->vert[index].is_ray_stop) break;            
-            if (view_grid_points->vert[index].is_ray_hit)  continue;
-
-            //_mutex.lock();
-            //if the grid get first hit 
-            view_grid_points->vert[index].is_ray_hit = true;
-            //1. set the confidence of the grid center
-            CVertex& t = view_grid_points->vert[index];
-            Point3f diff = t.P() - v.P();
-            double dist2 = diff.SquaredNorm();
-            double dist = sqrt(dist2);
-
-            Point3f view_direction = diff.Normalize();
-            double opt_dist = dist - optimal_D;
-            double coefficient1 = exp(opt_dist * opt_dist * gaussian_term);
-            double coefficient2 = exp(-pow(1-v.N() * view_direction, 2) / sigma_threshold);
-
-            float iso_confidence = 1 - v.eigen_confidence;     
-            float confidence_weight = coefficient1 * coefficient2;
-
-            if (use_max_propagation)
-            {
-              //t.eigen_confidence = (std::max)(float(t.eigen_confidence), float(confidence_weight * iso_confidence));          
-              if (confidence_weight * iso_confidence > t.eigen_confidence)
-              {
-                t.eigen_confidence = confidence_weight * iso_confidence;
-                t.N() = (v.P()-t.P()).Normalize();
-                t.remember_iso_index = v.m_index;
-              }
-            }
-            else
-            {
-              t.eigen_confidence += coefficient1 * iso_confidence;      
-            }
-
-            // record hit_grid center index
-            hit_grid_indexes.push_back(index);                        
-          }//end for k
-        }// end for b
-      }//end for a
-
-      if (hit_grid_indexes.size() > 0)
-      {
-        setGridUnHit(hit_grid_indexes);
-        hit_grid_indexes.clear();
-      }
-
-      if (use_propagate_one_point)  break;
-    }//end for iso_points
+  //directions and exp() weights are tabulated once, the tracing only does lookups
+  ray_directions.build(angle_delta);
+  double max_ray_dist = (max_steps + 2) * grid_step_size * sqrt(3.0);
+  WeightTable dist_weights, angle_weights;
+  dist_weights.build(0.0, max_ray_dist, 4096, [&](double dist)
+  {
+    double opt_dist = dist - optimal_D;
+    return exp(opt_dist * opt_dist * gaussian_term);
   });
-#else
-  for (int i = 0 ;i < iso_points->vert.size(); ++i)//fix: < iso_points->vert.size()    
+  angle_weights.build(-1.0, 1.0, 2048, [&](double cos_angle)
   {
-    //    cout << "index" << i << endl;
-    vector<int> hit_grid_indexes;
+    return exp(-pow(1 - cos_angle, 2) / sigma_threshold);
+  });
 
+  auto propagateIsoPoint = [&](int i, PropagateThreadState& state)
+  {
     CVertex &v = iso_points->vert[i];
-    //t is the ray_start_point
     v.is_ray_hit = true;
-    //ray_hit_nbv_grids->vert.push_back(v);
-
-    //get the x,y,z index of each iso_points
-    int t_indexX = static_cast<int>( ceil((v.P()[0] - whole_space_box_min.X()) / grid_step_size ));
-    int t_indexY = static_cast<int>( ceil((v.P()[1] - whole_space_box_min.Y()) / grid_step_size ));
-    int t_indexZ = static_cast<int>( ceil((v.P()[2] - whole_space_box_min.Z()) / grid_step_size ));
-    //next point index along the ray, pay attention , index should be stored in double ,used in integer
-    double n_indexX, n_indexY, n_indexZ;
-
-    //loop for a, b
-    double a = 0.0f, b = 0.0f;
-    double l = 0.0f;
-    double x = 0.0f, y = 0.f, z = 0.0f;
-    //for DDA algorithm
-    //int stepX = 0, stepY = 0, stepZ = 0;
-
-    double length = 0.0f;
-    double deltaX, deltaY, deltaZ;
-
-    //double half_D = optimal_D / 2.0f;
-    double optimal_D = (n_dist + f_dist) / 2.0f;
-    double half_D = optimal_D / 2.0f; //wsh    
-    double half_D2 = half_D * half_D;
-    //for debug
-
-    double sigma = global_paraMgr.norSmooth.getDouble("Sharpe Feature Bandwidth Sigma");
-    double sigma_threshold = pow(max(1e-8, 1-cos(sigma/180.0*3.1415926)), 2);
+    state.nextStamp();
 
+    float iso_confidence = 1 - v.eigen_confidence;     
     //1. for each point, propagate to all discrete directions
-    for (a = 0.0f; a < PI; a += angle_delta)
+    for (int d = 0; d < ray_directions.size(); ++d)
     {
-      l = sin(a); y = cos(a);
-      for (b = 0.0f; b < 2 * PI; b += angle_delta)
+      const Point3f& direction = ray_directions[d];
+      //as far as max_steps + 1 grids along the major axis of the direction
+      double reach = (max_steps + 1) * grid_step_size / GlobalFun::getAbsMax(direction[0], direction[1], direction[2]);
+
+      //2. walk the grids along the ray, the grid of the iso point itself is skipped
+      VoxelRay ray(*view_grid_points, v.P(), direction, reach);
+      while (ray.next())
       {
-        //now the propagate direction is Point3f(x, y, z)
-        x = l * cos(b); z = l * sin(b);
-        //reset the next grid indexes
-        n_indexX = t_indexX; n_indexY = t_indexY; n_indexZ = t_indexZ;
-        //2. compute the next grid indexes
-        length = GlobalFun::getAbsMax(x, y, z);
-        deltaX = x / length; 
-        deltaY = y / length;
-        deltaZ = z / length;
-
-        //int hit_stop_time = 0;
-        for (int k = 0; k <= max_steps; ++k)
-          //for (int k = 0; k <= 100000; ++k)
-          //while (1)        
-        {
-          n_indexX = n_indexX + deltaX;
-          n_indexY = n_indexY + deltaY;
-          n_indexZ = n_indexZ + deltaZ;
-          int index = round(n_indexX) * y_max * z_max + round(n_indexY) * z_max + round(n_indexZ);
+        int index = ray.index();
+        //if the direction is into the model, or has been hit, then stop tracing
+        if (view_grid_points->flag(VoxelGrid::RAY_STOP, index)) break;            
+        if (state.visited_stamp[index] == state.stamp)  continue;
+        state.visited_stamp[index] = state.stamp;
 
-          if (index >= view_grid_points->vert.size())
-          {
-            break;
-          }
-          //if the direction is into the model, or has been hit, then stop tracing
-          if (view_grid_points->vert[index].is_ray_stop)
-          {
-            break;
-          }
+        //3. set the confidence of the grid center
+        Point3f diff = view_grid_points->position(index) - v.P();
+        double dist = diff.Norm();
+        if (dist < EPS_SUN)  continue;
 
-          if (view_grid_points->vert[index].is_ray_hit)  continue;
+        double coefficient1 = dist_weights.lookup(dist);
+        double coefficient2 = angle_weights.lookup(v.N() * diff / dist);
 
-          //if the grid get first hit 
-          view_grid_points->vert[index].is_ray_hit = true;
-          //1. set the confidence of the grid center
-          CVertex& t = view_grid_points->vert[index];
-          //double dist = GlobalFun::computeEulerDist(v.P(), t.P());
-          Point3f diff = t.P() - v.P();
-          double dist2 = diff.SquaredNorm();
-          double dist = sqrt(dist2);
+        float confidence_weight = coefficient1 * coefficient2;
 
-          Point3f view_direction = diff.Normalize();
-          double opt_dist = dist - optimal_D;
-          double coefficient1 = exp(opt_dist * opt_dist * gaussian_term);
-          double coefficient2 = exp(-pow(1-v.N()*view_direction, 2)/sigma_threshold);
+        if (use_max_propagation)
+          grid_values.keepMax(index, confidence_weight * iso_confidence, i);
+        else
+          grid_values.add(index, coefficient1 * iso_confidence);
+      }
+    }
+  };
 
-          float iso_confidence = 1 - v.eigen_confidence;
-          float view_weight = iso_confidence * coefficient2;   
-          float confidence_weight = coefficient1 * coefficient2;
+  int iso_begin = 0, iso_end = iso_points_size;
+  if (use_propagate_one_point)
+  {
+    for (iso_begin = 0; iso_begin < iso_points_size; ++iso_begin)
+      if (iso_points->vert[iso_begin].m_index == target_index)  break;
+    iso_end = std::min(iso_begin + 1, iso_points_size);
+  }
 
-          if (use_max_propagation)
-          {
-            //t.eigen_confidence = (std::max)(float(t.eigen_confidence), float(confidence_weight * iso_confidence));          
-            if (confidence_weight * iso_confidence > t.eigen_confidence)
-            {
-              t.eigen_confidence = confidence_weight * iso_confidence;
-              t.N() = (v.P()-t.P()).Normalize();
-              t.remember_iso_index = v.m_index;
-            }
-          }
-          else
-          {
-            //t.eigen_confidence += coefficient1 * iso_confidence;
-            t.eigen_confidence += coefficient1 * 1.0;
-          }
-          // record hit_grid center index
-          hit_grid_indexes.push_back(index);
-        }//end for k
-      }// end for b
-    }//end for a
+  //incremental: the maxima of the last propagation are kept, grids whose best came from an iso
+  //point that changed fall back to their second best, and only the changed points are traced again
+  bool use_incremental = para->getBool("Run Incremental Propagation") && use_max_propagation && !use_propagate_one_point;
+  double position_tolerance = para->getDouble("Incremental Position Tolerance") * grid_step_size;
+  double cos_normal_tolerance = cos(para->getDouble("Incremental Normal Tolerance") / 180.0 * 3.1415926);
+  double confidence_tolerance = para->getDouble("Incremental Confidence Tolerance");
+  vector<double> settings;
+  settings.push_back(max_steps);
+  settings.push_back(angle_delta);
+  settings.push_back(optimal_D);
+  settings.push_back(gaussian_term);
+  settings.push_back(sigma_threshold);
+
+  bool incremental = use_incremental && propagation_cache.isValidFor(*view_grid_points, settings);
+  //the poisson reconstruction regenerates the iso points in another order, so they are matched to the
+  //cached ones by position, one to one, in the order of the new points. matched[i] is the cached point
+  //of iso point i, renumber takes a cached point to its new index, -1 for those that changed or are gone
+  vector<int> matched(iso_points_size, -1);
+  vector<int> renumber;
+  if (incremental)
+  {
+    PointKdTree cached_tree;
+    cached_tree.build(propagation_cache.positions);
+    renumber.assign(propagation_cache.positions.size(), -1);
+    for (int i = iso_begin; i < iso_end; ++i)
+    {
+      CVertex& v = iso_points->vert[i];
+      int   nn_idx;
+      float dist2;
+      if (cached_tree.knn(v.P(), 1, &nn_idx, &dist2) == 0 || renumber[nn_idx] >= 0)  continue;
+      bool moved = sqrt(dist2) > position_tolerance;
+      bool turned = v.N() * propagation_cache.normals[nn_idx] < cos_normal_tolerance;
+      bool reweighted = fabs(v.eigen_confidence - propagation_cache.confidences[nn_idx]) > confidence_tolerance;
+      if (moved || turned || reweighted)  continue;
+      matched[i] = nn_idx;
+      renumber[nn_idx] = i;
+    }
+  }
+  vector<int> trace_points;
+  for (int i = iso_begin; i < iso_end; ++i)
+  {
+    if (matched[i] < 0)  trace_points.push_back(i);
+  }
+  if (incremental)
+    cout << "incremental propagation, trace " << trace_points.size() << " of " << iso_points_size << " iso points" << endl;
+
+  int n_traces = trace_points.size();
+  grid_values.init(n_grid, use_incremental);
+#ifdef LINKED_WITH_TBB
+  tbb::enumerable_thread_specific<PropagateThreadState> states;
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n_traces), 
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    PropagateThreadState& state = states.local();
+    if (state.visited_stamp.empty())  state.init(n_grid);
+
+    for (size_t i = r.begin(); i < r.end(); ++i)
+      propagateIsoPoint(trace_points[i], state);
+  });
+#else
+  PropagateThreadState serial_state;
+  serial_state.init(n_grid);
+  for (int i = 0; i < n_traces; ++i)
+    propagateIsoPoint(trace_points[i], serial_state);
+#endif
+
+  if (use_incremental && !incremental)
+  {
+    propagation_cache.best.assign(n_grid, 0);
+    propagation_cache.second.assign(n_grid, 0);
+    propagation_cache.unknown.assign(n_grid, 0);
+  }
 
-    if (hit_grid_indexes.size() > 0)
+  //write the shared grid back. max and integer sums don't depend on the order,
+  //so the result is the same at any thread count
+  auto reduceGrid = [&](int index)
+  {
+    long long best = 0;
+    if (use_incremental)
     {
-      setGridUnHit(hit_grid_indexes);
-      hit_grid_indexes.clear();
+      //the changed iso points are taken out first, they come back with what is traced again
+      long long second = 0;
+      char unknown = 0;
+      if (incremental)
+      {
+        best = propagation_cache.best[index];
+        second = propagation_cache.second[index];
+        unknown = propagation_cache.unknown[index];
+        int second_iso = second > 0 ? renumber[PropagateGrid::unpackIsoIndex(second)] : -1;
+        int best_iso = best > 0 ? renumber[PropagateGrid::unpackIsoIndex(best)] : -1;
+        if (second > 0 && second_iso < 0)
+        {
+          second = 0;
+          unknown |= PropagationCache::SECOND_UNKNOWN;
+        }
+        else if (second > 0)
+        {
+          second = PropagateGrid::withIsoIndex(second, second_iso);
+        }
+        if (best > 0 && best_iso < 0)
+        {
+          //without a known second, an iso point that wasn't traced again may be above the new best
+          if (unknown & PropagationCache::SECOND_UNKNOWN)  unknown |= PropagationCache::BEST_UNKNOWN;
+          if (second > 0)  unknown |= PropagationCache::SECOND_UNKNOWN;
+          best = second;
+          second = 0;
+        }
+        else if (best > 0)
+        {
+          best = PropagateGrid::withIsoIndex(best, best_iso);
+        }
+        //equal confidences go to the lower index, which may be the other one now
+        if (second > best)  std::swap(best, second);
+      }
+      PropagateGrid::keepTwo(best, second, grid_values.best[index].load(std::memory_order_relaxed));
+      PropagateGrid::keepTwo(best, second, grid_values.second[index].load(std::memory_order_relaxed));
+      propagation_cache.best[index] = best;
+      propagation_cache.second[index] = second;
+      propagation_cache.unknown[index] = unknown;
+    }
+    else
+    {
+      best = grid_values.best[index].load(std::memory_order_relaxed);
     }
 
-    if (use_propagate_one_point)
+    if (use_max_propagation)
+    {
+      if (best <= 0)  return;
+      int iso_index = 0;
+      view_grid_points->confidence(index) = PropagateGrid::unpackMax(best, iso_index);
+      CVertex& v = iso_points->vert[iso_index];
+      view_grid_points->setNormal(index, (v.P() - view_grid_points->position(index)).Normalize());
+      view_grid_points->setIsoIndex(index, v.m_index);
+    }
+    else
     {
-      break;
+      view_grid_points->confidence(index) = PropagateGrid::unpackSum(best);
     }
-  }//end for iso_points
+  };
+
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n_grid), 
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    for (size_t i = r.begin(); i < r.end(); ++i)
+      reduceGrid(i);
+  });
+#else
+  for (int i = 0; i < n_grid; ++i)
+    reduceGrid(i);
 #endif
 
-  GlobalFun::normalizeConfidence(view_grid_points->vert, 0.);
-}
+  if (use_incremental)
+  {
+    propagation_cache.remember(*view_grid_points, settings);
+    propagation_cache.uncertain_cells = propagation_cache.reached_cells = 0;
+    for (int i = 0; i < n_grid; ++i)
+    {
+      if (propagation_cache.unknown[i] & PropagationCache::BEST_UNKNOWN)  propagation_cache.uncertain_cells++;
+      if (propagation_cache.best[i] > 0)  propagation_cache.reached_cells++;
+    }
 
-int NBV::round(double x)
-{
-  return static_cast<int>(x + 0.5);
-}
+    //the traced points are remembered as they were traced, the matched ones as they were when they
+    //were traced last, so changes below the tolerance can't add up
+    vector<Point3f> positions(iso_points_size), normals(iso_points_size);
+    vector<float> confidences(iso_points_size);
+    for (int i = 0; i < iso_points_size; ++i)
+    {
+      CVertex& v = iso_points->vert[i];
+      int m = matched[i];
+      positions[i] = m >= 0 ? propagation_cache.positions[m] : v.P();
+      normals[i] = m >= 0 ? propagation_cache.normals[m] : v.N();
+      confidences[i] = m >= 0 ? propagation_cache.confidences[m] : v.eigen_confidence;
+    }
+    propagation_cache.positions.swap(positions);
+    propagation_cache.normals.swap(normals);
+    propagation_cache.confidences.swap(confidences);
+  }
+  else
+  {
+    propagation_cache.clear();
+  }
 
-void NBV::setGridUnHit(vector<int>& hit_grids_idx)
-{
-  vector<int>::iterator it;
-  for (it = hit_grids_idx.begin(); it != hit_grids_idx.end(); ++it)
-    view_grid_points->vert[*it].is_ray_hit = false;
+  view_grid_points->normalizeConfidence(0.);
 }
 
 void NBV::viewExtraction()
@@ -664,11 +934,11 @@ void NBV::viewExtraction()
   nbv_candidates->vert.clear();
 
   int index = 0;
-  for (int i = 0; i < view_grid_points->vert.size(); i++)
+  for (int i = 0; i < view_grid_points->size(); i++)
   {
-    CVertex& v = view_grid_points->vert[i];
-    if (v.eigen_confidence > nbv_confidence_value)
+    if (view_grid_points->confidence(i) > nbv_confidence_value)
     {
+      CVertex v = view_grid_points->getVertex(i);
       v.m_index = index++;
       //v.is_view_grid = false;
       //v.is_iso = true;
@@ -707,13 +977,14 @@ void NBV::viewExtractionIntoBins(int view_bin_each_axis)
 
   //process each iso_point
   int index = 0; 
-  for (int i = 0; i < view_grid_points->vert.size(); ++i)
+  for (int i = 0; i < view_grid_points->size(); ++i)
   {
-    CVertex &v = view_grid_points->vert[i];
+    Point3f p = view_grid_points->position(i);
+    float confidence = view_grid_points->confidence(i);
 
-    int t_indexX = static_cast<int>( floor((v.P()[0] - whole_space_box_min.X()) / bin_length_x ));
-    int t_indexY = static_cast<int>( floor((v.P()[1] - whole_space_box_min.Y()) / bin_length_y ));
-    int t_indexZ = static_cast<int>( floor((v.P()[2] - whole_space_box_min.Z()) / bin_length_z ));
+    int t_indexX = static_cast<int>( floor((p[0] - whole_space_box_min.X()) / bin_length_x ));
+    int t_indexY = static_cast<int>( floor((p[1] - whole_space_box_min.Y()) / bin_length_y ));
+    int t_indexZ = static_cast<int>( floor((p[2] - whole_space_box_min.Z()) / bin_length_z ));
 
     t_indexX = (t_indexX >= view_bin_each_axis ? (view_bin_each_axis-1) : t_indexX);
     t_indexY = (t_indexY >= view_bin_each_axis ? (view_bin_each_axis-1) : t_indexY);
@@ -722,10 +993,10 @@ void NBV::viewExtractionIntoBins(int view_bin_each_axis)
     int idx = t_indexY * view_bin_each_axis * view_bin_each_axis
       + t_indexZ * view_bin_each_axis + t_indexX;
 
-    if (v.eigen_confidence > bin_confidence[idx])
+    if (confidence > bin_confidence[idx])
     {
-      bin_confidence[idx] = v.eigen_confidence;
-      view_bins[t_indexX][t_indexY][t_indexZ] = v.m_index;
+      bin_confidence[idx] = confidence;
+      view_bins[t_indexX][t_indexY][t_indexZ] = i;
     }
   }
 
@@ -737,10 +1008,10 @@ void NBV::viewExtractionIntoBins(int view_bin_each_axis)
     {
       for (int k = 0; k < view_bin_each_axis; ++k)
       {
-        if (view_bins[i][j][k] < 0  || view_bins[i][j][k] > view_grid_points->vert.size() - 1)
+        if (view_bins[i][j][k] < 0  || view_bins[i][j][k] > view_grid_points->size() - 1)
           continue;
         else
-          nbv_candidates->vert.push_back(view_grid_points->vert[view_bins[i][j][k]]);
+          nbv_candidates->vert.push_back(view_grid_points->getVertex(view_bins[i][j][k]));
       }
     }
   }
@@ -816,15 +1087,16 @@ void NBV::extractViewIntoBinsUsingDist()
     }
   }
 
-  for (int i = 0; i < view_grid_points->vert.size(); ++i)
+  for (int i = 0; i < view_grid_points->size(); ++i)
   {
-    CVertex &v = view_grid_points->vert[i];
+    Point3f p = view_grid_points->position(i);
+    float confidence = view_grid_points->confidence(i);
     int nearest_grid_idx = 0;
     double nearDistance = BIG;
     //for each iso_point, get the nearest grid index
     for ( int j = 0; j < v_grid_centers.size(); ++j)
     {
-      double d = GlobalFun::computeEulerDistSquare(v.P(), v_grid_centers[j]);
+      double d = GlobalFun::computeEulerDistSquare(p, v_grid_centers[j]);
       if (d < nearDistance)
       {
         nearest_grid_idx = j;
@@ -832,16 +1104,16 @@ void NBV::extractViewIntoBinsUsingDist()
       }
     }
 
-    if (v.eigen_confidence > bin_confidence[nearest_grid_idx])
+    if (confidence > bin_confidence[nearest_grid_idx])
     {
-      bin_confidence[nearest_grid_idx] = v.eigen_confidence;
-      view_bins[nearest_grid_idx] = v.m_index;
+      bin_confidence[nearest_grid_idx] = confidence;
+      view_bins[nearest_grid_idx] = i;
     }
   }
 
   for (int i = 0; i < sizeof(view_bins) / sizeof(view_bins[0]); ++i)
   {
-    nbv_candidates->vert.push_back(view_grid_points->vert[view_bins[i]]);
+    nbv_candidates->vert.push_back(view_grid_points->getVertex(view_bins[i]));
   }
   nbv_candidates->vn = nbv_candidates->vert.size();
 
@@ -884,108 +1156,112 @@ void NBV::viewClustering()
   double cos_view_preserve_angle = cos(view_preserve_angle / 180.0 * 3.1415926);
   cout << "cos(view_preserve_angle); " << view_preserve_angle << ", " <<cos_view_preserve_angle << endl;
 
-  while(1)
+  //the candidates are indexed by the position of their iso point
+  int iso_size = iso_points->vert.size();
+  int wrong_iso_count = 0;
+  vector<CVertex> iso_anchors;
+  vector<int> anchor_candidate;
+  for (int i = 0; i < nbv_candidates->vert.size(); i++)
   {
-    bool find_new_cluster = false;
-    vector<int> nbv_cluster;
-    for(int i = 0; i < nbv_candidates->vert.size(); i++)
+    int iso_index = nbv_candidates->vert[i].remember_iso_index;
+    if (iso_index < 0 || iso_index >= iso_size)
     {
-      CVertex& v = nbv_candidates->vert[i];
+      wrong_iso_count++;
+      continue;
+    }
+    CVertex anchor;
+    anchor.P() = iso_points->vert[iso_index].P();
+    iso_anchors.push_back(anchor);
+    anchor_candidate.push_back(i);
+  }
+  if (wrong_iso_count > 0)
+  {
+    cout << "iso index wrong! " << wrong_iso_count << endl;
+  }
+  PointKdTree iso_tree;
+  iso_tree.build(iso_anchors);
 
-      if (v.is_ignore)
-      {
-        continue;
-      }
+  //a cluster removes all its members but the best, and a surviving first member has no
+  //cluster left, so one pass in candidate order finds the clusters the repeated scans found
+  vector<int> nearby;
+  vector<int> nbv_cluster;
+  for (int i = 0; i < nbv_candidates->vert.size(); i++)
+  {
+    CVertex& v = nbv_candidates->vert[i];
+    if (v.is_ignore)
+    {
+      continue;
+    }
 
-      int v_iso_index = v.remember_iso_index;
-      if (v_iso_index < 0 || v_iso_index >= iso_points->vert.size())
+    int v_iso_index = v.remember_iso_index;
+    if (v_iso_index < 0 || v_iso_index >= iso_size)
+    {
+      continue;
+    }
+    CVertex& iso_v = iso_points->vert[v_iso_index];
+
+    //the tree compares in float, the exact test below decides
+    iso_tree.radius(iso_v.P(), cluster_radius_threshold * 1.001, nearby);
+    for (int n = 0; n < nearby.size(); n++)
+    {
+      nearby[n] = anchor_candidate[nearby[n]];
+    }
+    sort(nearby.begin(), nearby.end());
+
+    nbv_cluster.clear();
+    nbv_cluster.push_back(i);
+    for (int n = 0; n < nearby.size(); n++)
+    {
+      int j = nearby[n];
+      CVertex& t = nbv_candidates->vert[j];
+      if (i == j || t.is_ignore)
       {
-        cout << "iso index wrong!" << endl;
         continue;
       }
-      nbv_cluster.clear();
-      nbv_cluster.push_back(i);
-
-      CVertex& iso_v = iso_points->vert[v_iso_index];
 
-      for (int j = 0; j < nbv_candidates->vert.size(); j++)
+      CVertex& iso_t = iso_points->vert[t.remember_iso_index];
+      double iso_dist2 = GlobalFun::computeEulerDistSquare(iso_v.P(), iso_t.P());
+      if (iso_dist2 < cluster_radius_threshold2)
       {
-        if (i == j)
-        {
-          continue;
-        }
+        Point3f diff_v_iso = iso_v.P() - v.P();
+        Point3f diff_t_iso = iso_v.P() - t.P();
 
-        CVertex& t = nbv_candidates->vert[j];
-        if (t.is_ignore)
+        //here may have problem
+        double cos_angle = diff_v_iso.Normalize() * diff_t_iso.Normalize();
+        if (cos_angle > cos_view_preserve_angle)
         {
-          continue;
-        }
-
-        int t_iso_index = t.remember_iso_index;
-        if (t_iso_index < 0 || t_iso_index >= iso_points->vert.size())
-        {
-          cout << "iso index wrong!" << endl;
-          continue;
-        }
-
-        CVertex& iso_t = iso_points->vert[t_iso_index];
-
-        double iso_dist2 = GlobalFun::computeEulerDistSquare(iso_v.P(), iso_t.P());
-        if (iso_dist2 < cluster_radius_threshold2)
-        {
-          Point3f diff_v_iso = iso_v.P() - v.P();
-          Point3f diff_t_iso = iso_v.P() - t.P();
-
-          //here may have problem
-          double cos_angle = diff_v_iso.Normalize() * diff_t_iso.Normalize();
-          if (cos_angle > cos_view_preserve_angle)
-          {
-            cout << "cos_angle; " << cos_angle << endl;
-
-            find_new_cluster = true;
-            nbv_cluster.push_back(j);
-          }
+          nbv_cluster.push_back(j);
         }
       }
-
-      if (find_new_cluster)
-      {
-        break;
-      }
     }
 
-    if (find_new_cluster)
+    if (nbv_cluster.size() < 2)
     {
-      cout << "cluster size: " << nbv_cluster.size() << endl;
-      double max_score = 0;
-      int best_index = -1;
+      continue;
+    }
 
-      for (int i = 0; i < nbv_cluster.size(); i++)
-      {
-        int nbv_index = nbv_cluster[i];
-        double score = nbv_scores[nbv_index];
+    double max_score = 0;
+    int best_index = -1;
 
-        if (score > max_score)
-        {
-          max_score = score;
-          best_index = nbv_index;
-        }
-      }
+    for (int c = 0; c < nbv_cluster.size(); c++)
+    {
+      int nbv_index = nbv_cluster[c];
+      double score = nbv_scores[nbv_index];
 
-      for (int i = 0; i < nbv_cluster.size(); i++)
+      if (score > max_score)
       {
-        int nbv_index = nbv_cluster[i];
-        CVertex& v = nbv_candidates->vert[nbv_index];
-
-        if (nbv_index != best_index)
-        {
-          v.is_ignore = true;
-        }
+        max_score = score;
+        best_index = nbv_index;
       }
     }
-    else
+
+    for (int c = 0; c < nbv_cluster.size(); c++)
     {
-      break;
+      int nbv_index = nbv_cluster[c];
+      if (nbv_index != best_index)
+      {
+        nbv_candidates->vert[nbv_index].is_ignore = true;
+      }
     }
   }
 
@@ -1189,95 +1465,211 @@ bool NBV::updateViewDirections()
   double sigma = global_paraMgr.norSmooth.getDouble("Sharpe Feature Bandwidth Sigma");
   double sigma_threshold = pow(max(1e-8, 1-cos(sigma/180.0*3.1415926)), 2);
 
-  double radius2 = radius * radius;
-  double iradius16 = -4/radius2;
-
-  GlobalFun::computeBallNeighbors(iso_points, NULL, 
-    radius, iso_points->bbox);
-  for (int i = 0; i < iso_points->vert.size(); i++)
+  ViewScorer::Params score_params;
+  score_params.optimal_D = optimal_D;
+  score_params.half_D2 = half_D2;
+  score_params.sigma_threshold = sigma_threshold;
+  score_params.use_overlap = para->getBool("Need Update Direction With More Overlaps");
+  if (!view_scorer.update(iso_points, neighbor_search, radius, score_params))
   {
-    CVertex& v = iso_points->vert[i];
-    v.m_index = i;
-    v.neighbors.push_back(v.m_index);
+    cout << "iso neighborhoods reused" << endl;
   }
 
-  for (int i = 0; i < nbv_candidates->vert.size(); i++)
+  int iso_size = iso_points->vert.size();
+  vector<char> direction_moved(nbv_candidates->vert.size(), 0);
+  auto scoreCandidates = [&](int begin, int end, ViewScorer::Scratch& scratch)
   {
-    CVertex& nbvc = nbv_candidates->vert[i];
-    int iso_index = nbvc.remember_iso_index;
-    if (iso_index < 0)
+    for (int i = begin; i < end; i++)
     {
-      continue;
-    }
+      CVertex& nbvc = nbv_candidates->vert[i];
+      int iso_index = nbvc.remember_iso_index;
+      if (iso_index < 0 || iso_index >= iso_size)
+      {
+        continue;
+      }
+
+      float max_score = 0.;
+      int best_iso_index = view_scorer.bestIsoPoint(nbvc.P(), iso_index, max_score, scratch);
 
-    CVertex& iso_v = iso_points->vert[iso_index];
+      //nothing scored above zero, stay on the old iso point
+      if (best_iso_index >= 0 && best_iso_index != nbvc.remember_iso_index)//fixme: add collision detection
+      {
+        direction_moved[i] = 1;
+        Point3f best_direction_pos = iso_points->vert[best_iso_index].P();
+        nbvc.N() = (best_direction_pos - nbvc.P()).Normalize();
+        nbvc.remember_iso_index = best_iso_index;
+      }
+      nbv_scores[i] = max_score;
+    }
+  };
 
-    float max_score = 0.;
-    int best_iso_index = -1.;
+#ifdef LINKED_WITH_TBB
+  tbb::enumerable_thread_specific<ViewScorer::Scratch> scratches;
+  tbb::parallel_for(tbb::blocked_range<int>(0, nbv_candidates->vert.size()),
+    [&](const tbb::blocked_range<int>& r)
+  {
+    scoreCandidates(r.begin(), r.end(), scratches.local());
+  });
+#else
+  ViewScorer::Scratch scratch;
+  scoreCandidates(0, nbv_candidates->vert.size(), scratch);
+#endif
 
-    for (int j = 0; j < iso_v.neighbors.size(); j++)
+  for (int i = 0; i < direction_moved.size(); i++)
+  {
+    if (direction_moved[i])
     {
-      int neighbor_index = iso_v.neighbors[j];
-      CVertex& t = iso_points->vert[neighbor_index];
+      have_direction_move = true;
+    }
+  }
+  return have_direction_move;
+}
+
+bool ViewScorer::update(const CMesh* iso_points, NeighborSearch* neighbor_search, double _radius, const Params& _params)
+{
+  params = _params;
+  int n = iso_points->vert.size();
 
-      double t_score = computeLocalScores(nbvc, t, optimal_D, half_D2, sigma_threshold);
+  bool same_points = (_radius == radius && positions.size() == n && neighborhoods.size() == n);
+  for (int i = 0; i < n && same_points; i++)
+  {
+    same_points = (positions[i] == iso_points->vert[i].cP());
+  }
 
-      if (t_score > max_score)
+  if (!same_points)
+  {
+    radius = _radius;
+    positions.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+      positions[i] = iso_points->vert[i].cP();
+    }
+
+    //the ball neighbors and the point itself, ascending so ties go to the lower index
+    NeighborGraph ball;
+    neighbor_search->computeBallGraph(iso_points, NULL, radius, ball);
+    bool has_ball = (ball.size() == n);
+    neighborhoods.clear();
+    neighborhoods.offsets.assign(n + 1, 0);
+    for (int i = 0; i < n; i++)
+    {
+      int first = neighborhoods.indices.size();
+      neighborhoods.indices.push_back(i);
+      for (int j = 0; has_ball && j < ball.count(i); j++)
       {
-        max_score = t_score;
-        best_iso_index = neighbor_index;
+        neighborhoods.indices.push_back(ball.neighbor(i, j));
       }
+      sort(neighborhoods.indices.begin() + first, neighborhoods.indices.end());
+      neighborhoods.offsets[i + 1] = neighborhoods.indices.size();
     }
+  }
 
-    if (best_iso_index != nbvc.remember_iso_index)//fixme: add collision detection
+  px.resize(n); py.resize(n); pz.resize(n);
+  nx.resize(n); ny.resize(n); nz.resize(n);
+  weight.resize(n);
+  max_confidence.resize(n);
+  for (int i = 0; i < n; i++)
+  {
+    const CVertex& v = iso_points->vert[i];
+    px[i] = v.cP()[0]; py[i] = v.cP()[1]; pz[i] = v.cP()[2];
+    nx[i] = v.cN()[0]; ny[i] = v.cN()[1]; nz[i] = v.cN()[2];
+    weight[i] = 1.0 - v.eigen_confidence;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    float max_c = 0.0f;
+    for (int j = 0; j < neighborhoods.count(i); j++)
     {
-      have_direction_move = true;
-      //cout << "Max scores:  " << max_score << endl;
-      Point3f best_direction_pos = iso_points->vert[best_iso_index].P();
-      nbvc.N() = (best_direction_pos - nbvc.P()).Normalize();
-      nbvc.remember_iso_index = best_iso_index;
+      max_c = (std::max)(max_c, iso_points->vert[neighborhoods.neighbor(i, j)].eigen_confidence);
     }
-    nbv_scores[i] = max_score;
+    max_confidence[i] = max_c;
   }
+  return !same_points;
+}
 
-  return have_direction_move;
+void ViewScorer::clear()
+{
+  radius = -1.0;
+  positions.clear();
+  neighborhoods.clear();
 }
 
-double NBV::computeLocalScores(CVertex& view_t, CVertex& iso_v, 
-                               double& optimal_D, double& half_D2, double& sigma_threshold)
+int ViewScorer::bestIsoPoint(const Point3f& view, int iso_index, float& best_score, Scratch& scratch) const
 {
-  //return (1.0-iso_v.eigen_confidence);
+  int n = positions.size();
+  if (scratch.stamp.size() != n)
+  {
+    scratch.stamp.assign(n, 0);
+    scratch.slot.assign(n, 0);
+    scratch.current = 0;
+  }
+  if (++scratch.current == 0)
+  {
+    std::fill(scratch.stamp.begin(), scratch.stamp.end(), 0);
+    scratch.current = 1;
+  }
 
-  double sum_weight = 0.0;
-  //iso_v.neighbors.push_back(iso_v.m_index);
-  double max_confidence = 0.0;
+  //every iso point two steps away is weighted once, however many neighborhoods share it
+  scratch.ring.clear();
+  for (int j = 0; j < neighborhoods.count(iso_index); j++)
+  {
+    int t = neighborhoods.neighbor(iso_index, j);
+    for (int k = 0; k < neighborhoods.count(t); k++)
+    {
+      int u = neighborhoods.neighbor(t, k);
+      if (scratch.stamp[u] == scratch.current) continue;
 
-  for(int i = 0; i < iso_v.neighbors.size(); i++)
+      scratch.stamp[u] = scratch.current;
+      scratch.slot[u] = scratch.ring.size();
+      scratch.ring.push_back(u);
+    }
+  }
+  scratch.weights.resize(scratch.ring.size());
+  if (!scratch.ring.empty())
   {
-    int neighbor_index = iso_v.neighbors[i];
-    CVertex& t = iso_points->vert[neighbor_index];
+    weightRing(view, scratch.ring.size(), &scratch.ring[0], &scratch.weights[0]);
+  }
 
-    Point3f diff = view_t.P()-t.P();
-    double dist2 = diff.SquaredNorm();
-    double dist = sqrt(dist2);
-    Point3f view_direction = diff.Normalize();
+  best_score = 0.0f;
+  int best_iso_index = -1;
+  for (int j = 0; j < neighborhoods.count(iso_index); j++)
+  {
+    int t = neighborhoods.neighbor(iso_index, j);
+    double sum_weight = 0.0;
+    for (int k = 0; k < neighborhoods.count(t); k++)
+    {
+      sum_weight += scratch.weights[scratch.slot[neighborhoods.neighbor(t, k)]];
+    }
+    double t_score = params.use_overlap ? sum_weight * max_confidence[t] : sum_weight;
 
-    double w1 = exp(-(dist - optimal_D) * (dist - optimal_D) / half_D2);
-    //double w1 = 1.0;    
-    double w2 = exp(-pow(1-t.N()*view_direction, 2)/sigma_threshold);
-    //double w2 = 1.0;
-    double weight = w1 * w2 * (1.0-t.eigen_confidence); 
-    sum_weight += weight;
-    if (t.eigen_confidence > max_confidence)
+    if (t_score > best_score)
     {
-      max_confidence = t.eigen_confidence;
+      best_score = t_score;
+      best_iso_index = t;
     }
   }
+  return best_iso_index;
+}
 
-  if (para->getBool("Need Update Direction With More Overlaps"))  
-    return sum_weight * max_confidence;
-  else  
-    return sum_weight;
+void ViewScorer::weightRing(const Point3f& view, int n, const int* ring, double* weights) const
+{
+  //w1 * w2 * (1 - confidence) with a single exp, w1 for the distance to the view and w2 for the
+  //angle between the normal and the direction to the view. no branches, so the loop vectorizes
+  float vx = view[0], vy = view[1], vz = view[2];
+  double optimal_D = params.optimal_D;
+  double inv_half_D2 = 1.0 / params.half_D2;
+  double inv_sigma = 1.0 / params.sigma_threshold;
+  for (int r = 0; r < n; r++)
+  {
+    int u = ring[r];
+    float dx = vx - px[u], dy = vy - py[u], dz = vz - pz[u];
+    float dist2 = dx * dx + dy * dy + dz * dz;
+    double dist = sqrt(double(dist2));
+    float inv_dist = dist2 > 0.0f ? float(1.0 / dist) : 0.0f;
+    double one_minus_cos = 1.0 - (nx[u] * dx + ny[u] * dy + nz[u] * dz) * inv_dist;
+    double e = (dist - optimal_D) * (dist - optimal_D) * inv_half_D2 + one_minus_cos * one_minus_cos * inv_sigma;
+    weights[r] = exp(-e) * weight[u];
+  }
 }
 
 void NBV::setIsoBottomConfidence()
@@ -1346,52 +1738,52 @@ void NBV::runSmoothGridConfidence()
   //double sigma = 25;  
   double sigma_threshold = pow(max(1e-8,1-cos(sigma/180.0*3.1415926)), 2);
 
-  Timer time;
-  time.start("Sample ISOpoints Neighbor Tree!!");
-  GlobalFun::computeBallNeighbors(field_points, NULL, 
-    radius_threshold, field_points->bbox);
-  time.end();
-
-  for (int i = 0; i < field_points->vert.size(); i++)
+  //the cells are on a regular grid, so the ball neighbors are read straight from it
+  vector<int> neighbors;
+  for (int i = 0; i < field_points->size(); i++)
   {
-    CVertex& v = field_points->vert[i];
+    Point3f v_p = field_points->position(i);
+    Point3f v_n = field_points->normal(i);
 
     if (i < 20)
     {
-      cout << "before confidence: " << v.eigen_confidence << endl;
+      cout << "before confidence: " << field_points->confidence(i) << endl;
     }
 
-    if (v.neighbors.empty() && i < 50)
+    field_points->getCellsInBall(v_p, radius_threshold, neighbors);
+    if (neighbors.size() <= 1)
     {
-      cout << "empty neighbor" << endl;
+      if (i < 50)  cout << "empty neighbor" << endl;
       continue;
     }
 
     double sum_confidence = 0;
     double weight_sum = 0;
-    for(int j = 0; j < v.neighbors.size(); j++)
+    for(int j = 0; j < neighbors.size(); j++)
     {
-      CVertex& t = field_points->vert[v.neighbors[j]];
-      double dist2 = GlobalFun::computeEulerDistSquare(v.P(), t.P());
+      int t = neighbors[j];
+      if (t == i) continue;
+
+      Point3f t_p = field_points->position(t);
+      double dist2 = GlobalFun::computeEulerDistSquare(v_p, t_p);
 
       double dist_diff = exp(dist2 * iradius16);
-      double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
+      double normal_diff = exp(-pow(1-v_n*field_points->normal(t), 2)/sigma_threshold);
 
       double w = dist_diff * normal_diff;
 
-      sum_confidence += w * t.eigen_confidence;
+      sum_confidence += w * field_points->confidence(t);
       weight_sum += w;
 
     }
 
-    v.eigen_confidence = sum_confidence / weight_sum;
+    field_points->confidence(i) = sum_confidence / weight_sum;
 
     if (i < 20)
     {
-      cout << "after confidence: " << v.eigen_confidence << endl;
+      cout << "after confidence: " << field_points->confidence(i) << endl;
     }
   }
-  //cout << "neighbor size: " << field_points->vert[0].neighbors.size() << endl;
 }
 
 void NBV::runComputeViewCandidateIndex()
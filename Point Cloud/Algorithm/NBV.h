@@ -2,14 +2,100 @@
 #include <iostream>
 #include <tbb/parallel_for.h>
 #include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/queuing_mutex.h>
 #include "PointCloudAlgorithm.h"
 #include "GlobalFunction.h"
+#include "VoxelTraversal.h"
 
 using std::cout;
 using std::endl;
 using vcg::Point3f;
 
+// scores candidate views against the iso points for updateViewDirections. the ball neighborhoods
+// of the iso points are kept between calls and only searched again when the iso points moved or the
+// radius changed. the terms of each iso point (position, normal, 1 - confidence, and the largest
+// confidence around it) are gathered into flat arrays once per call, so scoring a view only reads
+// them and can run from many threads, each with its own Scratch.
+class ViewScorer
+{
+public:
+  struct Params
+  {
+    double optimal_D;
+    double half_D2;
+    double sigma_threshold;
+    bool   use_overlap; // "Need Update Direction With More Overlaps"
+  };
+
+  // the weights of one view, per iso point of its two ring. stamp[i] == current marks the
+  // points already weighted, at slot[i] in weights
+  struct Scratch
+  {
+    vector<unsigned int> stamp;
+    vector<int>          slot;
+    unsigned int         current;
+    vector<int>          ring;
+    vector<double>       weights;
+    Scratch() : current(0) {}
+  };
+
+  ViewScorer() : radius(-1.0) {}
+
+  // returns true if the neighborhoods were searched again
+  bool update(const CMesh* iso_points, NeighborSearch* neighbor_search, double _radius, const Params& _params);
+  void clear();
+
+  // the iso point around iso_index that view scores best on, -1 if none scores above 0
+  int  bestIsoPoint(const Point3f& view, int iso_index, float& best_score, Scratch& scratch) const;
+
+private:
+  void weightRing(const Point3f& view, int n, const int* ring, double* weights) const;
+
+private:
+  double          radius;
+  vector<Point3f> positions;     // the iso points the neighborhoods were searched for
+  NeighborGraph   neighborhoods; // ascending, with the point itself
+  Params          params;
+  vector<float>   px, py, pz, nx, ny, nz;
+  vector<float>   weight;        // 1 - confidence
+  vector<float>   max_confidence;
+};
+
+// what the last max propagation left, so the next one only traces the iso points that changed.
+// per grid the best and the second best (confidence, iso point) packed as in PropagateGrid,
+// the second from another iso point. once the second of a grid came from an iso point that changed,
+// what was below it is not known anymore: SECOND_UNKNOWN stays set and the second is only a lower
+// bound. if the best then changes too, the grid gets BEST_UNKNOWN and may stay lower than a full
+// trace would make it, once more than MAX_UNCERTAIN_FRACTION of the reached grids are like that the
+// next trace is full. the iso points are kept as they were traced. they are matched to the new ones
+// by position, as the poisson reconstruction regenerates them in another order, and the cache only
+// holds while the grid, its ray stops and the settings stay the same
+struct PropagationCache
+{
+  enum Unknown { SECOND_UNKNOWN = 1, BEST_UNKNOWN = 2 };
+
+  PropagationCache() : uncertain_cells(0), reached_cells(0) {}
+
+  vector<long long> best;
+  vector<long long> second;
+  vector<char>      unknown;   // Unknown bits per grid
+  vector<Point3f>   positions;
+  vector<Point3f>   normals;
+  vector<float>     confidences;
+  vector<double>    settings;
+  vector<int>       brick_slots;
+  vector<bool>      ray_stop;
+  int               uncertain_cells;
+  int               reached_cells;
+
+  static const double MAX_UNCERTAIN_FRACTION;
+
+  bool isValidFor(const VoxelGrid& grid, const vector<double>& _settings) const;
+  void remember(const VoxelGrid& grid, const vector<double>& _settings);
+  void clear();
+};
+
 class NBV : public PointCloudAlgorithm
 {
 public:
@@ -36,10 +122,6 @@ private:
   void runSmoothGridConfidence();
   void runComputeViewCandidateIndex();
 
-  int    round(double x);
-  void   setGridUnHit(vector<int>& hit_grids_idx);
-  double computeLocalScores(CVertex& view_t, CVertex& iso_v, 
-  double& optimal_D, double& half_D2, double& sigma_threshold);
   int    getIsoPointsViewBinIndex(Point3f& p, int which_axis);
   static bool cmp(const CVertex &v1, const CVertex &v2);
 
@@ -49,11 +131,12 @@ private:
   CMesh                 *model;
   CMesh                 *original;
   CMesh                 *iso_points;
-  CMesh                 *view_grid_points;
+  VoxelGrid             *view_grid_points;
   CMesh                 *nbv_candidates;
   vector<ScanCandidate> *scan_candidates;
   vector<ScanCandidate> *seletedViewCameras;
-  CMesh                 *field_points;
+  VoxelGrid             *field_points;
+  NeighborSearch        *neighbor_search;
   double                grid_step_size;
   Point3f               whole_space_box_max;
   Point3f               whole_space_box_min;
@@ -62,5 +145,8 @@ private:
   int                   z_max;
   vector<float>         confidence_weight_sum;
   vector<double>        nbv_scores;
+  RayDirectionTable     ray_directions;
+  ViewScorer            view_scorer;
+  PropagationCache      propagation_cache;
   Box3f*                whole_space_box;
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 NormalSmoother::NormalSmoother(RichParameterSet* _para)
 {
   mesh = NULL;
+  neighbor_search = NULL;
   para = _para;
 }
 
@@ -13,6 +14,7 @@ NormalSmoother::~NormalSmoother(void)
 
 void NormalSmoother::setInput(DataMgr* pData)
 {
+  neighbor_search = pData->getNeighborSearch();
   if(!pData->isSamplesEmpty())
   {
     input(pData->getCurrentSamples());
@@ -72,10 +74,11 @@ void NormalSmoother::runAnisotropicPCA()
   initVertexes();
 
   int knnNum = para->getInt("PCA KNN");
-  GlobalFun::computeAnnNeigbhors(mesh->vert, mesh->vert, knnNum, true, "runAnisotropicPCA");
+  NeighborGraph graph;
+  neighbor_search->computeKnnGraph(mesh, mesh->vert, knnNum, graph);
 
   double radius = para->getDouble("CGrid Radius");
-  AnistropicPca<vector<CVertex> >::ComputeAPcaNormalsByKNN(mesh->vert.begin(), mesh->vert.end(), 10, 
+  AnistropicPca<vector<CVertex> >::ComputeAPcaNormalsByKNN(mesh->vert.begin(), mesh->vert.end(), graph, 
     radius, para->getDouble("Sharpe Feature Bandwidth Sigma"));
 }
 
@@ -104,7 +107,8 @@ void NormalSmoother::runNormalSmooth()
   double iradius16 = -4 / radius2;
 
   CMesh* samples = mesh;
-  GlobalFun::computeBallNeighbors(samples, NULL, para->getDouble("CGrid Radius"), samples->bbox);
+  NeighborGraph graph;
+  neighbor_search->computeBallGraph(samples, NULL, radius, graph, true);
 
   normal_sum.assign(samples->vert.size(), Point3f(0.,0.,0.));
   normal_weight_sum.assign(samples->vert.size(), 0);
@@ -113,12 +117,11 @@ void NormalSmoother::runNormalSmooth()
   {
     CVertex& v = samples->vert[i];
 
-    for (int j = 0; j < v.neighbors.size(); j++)
+    for (int j = 0; j < graph.count(i); j++)
     {
-      CVertex& t = samples->vert[v.neighbors[j]];
+      CVertex& t = samples->vert[graph.neighbor(i, j)];
 
-      Point3f diff = v.P() - t.P();
-      double dist2  = diff.SquaredNorm();
+      double dist2  = graph.dist2(i, j);
 
       double rep; 
 
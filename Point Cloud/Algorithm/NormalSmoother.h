@@ -34,6 +34,7 @@ private:
 private:
   CMesh* mesh;
   CMesh* orignal_mesh;
+  NeighborSearch* neighbor_search;
   RichParameterSet* para;
   Box3f m_box;
   vector<Point3f> normal_sum;
@@ -9,6 +9,7 @@
 #include "Poisson/Ply.h"
 #include "Poisson/MultiGridOctreeData.h"
 #include "vcg/complex/trimesh/point_sampling.h"
+#include "PoissonDiskSampler.h"
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -75,14 +76,20 @@ public:
 Poisson::Poisson(RichParameterSet* _para)
 {
 	samples = NULL; original = NULL; iso_points = NULL; slices = NULL;
-  field_points = NULL;
+  field_points = NULL; neighbor_search = NULL;
 	para = _para;
+  poisson_context = new PoissonContext;
+  solver_cache = new PoissonSolverCache<2, false>;
 }
 
 Poisson::~Poisson(void)
 {
 	samples = NULL; original = NULL; iso_points = NULL; slices = NULL;
   field_points = NULL;
+  delete poisson_context;
+  poisson_context = NULL;
+  delete solver_cache;
+  solver_cache = NULL;
 }
 
 void Poisson::setInput(DataMgr* pData)
@@ -91,6 +98,7 @@ void Poisson::setInput(DataMgr* pData)
   samples = pData->getCurrentSamples();
   iso_points = pData->getCurrentIsoPoints();
   slices = pData->getCurrentSlices();
+  neighbor_search = pData->getNeighborSearch();
 
   model = pData->getCurrentModel();
 
@@ -192,7 +200,7 @@ void Poisson::run()
 
   if (para->getBool("Run Normalize Field Confidence"))
   {
-    GlobalFun::normalizeConfidence(field_points->vert, 0);
+    field_points->normalizeConfidence(0);
     return;
   }
 
@@ -221,13 +229,13 @@ void Poisson::run()
     return;
   }
   //runPoisson();
-   runPoissonFieldAndExtractIsoPoints_ByEXE();
+   runPoissonFieldAndExtractIsoPoints();
 }
 
 
 void Poisson::runOneKeyPoissonConfidence()
 {
-  runPoissonFieldAndExtractIsoPoints_ByEXE();
+  runPoissonFieldAndExtractIsoPoints();
 
   if (!para->getBool("Run Poisson On Original"))
   {
@@ -381,22 +389,20 @@ void Poisson::runSmoothGridConfidence()
   //double sigma = 25;  
   double sigma_threshold = pow(max(1e-8,1-cos(sigma/180.0*3.1415926)), 2);
 
-  Timer time;
-  time.start("Sample ISOpoints Neighbor Tree!!");
-  GlobalFun::computeBallNeighbors(field_points, NULL, 
-                                  radius_threshold, field_points->bbox);
-  time.end();
-
-  for (int i = 0; i < field_points->vert.size(); i++)
+  //the cells are on a regular grid, so the ball neighbors are read straight from it
+  vector<int> neighbors;
+  for (int i = 0; i < field_points->size(); i++)
   {
-    CVertex& v = field_points->vert[i];
+    Point3f v_p = field_points->position(i);
+    Point3f v_n = field_points->normal(i);
 
     if (i < 20)
     {
-      cout << "before confidence: " << v.eigen_confidence << endl;
+      cout << "before confidence: " << field_points->confidence(i) << endl;
     }
 
-    if (v.neighbors.empty())
+    field_points->getCellsInBall(v_p, radius_threshold, neighbors);
+    if (neighbors.size() <= 1)
     {
       cout << "empty neighbor" << endl;
       continue;
@@ -404,29 +410,31 @@ void Poisson::runSmoothGridConfidence()
 
     double sum_confidence = 0;
     double weight_sum = 0;
-    for(int j = 0; j < v.neighbors.size(); j++)
+    for(int j = 0; j < neighbors.size(); j++)
     {
-      CVertex& t = field_points->vert[v.neighbors[j]];
-      double dist2 = GlobalFun::computeEulerDistSquare(v.P(), t.P());
+      int t = neighbors[j];
+      if (t == i) continue;
+
+      Point3f t_p = field_points->position(t);
+      double dist2 = GlobalFun::computeEulerDistSquare(v_p, t_p);
 
       double dist_diff = exp(dist2 * iradius16);
-      double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
+      double normal_diff = exp(-pow(1-v_n*field_points->normal(t), 2)/sigma_threshold);
 
       double w = dist_diff * normal_diff;
 
-      sum_confidence += w * t.eigen_confidence;
+      sum_confidence += w * field_points->confidence(t);
       weight_sum += w;
 
     }
 
-    v.eigen_confidence = sum_confidence / weight_sum;
+    field_points->confidence(i) = sum_confidence / weight_sum;
 
     if (i < 20)
     {
-       cout << "after confidence: " << v.eigen_confidence << endl;
+       cout << "after confidence: " << field_points->confidence(i) << endl;
     }
   }
-  //cout << "neighbor size: " << field_points->vert[0].neighbors.size() << endl;
 }
 
 void Poisson::runIsoSmooth()
@@ -441,8 +449,8 @@ void Poisson::runIsoSmooth()
 
   Timer time;
   time.start("Sample ISOpoints Neighbor Tree!!");
-  GlobalFun::computeBallNeighbors(iso_points, NULL, 
-                                  radius_threshold, samples->bbox);
+  NeighborGraph graph;
+  neighbor_search->computeBallGraph(iso_points, NULL, radius_threshold, graph, true);
   time.end();
 
 
@@ -450,17 +458,17 @@ void Poisson::runIsoSmooth()
   {
     CVertex& v = iso_points->vert[i];
 
-    if (v.neighbors.empty())
+    if (graph.count(i) == 0)
     {
       continue;
     }
 
     double sum_confidence = 0;
     double weight_sum = 0;
-    for(int j = 0; j < v.neighbors.size(); j++)
+    for(int j = 0; j < graph.count(i); j++)
     {
-      CVertex& t = iso_points->vert[v.neighbors[j]];
-      double dist2 = GlobalFun::computeEulerDistSquare(v.P(), t.P());
+      CVertex& t = iso_points->vert[graph.neighbor(i, j)];
+      double dist2 = graph.dist2(i, j);
 
       double dist_diff = exp(dist2 * iradius16);
       double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
@@ -552,11 +560,10 @@ void Poisson::runViewCandidatesClustering()
 
   //GlobalFun::computeBallNeighbors(view_candidates, NULL, 
   //                                radius, view_candidates->bbox);
-  GlobalFun::computeAnnNeigbhors(view_candidates->vert,
-                                 view_candidates->vert, 
-                                 15,
-                                 false,
-                                 "runViewCandidatesClustering");
+  neighbor_search->computeAnnNeighbors(view_candidates,
+                                       view_candidates->vert, 
+                                       15,
+                                       "runViewCandidatesClustering");
 
   vector<CVertex> update_temp;
   for(int i = 0; i < view_candidates->vert.size(); i++)
@@ -595,6 +602,7 @@ void Poisson::runViewCandidatesClustering()
     update_temp.push_back(temp_v);
   }
 
+  neighbor_search->invalidate(view_candidates);
   view_candidates->vert.clear();
   for (int i = 0; i < update_temp.size(); i++)
   {
@@ -921,29 +929,18 @@ void Poisson::samplePointsFromMesh(CMesh& mesh, CMesh* points)
   {
     sampleNum = 100;
   }
-  radius = tri::SurfaceSampling<CMesh,BaseSampler>::ComputePoissonDiskRadius(mesh, sampleNum);
-  // first of all generate montecarlo samples for fast lookup
-  CMesh *presampledMesh=&(mesh);
-  CMesh MontecarloMesh; // this mesh is used only if we need real poisson sampling (and therefore we need to choose points different from the starting mesh vertices)
-
+  radius = PoissonDiskSampler::computeRadius(mesh, sampleNum);
 
-  BaseSampler sampler(&MontecarloMesh);
-  sampler.qualitySampling =true;
-  tri::SurfaceSampling<CMesh,BaseSampler>::Montecarlo(mesh, sampler, sampleNum*20);
-  MontecarloMesh.bbox = mesh.bbox; // we want the same bounding box
-  presampledMesh=&MontecarloMesh;
-  
-
-  BaseSampler mps(points);
-  tri::SurfaceSampling<CMesh,BaseSampler>::PoissonDiskParam pp;
-  tri::SurfaceSampling<CMesh,BaseSampler>::PoissonDisk(mesh, mps, *presampledMesh, radius,pp);
+  // thins sampleNum*20 uniform candidates, as the montecarlo presampling did
+  PoissonDiskSampler sampler;
+  sampler.sample(mesh, radius, sampleNum * 20, points);
 }
 
-void Poisson::runPoissonFieldAndExtractIsoPoints_ByEXE()
+// screened poisson reconstruction of original or samples in process, with the settings
+// PoissonRecon.exe used to run with (--depth "Max Depth" --pointWeight 0, the rest default),
+// so the field and the mesh are the ones the exe wrote to poisson_field.raw and poisson_out.ply
+void Poisson::runPoissonFieldAndExtractIsoPoints()
 {
-  PoissonParam Par;
-  Par.Depth = para->getDouble("Max Depth");
-
   CMesh* target = NULL;
   if (para->getBool("Run Poisson On Original"))
   {
@@ -959,436 +956,215 @@ void Poisson::runPoissonFieldAndExtractIsoPoints_ByEXE()
     return;
   }
 
-  Timer timer;
-  timer.start("write ply file");
-  int mask= tri::io::Mask::IOM_VERTNORMAL;// add vertcord will cause crash
-  tri::io::ExporterPLY<CMesh>::Save(*target, "poisson_in.ply", mask, false);
-  timer.end();
-
-  timer.start("run Poisson");
-  char mycmd[100];
-  sprintf(mycmd, "PoissonRecon.exe --in poisson_in.ply --out poisson_out.ply --voxel poisson_field.raw --depth %d --pointWeight 0", Par.Depth);
-  system(mycmd); 
-  timer.end();
-
-  if (para->getBool("Run Generate Poisson Field") || para->getBool("Run One Key PoissonConfidence"))
+  if (target->vert.empty())
   {
-    timer.start("read voxel poisson field");
-    FILE *fp = fopen("poisson_field.raw", "rb");
-    if (fp == NULL) {
-      perror("Open file poisson_field.raw");
-      exit(1);
-    }
-
-    //int res = 1<<Par.Depth;
-    //int read_size = res * res * res;
-    int res;
-    fread(&res, sizeof(int), 1, fp);
-
-    float tree_scale;
-    Point3f center_p;
-    fread(&tree_scale, sizeof(float), 1, fp);
-    fread(&center_p[0], sizeof(float), 1, fp);
-    fread(&center_p[1], sizeof(float), 1, fp);
-    fread(&center_p[2], sizeof(float), 1, fp);
-
-    cout << res << " | " << tree_scale << " | " << center_p[0] << ", " << center_p[1] << ", " << center_p[2] << endl;
-
-    int read_size = res * res * res;
-    float *buf = new float[read_size];
-    fread(buf, sizeof(float), read_size, fp);
-
-
-    float space = tree_scale * (1.0 / res);
-    int index = 0;
-    field_points->vert.clear();
-    int res2 = res * res;
-    for (int i = 0; i < res; i++)
-    {
-      for (int j = 0; j < res; j++)
-      {
-        for (int k = 0; k < res; k++)
-        {
-          Point3f p(i * space, j * space, k * space);
-          CVertex new_v;
-          new_v.is_field_grid = true;
-          new_v.P() = p + center_p;
-          new_v.m_index = index;
-          new_v.eigen_confidence = buf[i + j * res + k * res2];          
-          index++;
-          field_points->vert.push_back(new_v);
-          field_points->bbox.Add(new_v.P());
-        }
-      }
-    }
-
-    field_points->vn = field_points->vert.size();
-    cout << "field point size:  " << field_points->vn << endl;
-    cout << "resolution:  " << res << endl;
-    para->setValue("Field Points Resolution", IntValue(res));
-    GlobalFun::normalizeConfidence(field_points->vert, 0);
-
-    delete buf;
-    timer.end();
-
-    if (para->getBool("Run Generate Poisson Field")) return;
+    cout << "Poisson: empty input" << endl;
+    return;
   }
 
-  if (para->getBool("Run Extract MC Points") || para->getBool("Run One Key PoissonConfidence"))
-  {
-    timer.start("load ply file and sample ISO points");
-    mask= tri::io::Mask::IOM_VERTNORMAL ;
-    int err = tri::io::Importer<CMesh>::Open(tentative_mesh, "poisson_out.ply", mask);  
-    if(err) 
-    {
-      cout << "Failed reading mesh: " << err << "\n";
-      return;
-    }  
-
-    if (tentative_mesh.vert.empty())
-    {
-      cout << "tentative mesh empty" << endl;
-      return;
-    }
-
-    iso_points->vert.clear();
-    samplePointsFromMesh(tentative_mesh, iso_points);
-
-    for (int i = 0; i < iso_points->vert.size(); i++)
-    {
-      CVertex& v = iso_points->vert[i];
-      v.is_iso = true;
-      v.m_index = i;
-      v.eigen_confidence = 0;
-      v.N().Normalize();
-      v.recompute_m_render();
-    }
-    iso_points->vn = iso_points->vert.size();
-    timer.end();
-  }
-}
+  PoissonParam Par;
+  Par.Depth = para->getDouble("Max Depth");
+  Par.Scale = 1.1f;
+  Par.MinIters = 24;
+  Par.Confidence = false;
+  Par.NonManifold = false;
+  Par.constraintWeight = 0.0f;
+  Par.MaxSolveDepth = Par.Depth;
+  Par.SolverDivide = (std::max)(Par.SolverDivide, Par.MinDepth);
+  Par.IsoDivide = (std::max)(Par.IsoDivide, Par.MinDepth);
 
-void Poisson::runPoissonFieldAndExtractIsoPoints()
-{
-  cout << "run Poisson Field And Iso" << endl;
-  CMesh* target = NULL;
-  if (para->getBool("Run Poisson On Original"))
-  {
-    target = original;
-  }
-  else if (para->getBool("Run Poisson On Samples"))
-  {
-    target = samples;
-  }
-  else
+  int kernelDepth = Par.KernelDepth >= 0 ? Par.KernelDepth : Par.Depth - 2;
+  if (kernelDepth > Par.Depth)
   {
-    cout << "Run on original or sample?" << endl;
+    cout << "Poisson: kernel depth can't be greater than depth" << endl;
     return;
   }
 
+  Timer timer;
+  timer.start("build tree");
   target->vn = target->vert.size();
   vector<Point3D<Real> > Pts(target->vn);
-  vector<Point3D<Real> > Nor(target->vn); 
-
-  cout << "target size : " << target->vn << endl;
-  Box3f test_box;
-  for (int i = 0; i < target->vert.size(); i++)
+  vector<Point3D<Real> > Nor(target->vn);
+  for (int i = 0; i < target->vn; i++)
   {
-    CVertex v = target->vert[i];
-    for (int ii = 0; ii < 3; ++ii)
+    const CVertex& v = target->vert[i];
+    for (int a = 0; a < 3; ++a)
     {
-      Pts[i].coords[ii] = v.P()[ii];
-      Nor[i].coords[ii] = v.N()[ii];
-
-      test_box.Add(v.P());
+      Pts[i].coords[a] = v.P()[a];
+      Nor[i].coords[a] = v.N()[a];
     }
   }
-  Point3f mid_p = (test_box.min + test_box.max) / 2.0;
-  //cout << mid_p << endl;
-
-  CoredVectorMeshData<PlyVertex<Real>> mesh;
-  //CoredVectorMeshData<Point3D<float>> mesh;
-
-  XForm4x4< Real > xForm , iXForm;
-  xForm = XForm4x4< Real >::Identity();
-  iXForm = xForm.inverse();
 
-  Timer time;
-  time.start("build tree");
-  PoissonParam Par;
-  Par.Depth = para->getDouble("Max Depth");
-  Par.SamplesPerNode = 1;
-  Par.SolverDivide = 8;
-  Par.Offset = 1;
-  Par.Confidence = false;
-
-  Point3D<float> center;
-  float scale = 1.0;
-  float isoValue=0;
-
-  ////////////////////////////////////
-  //// Fix courtesy of David Gallup //
-  //TreeNodeData::UseIndex = 1;     //
-  ////////////////////////////////////
-
-  //// Execute
-  ////int ret= Execute2(pp, Pts, Nor, mesh, center, scale, &cb);
   const int Degree = 2;
   const bool OutputDensity = false;
-
-  POctree<Degree, OutputDensity> tree;
+  //the last tree is gone, so its nodes go back into the pool, and the tables are kept if the depth and boundary are unchanged
+  POctree<Degree, OutputDensity> tree(solver_cache);
   tree.threads = Par.Threads;
-  //tree.threads = 1;
-
-  cout << "Threads Number:  " << tree.threads << endl;
-
-  //PPolynomial<Degree> ReconstructionFunction=PPolynomial<Degree>::GaussianApproximation();
-
-  center.coords[0]=center.coords[1]=center.coords[2]=0;
-
-  //TreeOctNode::SetPAllocator(MEMORY_PALLOCATOR_BLOCK_SIZE);
-  OctNode< TreeNodeData< OutputDensity > , Real >::SetAllocator( MEMORY_ALLOCATOR_BLOCK_SIZE );
-
-  int kernelDepth = Par.Depth-2;
-  if(Par.KernelDepth>=0){kernelDepth=Par.KernelDepth;}
-  cout << "kernel depth:  " << kernelDepth << endl;
+  tree.preconditioner = Par.Preconditioner;
+  solver_cache->setAllocator( MEMORY_ALLOCATOR_BLOCK_SIZE );
+
+  tree.setBSplineData(Par.Depth, Par.BoundaryType);
+  tree.maxMemoryUsage = 0;
+  int pointCount = tree.setTreeSorted(Pts, Nor, Par.Depth, Par.MinDepth, kernelDepth, Real(Par.SamplesPerNode),
+                                      Par.Scale, Par.Confidence, Par.constraintWeight, Par.adaptiveExponent,
+                                      XForm4x4< Real >::Identity(), poisson_context);
+  tree.ClipTree();
+  tree.finalize(Par.IsoDivide);
+  DumpOutput( "Input Points: %d\n" , pointCount );
+  DumpOutput( "Leaves/Nodes: %d/%d\n" , tree.tree.leaves() , tree.tree.nodes() );
+  timer.end();
 
-  Par.MaxSolveDepth = Par.Depth;
-  if (Par.SolverDivide < Par.MinDepth)
-  {
-    Par.SolverDivide = Par.MinDepth;
-  }
-  if (Par.IsoDivide < Par.MinDepth)
-  {
-    Par.IsoDivide = Par.MinDepth;
+  timer.start("solve Laplacian");
+  tree.SetLaplacianConstraints();
+  //scans only add a few points per iteration, so the last solution is a close initial guess
+  int seeded = tree.SetInitialSolution(*poisson_context);
+  int iters = tree.LaplacianMatrixIteration(Par.SolverDivide, Par.ShowResidual, Par.MinIters, Par.SolverAccuracy,
+                                            Par.MaxSolveDepth, Par.FixedIters);
+  tree.GetSolution(*poisson_context, iters);
+  if (Par.ShowResidual)
+  {
+    for (size_t i = 0; i < tree.solverTrace.size(); i++)
+    {
+      const SolverTrace& trace = tree.solverTrace[i];
+      cout << "depth " << trace.depth << ": " << trace.rows << " rows, " << trace.iters << " iterations, residual "
+           << trace.bNorm << " -> " << trace.rNorm << endl;
+    }
   }
-
-  tree.setBSplineData(Par.Depth , Par.BoundaryType);
-
-  if (kernelDepth > Par.Depth)
+  if (seeded > 0)
   {
-    cout << "can not be ..." << endl;
-    return;
+    cout << "warm start: " << seeded << " nodes seeded, " << iters << " CG iterations";
+    if (poisson_context->coldIters >= 0)
+      cout << ", " << poisson_context->coldIters - iters << " saved against the last cold solve";
+    cout << endl;
   }
-  double maxMemoryUsage;
-  tree.maxMemoryUsage=0;
-
-  time.start("set tree");
-  cout << "normals" << endl;
-  for (int i = 0; i < 5; i++)
+  else
   {
-    cout << Nor[i][0] << ", " << Nor[i][1] << ", " << Nor[i][2] << endl;
+    cout << "cold start: " << iters << " CG iterations" << endl;
   }
+  Real isoValue = tree.GetIsoValue();
+  timer.end();
 
-  int pointCount = tree.setTree2(Pts, 
-                                 Nor,
-                                 Par.Depth , 
-                                 Par.MinDepth, 
-                                 kernelDepth, 
-                                 Real(Par.SamplesPerNode) , 
-                                 Par.Scale , 
-                                 Par.Confidence , 
-                                 Par.constraintWeight , 
-                                 Par.adaptiveExponent , 
-                                 xForm );
-  time.end();
-  time.start("Solve Laplacian");
-
-  DumpOutput( "Input Points: %d\n" , pointCount );
-  DumpOutput( "Leaves/Nodes: %d/%d\n" , tree.tree.leaves() , tree.tree.nodes() );  
-  DumpOutput( "Memory Usage: %.3f MB\n" , float( MemoryInfo::Usage() )/(1<<20) );
-
-
-  tree.ClipTree();
-  tree.finalize( Par.IsoDivide );
-
-  //DumpOutput2( comments[commentNum++] , "#             Tree set in: %9.1f (s), %9.1f (MB)\n" , 0 , tree.maxMemoryUsage );
-
-  tree.SetLaplacianConstraints();
-  tree.LaplacianMatrixIteration( Par.SolverDivide, 
-                                 Par.ShowResidual , 
-                                 Par.MinIters , 
-                                 Par.SolverAccuracy , 
-                                 Par.MaxSolveDepth , 
-                                 Par.FixedIters );
-
-  isoValue = tree.GetIsoValue();
-  time.end();
-
-  double estimate_scale = abs(isoValue);
-
-  if (para->getBool("Run Generate Poisson Field") || para->getBool("Run One Key PoissonConfidence"))
+  //the one key confidences only read the field around the iso points, so there it is evaluated in the bricks
+  //near them once they are extracted. the nbv inside segment reads the field everywhere
+  bool band_field = para->getBool("Run One Key PoissonConfidence") && !para->getBool("Run Generate Poisson Field")
+    && para->getBool("Generate Field Near ISO Points") && !global_paraMgr.nbv.getBool("Test Other Inside Segment");
+  if ((para->getBool("Run Generate Poisson Field") || para->getBool("Run One Key PoissonConfidence")) && !band_field)
   {
-    time.start("Generate Poisson Field");
-    cout << "Run Generate Poisson Field" << endl;
-
+    timer.start("generate Poisson field");
     int res;
-    Pointer( Real ) grid_values = tree.GetSolutionGrid( res , isoValue , Par.VoxelDepth );
-
-    float tree_scale = tree._scale;
-    Point3D<float> tree_center = tree._center;
-
-    float space = tree_scale * (1.0 / (1<<Par.Depth));
-
-    Point3f center_p(tree_center.coords[0], tree_center.coords[1], tree_center.coords[2]);
+    Pointer( Real ) grid_values = tree.GetSolutionGrid(res, isoValue, Par.VoxelDepth);
 
-    int index = 0;
-    field_points->vert.clear();
+    Point3f center_p(tree._center.coords[0], tree._center.coords[1], tree._center.coords[2]);
+    float space = tree._scale * (1.0 / res);
+    field_points->resize(VoxelGrid::FIELD_GRID, center_p, space, res, res, res);
     int res2 = res * res;
-    for (int i = 0; i < res; i++)
+    auto copySlab = [&](int i)
     {
       for (int j = 0; j < res; j++)
       {
         for (int k = 0; k < res; k++)
         {
-          Point3f p(i * space, j * space, k * space);
-          CVertex new_v;
-          new_v.is_field_grid = true;
-          new_v.P() = p + center_p;
-          new_v.m_index = index;
-          new_v.eigen_confidence = float( grid_values[i + j * res + k * res2] );          
-          index++;
-          field_points->vert.push_back(new_v);
-          field_points->bbox.Add(new_v.P());
+          field_points->confidence(field_points->index(i, j, k)) = float( grid_values[i + j * res + k * res2] );
         }
       }
-    }
+    };
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, res),
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      for (size_t i = r.begin(); i < r.end(); ++i)
+        copySlab(i);
+    });
+#else
+    for (int i = 0; i < res; i++)
+      copySlab(i);
+#endif
+    DeletePointer(grid_values);
 
-    field_points->vn = field_points->vert.size();
-    cout << "field point size:  " << field_points->vn << endl;
+    cout << "field point size:  " << field_points->size() << endl;
     cout << "resolution:  " << res << endl;
     para->setValue("Field Points Resolution", IntValue(res));
-    GlobalFun::normalizeConfidence(field_points->vert, 0);
+    field_points->normalizeConfidence(0);
+    timer.end();
 
-    time.end();
     if (para->getBool("Run Generate Poisson Field")) return;
   }
 
-  //iso_points->vert.clear();
   if (para->getBool("Run Extract MC Points") || para->getBool("Run One Key PoissonConfidence"))
   {
-    time.start("marching cube");
-    //if(Par.IsoDivide){tree.GetMCIsoTriangles(isoValue,Par.IsoDivide,&mesh);}
-    //else{tree.GetMCIsoTriangles(isoValue,&mesh);}
-    tree.GetMCIsoTriangles( isoValue , Par.IsoDivide, &mesh , 0 , 1 , !Par.NonManifold , Par.PolygonMesh);
-    time.end();
-
-    time.start("write result");
-    PlyWritePolygons("poisson_result.ply", &mesh , PLY_ASCII , NULL , 0 , iXForm );
-    time.end();
-
-    ////out put
-    mesh.resetIterator();
-    int vm = mesh.outOfCorePointCount()+mesh.inCorePoints.size();
-    int fm = mesh.polygonCount();
-
-    tentative_mesh.vert.clear();
-    tentative_mesh.face.clear();
-
-    Point3D<Real> p;
-    PlyVertex<Real> pv; 
-    int i=0;
-    int index = 0;
-    for (; i < int(mesh.inCorePoints.size()); i++)
+    if (para->getBool("Extract ISO Points From Octree"))
     {
-      p = mesh.inCorePoints[i].point;
-      CVertex new_v;
-      new_v.P()[0] = p.coords[0]*scale+center.coords[0];
-      new_v.P()[1] = p.coords[1]*scale+center.coords[1];
-      new_v.P()[2] = p.coords[2]*scale+center.coords[2];
-      new_v.is_iso = true;
-      new_v.eigen_confidence = 0;
-      new_v.m_index = index++;
-      tentative_mesh.vert.push_back(new_v);
-      tentative_mesh.bbox.Add(new_v.P());
-    }
-
+      //evenly spaced points straight from the leaves the surface crosses, with the field gradient as normal
+      timer.start("extract ISO points from the octree");
+      int sampleNum = para->getDouble("Poisson Disk Sample Number");
+      if (sampleNum <= 100)
+      {
+        sampleNum = 100;
+      }
+      vector<Point3D<Real> > iso_positions, iso_normals;
+      tree.GetIsoPoints(isoValue, sampleNum, iso_positions, iso_normals);
 
-    for (int ii=0; ii < mesh.outOfCorePointCount(); ii++)
-    {
-      mesh.nextOutOfCorePoint(pv);
-      p = pv.point;
-      CVertex new_v;
-      new_v.P()[0] = p.coords[0]*scale+center.coords[0];
-      new_v.P()[1] = p.coords[1]*scale+center.coords[1];
-      new_v.P()[2] = p.coords[2]*scale+center.coords[2];
-      new_v.eigen_confidence = 0;
-      new_v.is_iso = true;
-      new_v.m_index = index++;
-      tentative_mesh.vert.push_back(new_v);
-      tentative_mesh.bbox.Add(new_v.P());
+      neighbor_search->invalidate(iso_points);
+      iso_points->vert.clear();
+      iso_points->vert.resize(iso_positions.size());
+      for (int i = 0; i < iso_positions.size(); i++)
+      {
+        CVertex& v = iso_points->vert[i];
+        v.P() = Point3f(iso_positions[i].coords[0], iso_positions[i].coords[1], iso_positions[i].coords[2]);
+        v.N() = Point3f(iso_normals[i].coords[0], iso_normals[i].coords[1], iso_normals[i].coords[2]);
+      }
     }
-
-    if (tentative_mesh.vert.empty())
+    else
     {
-      cout << "tentative mesh empty" << endl;
-      return;
-    }
-    //TriangleIndex tIndex;
-    std::vector< CoredVertexIndex > polygon;
-    int inCoreFlag;
-    int nr_faces=mesh.polygonCount();	
+      timer.start("marching cubes and sample ISO points");
+      CoredVectorMeshData< PlyVertex<Real> > mesh;
+      tree.GetMCIsoTriangles(isoValue, Par.IsoDivide, &mesh, 0, 1, !Par.NonManifold, Par.PolygonMesh);
+
+      //the marching cubes vertices are already in world space
+      tentative_mesh.Clear();
+      mesh.resetIterator();
+      int in_core = mesh.inCorePoints.size();
+      int out_of_core = mesh.outOfCorePointCount();
+      tentative_mesh.vert.resize(in_core + out_of_core);
+      for (int i = 0; i < in_core + out_of_core; i++)
+      {
+        PlyVertex<Real> pv;
+        if (i < in_core) pv = mesh.inCorePoints[i];
+        else mesh.nextOutOfCorePoint(pv);
 
-    for (i=0; i < nr_faces; i++)
-    {
-      //
-      // create and fill a struct that the ply code can handle
-      //
-      //if (!mesh.nextPolygon(polygon))
-      //{
-      //  continue;
-      //}
-      mesh.nextPolygon(polygon);
-      CFace new_face;      
-      for(int j=0; j < 3; j++)
+        CVertex& v = tentative_mesh.vert[i];
+        v.P() = Point3f(pv.point.coords[0], pv.point.coords[1], pv.point.coords[2]);
+        v.m_index = i;
+      }
+
+      std::vector< CoredVertexIndex > polygon;
+      int face_num = mesh.polygonCount();
+      tentative_mesh.face.reserve(face_num);
+      for (int i = 0; i < face_num; i++)
       {
-        //tentative_mesh.face[i].V(j) = &tentative_mesh.vert[tIndex.idx[j]];
-        if (polygon[j].inCore)
-        {
-          new_face.V(j) = &tentative_mesh.vert[polygon[j].idx];         
-        }
-        else
+        mesh.nextPolygon(polygon);
+        if (polygon.size() != 3) continue;
+
+        CFace new_face;
+        for (int j = 0; j < 3; j++)
         {
-          int index = polygon[j].idx + int( mesh.inCorePoints.size() );
+          int index = polygon[j].inCore ? polygon[j].idx : polygon[j].idx + in_core;
           new_face.V(j) = &tentative_mesh.vert[index];
         }
+        tentative_mesh.face.push_back(new_face);
+      }
 
-        //cout << tIndex[j].idx << ", ";
+      if (tentative_mesh.vert.empty())
+      {
+        cout << "tentative mesh empty" << endl;
+        return;
       }
-      tentative_mesh.face.push_back(new_face);
-      //cout << endl;
-    } 
-
-    tentative_mesh.vn = tentative_mesh.vert.size();
-    tentative_mesh.fn = tentative_mesh.face.size();
-    vcg::tri::UpdateNormals<CMesh>::PerVertex(tentative_mesh);
-    //vcg::tri::UpdateNormals<CMesh>::PerFace(tentative_mesh);
-
-    float radius = 0;
-    int sampleNum = para->getDouble("Poisson Disk Sample Number");
-    if (sampleNum <= 100)
-    {
-      sampleNum = 100;
-    }
-    radius = tri::SurfaceSampling<CMesh,BaseSampler>::ComputePoissonDiskRadius(tentative_mesh, sampleNum);
-    // first of all generate montecarlo samples for fast lookup
-    CMesh *presampledMesh=&(tentative_mesh);
-    CMesh MontecarloMesh; // this mesh is used only if we need real poisson sampling (and therefore we need to choose points different from the starting mesh vertices)
 
-    if (1)
-    {
-      BaseSampler sampler(&MontecarloMesh);
-      sampler.qualitySampling =true;
-      tri::SurfaceSampling<CMesh,BaseSampler>::Montecarlo(tentative_mesh, sampler, sampleNum*20);
-      MontecarloMesh.bbox = tentative_mesh.bbox; // we want the same bounding box
-      presampledMesh=&MontecarloMesh;
+      neighbor_search->invalidate(iso_points);
+      iso_points->vert.clear();
+      samplePointsFromMesh(tentative_mesh, iso_points);
     }
 
-    iso_points->vert.clear();
-    BaseSampler mps(iso_points);
-    tri::SurfaceSampling<CMesh,BaseSampler>::PoissonDiskParam pp;
-    tri::SurfaceSampling<CMesh,BaseSampler>::PoissonDisk(tentative_mesh, mps, *presampledMesh, radius,pp);
-
     for (int i = 0; i < iso_points->vert.size(); i++)
     {
       CVertex& v = iso_points->vert[i];
@@ -1399,37 +1175,74 @@ void Poisson::runPoissonFieldAndExtractIsoPoints()
       v.recompute_m_render();
     }
     iso_points->vn = iso_points->vert.size();
+    timer.end();
+  }
 
+  if (band_field && !iso_points->vert.empty())
+  {
+    //the gradient confidence samples half a radius along the normals, the whole bricks add the margin
+    timer.start("generate Poisson field near ISO points");
+    vector<Point3D<Real> > band_points(iso_points->vert.size());
+    for (int i = 0; i < iso_points->vert.size(); i++)
+    {
+      for (int a = 0; a < 3; ++a)
+        band_points[i].coords[a] = iso_points->vert[i].P()[a];
+    }
+    int res;
+    vector<int> cells;
+    vector<Real> values;
+    tree.GetSolutionBand(band_points, Real(para->getDouble("CGrid Radius")), res, cells, values, isoValue, Par.VoxelDepth);
 
-    iso_points->face.clear();
-    for (int i = 0; i < tentative_mesh.face.size(); i++)
+    //cell x + y * res + z * res2 of the solution grid is field cell (x, y, z), as in the dense copy
+    int res2 = res * res;
+    int bricks = VoxelGrid::bricks(res);
+    vector<char> keep_bricks(bricks * bricks * bricks, 0);
+    for (int n = 0; n < cells.size(); n++)
     {
-      iso_points->face.push_back(tentative_mesh.face[i]);
+      int x = cells[n] % res, y = (cells[n] / res) % res, z = cells[n] / res2;
+      int bx = x >> VoxelGrid::BRICK_BITS, by = y >> VoxelGrid::BRICK_BITS, bz = z >> VoxelGrid::BRICK_BITS;
+      keep_bricks[(bx * bricks + by) * bricks + bz] = 1;
     }
-    iso_points->fn = iso_points->face.size();
 
+    Point3f center_p(tree._center.coords[0], tree._center.coords[1], tree._center.coords[2]);
+    float space = tree._scale * (1.0 / res);
+    field_points->resizeSparse(VoxelGrid::FIELD_GRID, center_p, space, res, res, res, keep_bricks);
+    auto copyCells = [&](int begin, int end)
+    {
+      for (int n = begin; n < end; n++)
+      {
+        int x = cells[n] % res, y = (cells[n] / res) % res, z = cells[n] / res2;
+        field_points->confidence(field_points->index(x, y, z)) = float( values[n] );
+      }
+    };
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, cells.size()),
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      copyCells(r.begin(), r.end());
+    });
+#else
+    copyCells(0, cells.size());
+#endif
+
+    cout << "field point size:  " << field_points->size() << " of " << res * res2 << endl;
+    cout << "resolution:  " << res << endl;
+    para->setValue("Field Points Resolution", IntValue(res));
+    field_points->normalizeConfidence(0);
+    timer.end();
   }
 }
 
 void Poisson::runSlice()
 {
-  if (field_points->vert.empty())
+  if (field_points->empty())
   {
     return;
   }
-  int iso_num = field_points->vert.size();
   double show_percentage = para->getDouble("Show Slice Percentage");
   bool paraller_slice_mode = para->getBool("Parallel Slices Mode");
 
-  int res = 0;
-  for (; res < iso_num; res++)
-  {
-    if (res * res * res >= iso_num)
-    {
-      break;
-    }
-  }
-  int res2 = res * res;
+  int res = field_points->resX();
 
   show_percentage = (std::max)(0., show_percentage);
   show_percentage = (std::min)(1., show_percentage);
@@ -1451,7 +1264,7 @@ void Poisson::runSlice()
         {
           for (int k = begin; k < end; k++)
           {      
-            (*slices)[0].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+            (*slices)[0].slice_nodes.push_back(field_points->getVertex(i, j, k));
           }
         }
       }
@@ -1469,14 +1282,14 @@ void Poisson::runSlice()
         {
           for (int k = begin; k < end; k++)
           {      
-            (*slices)[0].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+            (*slices)[0].slice_nodes.push_back(field_points->getVertex(i, j, k));
           }
         }
         /*for (int j = begin; j < end; j++)
         {
         for (int k = slice_k_num; k < slice_k_num+1; k++)
         {      
-        (*slices)[0].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+        (*slices)[0].slice_nodes.push_back(field_points->getVertex(i, j, k));
         }
         }*/
       }
@@ -1499,7 +1312,7 @@ void Poisson::runSlice()
         {
           for (int k = begin; k < end; k++)
           {      
-            (*slices)[1].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+            (*slices)[1].slice_nodes.push_back(field_points->getVertex(i, j, k));
           }
         }
       }
@@ -1517,14 +1330,14 @@ void Poisson::runSlice()
         {
           for (int k = begin; k < end; k++)
           {      
-            (*slices)[1].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+            (*slices)[1].slice_nodes.push_back(field_points->getVertex(i, j, k));
           }
         }
         /*for (int j = begin; j < end; j++)
         {
         for (int k = slice_k_num; k < slice_k_num+1; k++)
         {      
-        (*slices)[1].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+        (*slices)[1].slice_nodes.push_back(field_points->getVertex(i, j, k));
         }
         }*/
       }
@@ -1547,7 +1360,7 @@ void Poisson::runSlice()
         {
           for (int k = slice_k_num; k < slice_k_num+1; k++)
           {      
-            (*slices)[2].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+            (*slices)[2].slice_nodes.push_back(field_points->getVertex(i, j, k));
           }
         }
       }
@@ -1566,14 +1379,14 @@ void Poisson::runSlice()
         {
           for (int k = begin; k < end; k++)
           {      
-            (*slices)[2].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+            (*slices)[2].slice_nodes.push_back(field_points->getVertex(i, j, k));
           }
         }
         /*for (int j = begin; j < end; j++)
         {
         for (int k = slice_k_num; k < slice_k_num+1; k++)
         {      
-        (*slices)[2].slice_nodes.push_back(field_points->vert[i * res2 + j * res + k]);
+        (*slices)[2].slice_nodes.push_back(field_points->getVertex(i, j, k));
         }
         }*/
       }
@@ -1598,19 +1411,14 @@ void Poisson::runSlicePoints()
     source_points = samples;
   }
 
-  int iso_num = field_points->vert.size();
+  if (field_points->empty())
+  {
+    return;
+  }
   double show_percentage = para->getDouble("Show Slice Percentage");
   bool paraller_slice_mode = para->getBool("Parallel Slices Mode");
 
-  int res = 0;
-  for (; res < iso_num; res++)
-  {
-    if (res * res * res >= iso_num)
-    {
-      break;
-    }
-  }
-  int res2 = res * res;
+  int res = field_points->resX();
 
   double cut_width = para->getDouble("CGrid Radius") * 0.5;
 
@@ -1621,11 +1429,8 @@ void Poisson::runSlicePoints()
     int slice_i_num = res * slice_i_position;
     slice_i_num = (std::min)(slice_i_num, res-2);
 
-    int anchor_index = slice_i_num * res2;
-    int anchor_next_index = (slice_i_num+1) * res2;
-
-    Point3f anchor_point = field_points->vert[anchor_index];
-    Point3f anchor_next_point = field_points->vert[anchor_next_index];
+    Point3f anchor_point = field_points->position(slice_i_num, 0, 0);
+    Point3f anchor_next_point = field_points->position(slice_i_num+1, 0, 0);
     Point3f direction = (anchor_next_point - anchor_point).Normalize();
 
     GlobalFun::cutPointSelfSlice(source_points, anchor_point, direction, cut_width);
@@ -1639,11 +1444,8 @@ void Poisson::runSlicePoints()
     int slice_j_num = res * slice_j_position;
     slice_j_num = (std::min)(slice_j_num, res-2);
 
-    int anchor_index = slice_j_num * res;
-    int anchor_next_index = (slice_j_num+1) * res;
-
-    Point3f anchor_point = field_points->vert[anchor_index];
-    Point3f anchor_next_point = field_points->vert[anchor_next_index];
+    Point3f anchor_point = field_points->position(0, slice_j_num, 0);
+    Point3f anchor_next_point = field_points->position(0, slice_j_num+1, 0);
     Point3f direction = (anchor_next_point - anchor_point).Normalize();
 
     GlobalFun::cutPointSelfSlice(source_points, anchor_point, direction, cut_width);
@@ -1656,11 +1458,8 @@ void Poisson::runSlicePoints()
     int slice_k_num = res * slice_k_position;
     slice_k_num = (std::min)(slice_k_num, res-2);
 
-    int anchor_index = slice_k_num;
-    int anchor_next_index = (slice_k_num+1);
-
-    Point3f anchor_point = field_points->vert[anchor_index];
-    Point3f anchor_next_point = field_points->vert[anchor_next_index];
+    Point3f anchor_point = field_points->position(0, 0, slice_k_num);
+    Point3f anchor_next_point = field_points->position(0, 0, slice_k_num+1);
     Point3f direction = (anchor_next_point - anchor_point).Normalize();
 
     GlobalFun::cutPointSelfSlice(source_points, anchor_point, direction, cut_width);
@@ -2044,32 +1843,43 @@ void Poisson::runComputeIsoSmoothnessConfidence()
     time.start("confidence 1");
     int knn = global_paraMgr.norSmooth.getInt("PCA KNN");
     cout << "Knn: " << knn << endl;
-    GlobalFun::computeAnnNeigbhors(original->vert, iso_points->vert, knn, false, "runComputeIsoSmoothnessConfidence");
-    
-    float min_confidence = GlobalFun::getDoubleMAXIMUM();
-    float max_confidence = 0;
-    for (int i = 0; i < iso_points->vert.size(); i++)
-    {
-      confidences[i][curr] = 0.01;
-      CVertex& v = iso_points->vert[i];
+    NeighborGraph graph;
+    neighbor_search->computeKnnGraph(original, iso_points->vert, knn, graph);
 
-      if (v.neighbors.empty() && i < 100)
-      {
-        cout << "empty neighborhood" << endl;
-        continue;
-      }
-      vector<int>* neighbors = &v.neighbors;
-      double sum_proj2 = 0.0;
-      for (int j = 0; j < v.neighbors.size(); j++)
+    //every iso point only writes its own confidence, the points are independent
+    auto confidence1 = [&](size_t begin, size_t end)
+    {
+      for (size_t i = begin; i < end; i++)
       {
-        CVertex& t = original->vert[(*neighbors)[j]];
+        confidences[i][curr] = 0.01;
+        CVertex& v = iso_points->vert[i];
+
+        int nb_neighbors = graph.count(i);
+        if (nb_neighbors == 0)
+        {
+          continue;
+        }
+        double sum_proj2 = 0.0;
+        for (int j = 0; j < nb_neighbors; j++)
+        {
+          CVertex& t = original->vert[graph.neighbor(i, j)];
         
-        double proj = v.N()*(t.P() - v.P());
-        double proj2 = proj * proj;
-        sum_proj2 += proj2;
+          double proj = v.N()*(t.P() - v.P());
+          double proj2 = proj * proj;
+          sum_proj2 += proj2;
+        }
+        confidences[i][curr] = -sum_proj2 / nb_neighbors;
       }
-      confidences[i][curr] = -sum_proj2 / neighbors->size();
-    }
+    };
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, iso_points->vert.size()), 
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      confidence1(r.begin(), r.end());
+    });
+#else
+    confidence1(0, iso_points->vert.size());
+#endif
 
     curr++;
     time.end();
@@ -2091,50 +1901,53 @@ void Poisson::runComputeIsoSmoothnessConfidence()
     time.start("confidence 4");
     int knn = para->getDouble("Original KNN");
     cout << "Knn: " << knn << endl;
-    GlobalFun::computeAnnNeigbhors(original->vert, iso_points->vert, knn, false, "runComputeIsoSmoothnessConfidence");
-    
+    NeighborGraph graph;
+    neighbor_search->computeKnnGraph(original, iso_points->vert, knn, graph, true);
+
     double sigma = global_paraMgr.norSmooth.getDouble("Sharpe Feature Bandwidth Sigma");
     double sigma_threshold = pow(max(1e-8,1-cos(sigma/180.0*3.1415926)), 2);
 
-    for (int i = 0; i < iso_points->vert.size(); i++)
+    auto confidence4 = [&](size_t begin, size_t end)
     {
-      confidences[i][curr] = 0.01;
-      CVertex& v = iso_points->vert[i];
-
-      if (v.neighbors.empty())
+      for (size_t i = begin; i < end; i++)
       {
-        cout << "empty neighborhood" << endl;
-        continue;
-      }
-      vector<int>* neighbors = &v.neighbors;
-      double sum_diff = 0.0;
+        confidences[i][curr] = 0.01;
+        CVertex& v = iso_points->vert[i];
 
-      double max_dist2 = 0.0;
-      for (int j = 0; j < v.neighbors.size(); j++)
-      {
-        CVertex& t = original->vert[(*neighbors)[j]];
-        double dist2 = GlobalFun::computeEulerDistSquare(v.P(), t.P());
-        if (dist2 > max_dist2)
+        int nb_neighbors = graph.count(i);
+        if (nb_neighbors == 0)
         {
-          max_dist2 = dist2;
+          continue;
         }
-      }
-      double iradius16 = -4.0/max_dist2;
-      //double max_dist = sqrt(max_dist2);
-      double sum_weight = 0.0;
-      for (int j = 0; j < v.neighbors.size(); j++)
-      {
-        CVertex& t = original->vert[(*neighbors)[j]];
-        float dist2  = (v.P() - t.P()).SquaredNorm();
-        float dist_diff = exp(dist2 * iradius16);
-        double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
+        double sum_diff = 0.0;
 
-        sum_diff += dist_diff * normal_diff;
-        //sum_weight +=  w;
+        //the knn come sorted, the farthest is the last one
+        double max_dist2 = graph.dist2(i, nb_neighbors - 1);
+        double iradius16 = -4.0/max_dist2;
+        double sum_weight = 0.0;
+        for (int j = 0; j < nb_neighbors; j++)
+        {
+          CVertex& t = original->vert[graph.neighbor(i, j)];
+          float dist2  = graph.dist2(i, j);
+          float dist_diff = exp(dist2 * iradius16);
+          double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
+
+          sum_diff += dist_diff * normal_diff;
+          //sum_weight +=  w;
+        }
+        //confidences[i][curr] = sum_diff / sum_weight;
+        confidences[i][curr] = sum_diff;
       }
-      //confidences[i][curr] = sum_diff / sum_weight;
-      confidences[i][curr] = sum_diff;
-    }
+    };
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, iso_points->vert.size()), 
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      confidence4(r.begin(), r.end());
+    });
+#else
+    confidence4(0, iso_points->vert.size());
+#endif
 
     curr++;
     time.end();
@@ -2146,50 +1959,53 @@ void Poisson::runComputeIsoSmoothnessConfidence()
     time.start("confidence 4");
     int knn = para->getDouble("Original KNN");
     cout << "Knn: " << knn << endl;
-    GlobalFun::computeAnnNeigbhors(original->vert, iso_points->vert, knn, false, "runComputeIsoSmoothnessConfidence");
+    NeighborGraph graph;
+    neighbor_search->computeKnnGraph(original, iso_points->vert, knn, graph, true);
 
     double sigma = global_paraMgr.norSmooth.getDouble("Sharpe Feature Bandwidth Sigma");
     double sigma_threshold = pow(max(1e-8,1-cos(sigma/180.0*3.1415926)), 2);
 
-    for (int i = 0; i < iso_points->vert.size(); i++)
+    auto confidence3 = [&](size_t begin, size_t end)
     {
-      confidences[i][curr] = 0.01;
-      CVertex& v = iso_points->vert[i];
-
-      if (v.neighbors.empty())
+      for (size_t i = begin; i < end; i++)
       {
-        cout << "empty neighborhood" << endl;
-        continue;
-      }
-      vector<int>* neighbors = &v.neighbors;
-      double sum_diff = 0.0;
+        confidences[i][curr] = 0.01;
+        CVertex& v = iso_points->vert[i];
 
-      double max_dist2 = 0.0;
-      for (int j = 0; j < v.neighbors.size(); j++)
-      {
-        CVertex& t = original->vert[(*neighbors)[j]];
-        double dist2 = GlobalFun::computeEulerDistSquare(v.P(), t.P());
-        if (dist2 > max_dist2)
+        int nb_neighbors = graph.count(i);
+        if (nb_neighbors == 0)
         {
-          max_dist2 = dist2;
+          continue;
         }
-      }
-      double iradius16 = -4.0/max_dist2;
-      //double max_dist = sqrt(max_dist2);
-      double sum_weight = 0.0;
-      for (int j = 0; j < v.neighbors.size(); j++)
-      {
-        CVertex& t = original->vert[(*neighbors)[j]];
-        float dist2  = (v.P() - t.P()).SquaredNorm();
-        float dist_diff = exp(dist2 * iradius16);
-        double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
+        double sum_diff = 0.0;
 
-        sum_diff += dist_diff * normal_diff;
-        sum_weight +=  dist_diff;
+        //the knn come sorted, the farthest is the last one
+        double max_dist2 = graph.dist2(i, nb_neighbors - 1);
+        double iradius16 = -4.0/max_dist2;
+        double sum_weight = 0.0;
+        for (int j = 0; j < nb_neighbors; j++)
+        {
+          CVertex& t = original->vert[graph.neighbor(i, j)];
+          float dist2  = graph.dist2(i, j);
+          float dist_diff = exp(dist2 * iradius16);
+          double normal_diff = exp(-pow(1-v.N()*t.N(), 2)/sigma_threshold);
+
+          sum_diff += dist_diff * normal_diff;
+          sum_weight +=  dist_diff;
+        }
+        confidences[i][curr] = sum_diff / sum_weight;
+        //confidences[i][curr] = sum_diff;
       }
-      confidences[i][curr] = sum_diff / sum_weight;
-      //confidences[i][curr] = sum_diff;
-    }
+    };
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, iso_points->vert.size()), 
+      [&](const tbb::blocked_range<size_t>& r)
+    {
+      confidence3(r.begin(), r.end());
+    });
+#else
+    confidence3(0, iso_points->vert.size());
+#endif
 
     curr++;
     time.end();
@@ -2238,85 +2054,44 @@ void Poisson::runComputeIsoGradientConfidence()
     confidences_temp.push_back(iso_points->vert[i].eigen_confidence);
   }
 
-  if (field_points->vert.empty())
+  if (field_points->empty())
   {
     cout << "need field points" << endl;
     return;
   }
   else
   {
-    cout << "field points: " << field_points->vert.size() << endl;
+    cout << "field points: " << field_points->size() << endl;
   }
 
+  //the field is sampled on both sides of each iso point, half a radius along the normal.
+  //that is where the weighted ball average over the grid cells used to put its centroid,
+  //and the scale of the difference goes away in the normalization below
   double radius = para->getDouble("CGrid Radius");
-  double radius2 = radius * radius;
-  double iradius16 = -4.0 / radius2;
-
-  double sigma = global_paraMgr.norSmooth.getDouble("Sharpe Feature Bandwidth Sigma");
-  //double sigma = 35;
-  double sigma_threshold = pow(max(1e-8,1-cos(sigma/180.0*3.1415926)), 2);
-
-  GlobalFun::computeBallNeighbors(iso_points, field_points, 
-                                  radius, field_points->bbox);
+  float offset = radius * 0.5;
 
-  for (int i = 0; i < iso_points->vn; i++)
+  auto gradientConfidence = [&](int begin, int end)
   {
-    CVertex& v = iso_points->vert[i];
-
-    float positive_sum = 0.0;
-    float negative_sum = 0.0;
-    float positive_w_sum = 0.0;
-    float negative_w_sum = 0.0;
-
-    for (int j = 0; j < v.original_neighbors.size(); j++)
+    for (int i = begin; i < end; i++)
     {
-      int index = v.original_neighbors[j];
-      CVertex& t = field_points->vert[index];
-
-      //cout << t.eigen_confidence << endl;
-
-      Point3f diff = t.P() - v.P();
+      CVertex& v = iso_points->vert[i];
       Point3f vn = v.N();
-      float proj = diff * v.N();
+      vn.Normalize();
 
-      float dist2  = diff.SquaredNorm();
-      float w1 = exp(dist2 * iradius16);
-      float w2 = 1.0;
-
-      if (proj > 0)
-      {
-        w2 = exp(-pow(1-vn*diff.Normalize(), 2)/sigma_threshold); 
-      }
-      else
-      {
-        vn *= -1;
-        w2 = exp(-pow(1-vn*diff.Normalize(), 2)/sigma_threshold); 
-      } 
-      
-      float w = w1 * w2;
-
-      if (proj > 0)
-      {
-        positive_sum += w * t.eigen_confidence;
-        positive_w_sum += w;
-      }
-      else
-      {
-        negative_sum += w * t.eigen_confidence;
-        negative_w_sum += w;
-      }
+      float positive = field_points->interpolateConfidence(v.P() + vn * offset);
+      float negative = field_points->interpolateConfidence(v.P() - vn * offset);
+      v.eigen_confidence = (std::max)(1e-6f, abs(positive - negative));
     }
-
-    if (positive_w_sum > 0 && negative_w_sum > 0)
-    {
-      v.eigen_confidence = abs(positive_sum / positive_w_sum - negative_sum / negative_w_sum);
-      //cout << v.eigen_confidence << endl;
-    }
-    else
-    {
-      v.eigen_confidence = 1e-6;
-    }
-  }
+  };
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, iso_points->vn),
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    gradientConfidence(r.begin(), r.end());
+  });
+#else
+  gradientConfidence(0, iso_points->vn);
+#endif
   GlobalFun::normalizeConfidence(iso_points->vert, 0);
 
   if (para->getBool("Use Confidence 4"))
@@ -2375,16 +2150,19 @@ void Poisson::runComputeIsoHoleConfidence()
   assert(!original->vert.empty());
   global_paraMgr.poisson.setValue("Run Poisson On Original", BoolValue(true));
   global_paraMgr.poisson.setValue("Run Extract MC Points", BoolValue(true));
-  runPoissonFieldAndExtractIsoPoints_ByEXE();
+  runPoissonFieldAndExtractIsoPoints();
   global_paraMgr.poisson.setValue("Run Extract MC Points", BoolValue(false));
   global_paraMgr.poisson.setValue("Run Poisson On Original", BoolValue(false));
 
   assert(!iso_points->vert.empty());
-  GlobalFun::computeAnnNeigbhors(original->vert, iso_points->vert, 1, false, "runComputeIsoSmoothnessConfidence");
+  NeighborGraph graph;
+  neighbor_search->computeKnnGraph(original, iso_points->vert, 1, graph, true);
 
   for(int i = 0; i < iso_points->vert.size(); ++i){
     CVertex& v = iso_points->vert[i];
-    double dist = GlobalFun::computeEulerDist(v.P(), original->vert[v.neighbors[0]]);
+    if (graph.count(i) == 0)
+      continue;
+    double dist = sqrt(graph.dist2(i, 0));
     v.eigen_confidence = dist;
   }
 
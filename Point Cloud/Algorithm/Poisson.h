@@ -2,6 +2,7 @@
 #include "GlobalFunction.h"
 #include <algorithm>
 #include <iostream>
+#include <tbb/parallel_for.h>
 #include "PointCloudAlgorithm.h"
 #include <fstream>
 #include <wrap/io_trimesh/import.h>
@@ -10,6 +11,9 @@
 using namespace vcg;
 using namespace std;
 
+class PoissonContext;
+template< int Degree , bool OutputDensity > class PoissonSolverCache;
+
 class Poisson : public PointCloudAlgorithm
 {
 public:
@@ -32,7 +36,6 @@ private:
 
   void runPoisson();
   void runPoissonFieldAndExtractIsoPoints();
-  void runPoissonFieldAndExtractIsoPoints_ByEXE();
   void runLabelISO();
   void runIsoSmooth();
   void runLabelBoundaryPoints();
@@ -57,10 +60,13 @@ private:
 	CMesh* original;
   CMesh* iso_points;
   CMesh* view_candidates;
-  CMesh* field_points;
+  VoxelGrid* field_points;
   CMesh* model;
   Slices* slices;
+  NeighborSearch* neighbor_search;
   CMesh tentative_mesh;
+  PoissonContext* poisson_context; // the previous reconstruction, seeds the next solve
+  PoissonSolverCache<2, false>* solver_cache; // the B-spline tables and the node pool, kept between solves
   
 	RichParameterSet* para;
 	Box3f m_box;
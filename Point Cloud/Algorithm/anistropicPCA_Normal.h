@@ -41,6 +41,7 @@
 
 //#include "KnnNeighbor.h"
 #include "cmesh.h"
+#include "NeighborSearch.h"
 
 
 template < class VERTEX_CONTAINER >
@@ -89,24 +90,8 @@ public:
 	//}
 
 
-	static void ComputeAPcaNormalsByKNN(const VertexIterator& begin, const VertexIterator& end, const unsigned int k, double radius, const float sigma)
+	static void ComputeAPcaNormalsByKNN(const VertexIterator& begin, const VertexIterator& end, const NeighborGraph& graph, double radius, const float sigma)
 	{
-		vector<vector<int> > neighborMap;
-		neighborMap.assign(end - begin, vector<int>());
-
-		int curr_index = 0;
-		for (VertexIterator iter=begin; iter!=end; iter++, curr_index++)
-		{
-			if(iter->neighbors.empty())
-				continue;
-
-			for(int j = 0; j < iter->neighbors.size(); j++)
-			{
-				neighborMap[curr_index].push_back(iter->neighbors[j]);
-			}
-		}
-
-
 		double radius2 = radius*radius;
 		double iradius16 = -4/radius2; 
 
@@ -117,12 +102,10 @@ public:
 			CoordType diff;
 			covariance_matrix.SetZero();
 			int neighborIndex = -1;
-			int neighbor_size = iter->neighbors.size();
+			int neighbor_size = graph.count(currIndex);
 			for (unsigned int n=0; n<neighbor_size; n++)
 			{
-				neighborIndex = neighborMap[currIndex][n];
-				if(neighborIndex < 0)
-					break;
+				neighborIndex = graph.neighbor(currIndex, n);
 				VertexIterator neighborIter = begin + neighborIndex;
 
 				diff = iter->P() - neighborIter->P();
@@ -21,6 +21,7 @@ DataMgr::~DataMgr(void)
 
 void DataMgr::clearCMesh(CMesh& mesh)
 {
+  neighbor_search.invalidate(&mesh);
   mesh.face.clear();
   mesh.fn = 0;
   mesh.vert.clear();
@@ -86,7 +87,7 @@ bool DataMgr::isIsoPointsEmpty()
 
 bool DataMgr::isFieldPointsEmpty()
 {
-  return field_points.vert.empty();
+  return field_points.empty();
 }
 
 bool DataMgr::isScannedMeshEmpty()
@@ -106,7 +107,7 @@ bool DataMgr::isPoissonSurfaceEmpty()
 
 bool DataMgr::isViewGridsEmpty()
 {
-  return view_grid_points.vert.empty();
+  return view_grid_points.empty();
 }
 
 bool DataMgr::isNBVCandidatesEmpty()
@@ -117,6 +118,7 @@ bool DataMgr::isNBVCandidatesEmpty()
 void DataMgr::loadPlyToModel(QString fileName)
 {
   clearCMesh(model);
+  model_bvh.clear();
   curr_file_name = fileName;
 
   int mask = tri::io::Mask::IOM_ALL;
@@ -137,6 +139,8 @@ void DataMgr::loadPlyToModel(QString fileName)
     model.bbox.Add(vi->P());
   }
   model.vn = model.vert.size();
+
+  model_bvh.build(&model);
 }
 
 void DataMgr::loadPlyToOriginal(QString fileName)
@@ -398,10 +402,8 @@ CMesh* DataMgr::getCurrentIsoPoints()
   return & iso_points;
 }
 
-CMesh* DataMgr::getCurrentFieldPoints()
+VoxelGrid* DataMgr::getCurrentFieldPoints()
 {
-  if(&field_points == NULL) return NULL;
-
   return & field_points;
 }
 
@@ -423,6 +425,16 @@ CMesh* DataMgr::getCurrentModel()
   return &model;
 }
 
+MeshBVH* DataMgr::getModelBVH()
+{
+  return &model_bvh;
+}
+
+NeighborSearch* DataMgr::getNeighborSearch()
+{
+  return &neighbor_search;
+}
+
 CMesh* DataMgr::getCurrentPoissonSurface()
 {
   return &poisson_surface;
@@ -480,7 +492,7 @@ double DataMgr::getCameraMaxAngle()
   return camera_max_angle;
 }
 
-CMesh*
+VoxelGrid*
   DataMgr::getViewGridPoints()
 {
   return &view_grid_points;
@@ -759,6 +771,7 @@ Box3f DataMgr::normalizeAllMesh()
   global_paraMgr.data.setValue("Max Normalize Length", DoubleValue(max_length));
 
   normalizeROSA_Mesh(model);
+  model_bvh.refit();
   normalizeROSA_Mesh(original, true);
   normalizeROSA_Mesh(samples);
   normalizeROSA_Mesh(iso_points);
@@ -797,16 +810,18 @@ void DataMgr::clearData()
   clearCMesh(original);
   clearCMesh(samples);
   clearCMesh(iso_points);
-  clearCMesh(field_points);
+  field_points.clear();
 
   clearCMesh(model);  
+  model_bvh.clear();
   clearCMesh(current_scanned_mesh);
 
-  clearCMesh(view_grid_points);
+  view_grid_points.clear();
   clearCMesh(nbv_candidates);
   clearCMesh(current_scanned_mesh);
 
   slices.clear();
+  neighbor_search.clear();
 }
 
 void DataMgr::recomputeQuad()
@@ -836,7 +851,7 @@ bool cmp_angle(const CVertex &v1, const CVertex &v2)
 
 void DataMgr::saveFieldPoints(QString fileName)
 {
-  if (field_points.vert.empty())
+  if (field_points.empty())
   {
     cout<<"save Field Points Error: Empty field_points" <<endl;
     return;
@@ -862,11 +877,10 @@ void DataMgr::saveFieldPoints(QString fileName)
   }
 
   //for (int i = 0; i < field_points.vert.size(); i++)
-  cout << field_points.vert.size() << " grids" << endl;
-  for (int i = 0; i < field_points.vert.size(); i++)  
+  cout << field_points.size() << " grids" << endl;
+  for (int i = 0; i < field_points.size(); i++)  
   {
-    CVertex& v = field_points.vert[i];
-    float eigen_value = v.eigen_confidence * 255;
+    float eigen_value = field_points.confidence(i) * 255;
 
     unsigned char pTest = static_cast<unsigned char>(eigen_value);
 
@@ -897,7 +911,7 @@ void DataMgr::saveFieldPoints(QString fileName)
 void
   DataMgr::saveViewGrids(QString fileName)
 {
-  if (view_grid_points.vert.empty()) return;
+  if (view_grid_points.empty()) return;
 
   ofstream out;
   out.open(fileName.toAscii(), std::ios::out | std::ios::binary);
@@ -907,10 +921,13 @@ void
     return;
   }
 
-  for (int i = 0; i < view_grid_points.vert.size(); ++i)
+  //the whole volume in (i, j, k) order, the cells a sparse grid doesn't store are 0
+  for (int i = 0; i < view_grid_points.resX(); ++i)
+  for (int j = 0; j < view_grid_points.resY(); ++j)
+  for (int k = 0; k < view_grid_points.resZ(); ++k)
   {
-    CVertex &v = view_grid_points.vert[i];
-    float eigen_value = v.eigen_confidence * 255;
+    int index = view_grid_points.index(i, j, k);
+    float eigen_value = index < 0 ? 0.0f : view_grid_points.confidence(index) * 255;
     unsigned char p = static_cast<unsigned char>(eigen_value);
     out << p;
   }
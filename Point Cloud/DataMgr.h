@@ -3,6 +3,9 @@
 #include "cmesh.h"
 #include "Parameter.h"
 #include "GlobalFunction.h"
+#include "MeshBVH.h"
+#include "VoxelGrid.h"
+#include "NeighborSearch.h"
 #include "vcg\complex\trimesh\update\selection.h"
 
 #include <qfile.h>
@@ -60,11 +63,13 @@ public:
   CMesh*                  getCurrentSamples();
   CMesh*                  getCurrentTemperalSamples();
   CMesh*                  getCurrentModel();
+  MeshBVH*                getModelBVH();
+  NeighborSearch*         getNeighborSearch();
   CMesh*                  getCurrentPoissonSurface();
   CMesh*                  getCurrentOriginal();
   CMesh*                  getCurrentTemperalOriginal();
   CMesh*                  getCurrentIsoPoints();
-  CMesh*                  getCurrentFieldPoints();
+  VoxelGrid*              getCurrentFieldPoints();
   Slices*                 getCurrentSlices();
   
   CMesh*                  getCameraModel();
@@ -75,7 +80,7 @@ public:
   double                  getCameraVerticalDist();
   double                  getCameraMaxDistance();
   double                  getCameraMaxAngle();
-  CMesh*                  getViewGridPoints();
+  VoxelGrid*              getViewGridPoints();
   CMesh*                  getNbvCandidates();
   vector<ScanCandidate>*  getInitCameraScanCandidates();
   vector<ScanCandidate>*  getScanCandidates();
@@ -118,6 +123,8 @@ private:
 
 public:
   CMesh                  model;
+  MeshBVH                model_bvh;
+  NeighborSearch         neighbor_search;
   CMesh                  original;
   CMesh                  poisson_surface;
   CMesh                 *temperal_original;
@@ -125,9 +132,9 @@ public:
   CMesh                  samples;
   CMesh                 *temperal_sample;
   CMesh                  iso_points;
-  CMesh                  field_points;
+  VoxelGrid              field_points;
   CMesh                  camera_model;
-  CMesh                  view_grid_points;
+  VoxelGrid              view_grid_points;
   CMesh                  nbv_candidates;
   Point3f                camera_pos;
   Point3f                camera_direction;
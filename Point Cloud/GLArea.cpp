@@ -357,17 +357,17 @@ void GLArea::paintGL()
 
     if (para->getBool("Show View Grids"))
     {
-      CMesh *nbv_grids = dataMgr.getViewGridPoints();
+      VoxelGrid *nbv_grids = dataMgr.getViewGridPoints();
 
       if (NULL == nbv_grids) return;
 
-      if(!nbv_grids->vert.empty())
+      if(!nbv_grids->empty())
       {
         glDrawer.draw(GLDrawer::DOT, nbv_grids);
       }
       else 
       {
-        CMesh* field_points = dataMgr.getCurrentFieldPoints();
+        VoxelGrid* field_points = dataMgr.getCurrentFieldPoints();
         if (!dataMgr.isFieldPointsEmpty())
         {
           glDrawer.draw(GLDrawer::DOT, field_points);
@@ -512,10 +512,10 @@ void GLArea::paintGL()
       glBoxWire(dataMgr.whole_space_box);
       CoordinateFrame(dataMgr.whole_space_box.Diag()/2.0).Render(this, NULL);
 
-      CMesh *view_grid_points = dataMgr.getViewGridPoints();
+      VoxelGrid *view_grid_points = dataMgr.getViewGridPoints();
       if (NULL == view_grid_points) return;
 
-      if(!view_grid_points->vert.empty())
+      if(!view_grid_points->empty())
       {
         glDrawer.drawGrid(view_grid_points, global_paraMgr.nbv.getInt("View Bin Each Axis"));
       }
@@ -653,9 +653,12 @@ void GLArea::runPointCloudAlgorithm(PointCloudAlgorithm& algorithm)
   int starttime, stoptime, timeused;
   starttime = clock();
 
+  //the cached trees are only kept right within a run, the points may have been edited since the last one
+  dataMgr.getNeighborSearch()->clear();
   algorithm.setInput(&dataMgr);
   algorithm.run();
   algorithm.clear();
+  dataMgr.getNeighborSearch()->clear();
 
   stoptime = clock();
   timeused = stoptime - starttime;
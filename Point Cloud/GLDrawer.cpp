@@ -86,32 +86,7 @@ void GLDrawer::draw(DrawType type, CMesh* _mesh)
     //if (abs(vi->pvs_value - 1) < 1e-7)
     //  continue;
 
-		Point3f& p = vi->P();      
-		Point3f& normal = vi->N();
-
-		if(!(bCullFace /*&& !vi->is_original*/) || isCanSee(p, normal))		
-		{
-			switch(type)
-			{
-			case DOT:
-				drawDot(*vi);
-				break;
-			case CIRCLE:
-				drawCircle(*vi);
-				break;
-			case QUADE:
-				drawQuade(*vi);
-				break;
-			case NORMAL:
-				drawNormal(*vi);
-				break;
-			case SPHERE:
-				drawSphere(*vi);
-				break;
-			default:
-				break;
-			}
-		}
+		drawVertex(type, *vi);
 
 		if (doPick) 
 		{
@@ -122,6 +97,64 @@ void GLDrawer::draw(DrawType type, CMesh* _mesh)
 	para->setValue("Doing Pick", BoolValue(false));
 }
 
+void GLDrawer::draw(DrawType type, VoxelGrid* grid)
+{
+  if (!grid)
+    return;
+
+  bool doPick = para->getBool("Doing Pick");
+  bool is_view_grid = (grid->getKind() == VoxelGrid::VIEW_GRID);
+
+  for (int i = 0; i < grid->size(); i++)
+  {
+    if (doPick)
+      glLoadName(i);
+
+    //test the flags before building a vertex for the cell
+    if (grid->flag(VoxelGrid::IGNORED, i))
+      continue;
+
+    if (bUseConfidenceSeparation && is_view_grid)
+      if (grid->confidence(i) < confidence_Separation_value)
+        continue;
+
+    CVertex v = grid->getVertex(i);
+    drawVertex(type, v);
+  }
+
+  para->setValue("Doing Pick", BoolValue(false));
+}
+
+void GLDrawer::drawVertex(DrawType type, CVertex& v)
+{
+	Point3f& p = v.P();      
+	Point3f& normal = v.N();
+
+	if(!(bCullFace /*&& !v.is_original*/) || isCanSee(p, normal))		
+	{
+		switch(type)
+		{
+		case DOT:
+			drawDot(v);
+			break;
+		case CIRCLE:
+			drawCircle(v);
+			break;
+		case QUADE:
+			drawQuade(v);
+			break;
+		case NORMAL:
+			drawNormal(v);
+			break;
+		case SPHERE:
+			drawSphere(v);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 bool GLDrawer::isCanSee(const Point3f& pos, const Point3f& normal)
 {
 	return  ( (view_point - pos) * normal >= 0 );
@@ -679,10 +712,11 @@ void GLDrawer::generateRandomColorList(int num)
 	}
 }
 
-void GLDrawer::drawGrid(const CMesh *cube_mesh, const int grid_num_each_edge = 3)
+void GLDrawer::drawGrid(const VoxelGrid *grid, const int grid_num_each_edge = 3)
 {
-  Point3f cube_box_max = cube_mesh->bbox.max;
-  Point3f cube_box_min = cube_mesh->bbox.min;
+  Box3f cube_box = grid->getBox();
+  Point3f cube_box_max = cube_box.max;
+  Point3f cube_box_min = cube_box.min;
   double grid_length = (cube_box_max - cube_box_min).X() / grid_num_each_edge;
   Point3f grid_diagonal = Point3f(grid_length, grid_length, grid_length);
 
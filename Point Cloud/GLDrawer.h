@@ -3,6 +3,7 @@
 #include <wrap/gl/space.h>
 #include <wrap/qt/gl_label.h>
 #include "cmesh.h"
+#include "VoxelGrid.h"
 #include "ParameterMgr.h"
 
 #include <QtOpenGL/QGLWidget>
@@ -54,9 +55,10 @@ public:
 
 	void setViewPoint(const Point3f& view){ view_point = view; }
 	void draw(DrawType type, CMesh* mesh);
+	void draw(DrawType type, VoxelGrid* grid);
   void drawCamera(vcc::Camera& camera, bool is_draw_border = true);
   void drawSlice(Slice& slice, double trans_value);
-  void drawGrid(const CMesh *cube_mesh, const int grid_num_each_edge);
+  void drawGrid(const VoxelGrid *grid, const int grid_num_each_edge);
 
 	void updateDrawer(vector<int>& pickList);
 
@@ -79,6 +81,7 @@ private:
 	
 	void draw(DrawType type);
 	bool isCanSee(const Point3f& pos,  const Point3f& normal);
+	void drawVertex(DrawType type, CVertex& v);
 
 	void drawDot(CVertex& v);
 	void drawCircle(CVertex& v);
@@ -7,6 +7,8 @@
 
 #include "grid.h"
 #include "GlobalFunction.h"
+#include "RayTriangle.h"
+#include "NeighborSearch.h"
 
 using namespace vcg;
 using namespace std;
@@ -103,6 +105,26 @@ void GlobalFun::computeBallNeighbors(CMesh* mesh0, CMesh* mesh1, double radius,
   //cout << "compute_Bll_Neighbors" << endl;
   //cout << "radius: " << radius << endl;
 
+#ifdef LINKED_WITH_TBB
+  //each point gathers its own neighbors from the grid of the search set,
+  //nothing is pushed to the other end of a pair so the points run in parallel
+  bool is_self = (mesh1 == NULL);
+  CMesh* search_set = is_self ? mesh0 : mesh1;
+  CGrid search_grid;
+  search_grid.init(search_set->vert, box, radius);
+
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, mesh0->vert.size()), 
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    for (size_t i = r.begin(); i < r.end(); i++)
+    {
+      CVertex& v = mesh0->vert[i];
+      vector<int>& result = is_self ? v.neighbors : v.original_neighbors;
+      result.clear();
+      search_grid.gather(v.cP(), is_self ? &v : NULL, result);
+    }
+  });
+#else
   CGrid samples_grid;
   samples_grid.init(mesh0->vert, box, radius);
   //cout << "finished init" << endl;
@@ -127,7 +149,7 @@ void GlobalFun::computeBallNeighbors(CMesh* mesh0, CMesh* mesh1, double radius,
 
     samples_grid.iterate(self_neighbors, other_neighbors);
   }
-
+#endif
 }
 
 double GlobalFun::estimateKnnSize(CMesh* samples, CMesh* original, double radius, vcg::Box3f& box)
@@ -149,76 +171,17 @@ double GlobalFun::estimateKnnSize(CMesh* samples, CMesh* original, double radius
 void GlobalFun::computeAnnNeigbhors(vector<CVertex> &datapts, vector<CVertex> &querypts, int knn, bool need_self_included = false, QString purpose = "?_?")
 {
 	cout << endl <<"Compute ANN for: " << purpose.toStdString() << endl;
-	int numKnn = knn + 1;
 
   vector<CVertex>::iterator vi_temp;
   for(vi_temp = datapts.begin(); vi_temp != datapts.end(); ++vi_temp)
       vi_temp->neighbors.clear();
 
-  //if (querypts.size() <= numKnn+2)
-  //{
-  //  vector<CVertex>::iterator vi;
-  //  for(vi = datapts.begin(); vi != datapts.end(); ++vi)
-  //      vi->neighbors.clear();
-
-  //  return;
-  //}
-
-	int					    nPts;			 // actual number of data points
-	ANNpointArray		dataPts;	 // data points
-  ANNpoint			  queryPt;	 // query point
-  ANNidxArray			nnIdx;		 // near neighbor indices
-  ANNdistArray		dists;		 // near neighbor distances
-  ANNkd_tree*			kdTree;		 // search structure
-  int			k				= numKnn;			      // number of nearest neighbors
-  int			dim			= 3;			          // dimension
-  double	eps			= 0;			          // error bound
-	int			maxPts	= numKnn + 3000000;	// maximum number of data points
-
-	if (datapts.size() >= maxPts)
-	{
-		cout << "Too many data" << endl;
-		return;
-	}
-	queryPt = annAllocPt(dim);					// allocate query point
-	dataPts = annAllocPts(maxPts, dim);	// allocate data points
-	nnIdx   = new ANNidx[k];						// allocate near neigh indices
-	dists   = new ANNdist[k];						// allocate near neighbor dists
-
-	vector<CVertex>::iterator vi;
-	int index = 0;
-	for(vi = datapts.begin(); vi != datapts.end(); ++vi)
-	{
-		for(int j = 0; j < 3; j++)
-			dataPts[index][j] = double(vi->P()[j]); 
-
-		index++;
-	}
-  nPts = datapts.size();	 // read data points
-	kdTree = new ANNkd_tree( // build search structure
-		dataPts,					     // the data points
-		nPts,						       // number of points
-		dim);						       // dimension of space
-	for (vi = querypts.begin(); vi != querypts.end(); ++vi) 
-	{
-		vi->neighbors.clear();
-		for (int j = 0; j < 3; j++) 
-			queryPt[j] = vi->P()[j];
-
-		kdTree->annkSearch( // search
-			queryPt,					// query point
-			k,								// number of near neighbors
-			nnIdx,						// nearest neighbors (returned)
-			dists,						// distance (returned)
-			eps);							// error bound
-
-		for (int k = 1; k < numKnn; k++)
-			vi->neighbors.push_back(nnIdx[k]);
-	}
-	delete [] nnIdx; // clean things up
-	delete [] dists;
-	delete kdTree;
-	annClose();			 // done with ANN
+  //one-off tree, DataMgr's NeighborSearch keeps them between calls
+  PointKdTree kd_tree;
+  kd_tree.build(datapts);
+  NeighborGraph graph;
+  NeighborSearch::knnGraph(kd_tree, querypts, knn, graph);
+  graph.copyTo(querypts);
 }
 
 void GlobalFun::computeKnnNeigbhors(vector<CVertex> &datapts, vector<CVertex> &querypts, int numKnn, bool need_self_included = false, QString purpose = "?_?")
@@ -773,104 +736,31 @@ bool inline GlobalFun::isPointInTriangle_3(Point3f& v0, Point3f& v1, Point3f& v2
   else return false;
 }
 
-double GlobalFun::computeMeshLineIntersectPoint(const CMesh *target, const Point3f& p, const Point3f& line_dir, Point3f& result, Point3f& result_normal, bool& is_barely_visible)
+double GlobalFun::computeMeshLineIntersectPoint(const CMesh *target, const TriangleSoA& faces, const Point3f& p, const Point3f& line_dir, Point3f& result, Point3f& result_normal, bool& is_barely_visible)
 {
   //compute the intersecting point between the ray and the mesh
-  int n_face = target->face.size();
   double min_dist = BIG;
 
-#ifdef LINKED_WITH_TBB
-  tbb::parallel_for(tbb::blocked_range<size_t>(0, n_face), 
-    [&](const tbb::blocked_range<size_t>& r)
-  {
-    for (size_t f = r.begin(); f < r.end(); ++f)
-    {
-      Point3f& v0 = target->face[f].V(0)->P();
-      Point3f& v1 = target->face[f].V(1)->P();
-      Point3f& v2 = target->face[f].V(2)->P();
-
-      Point3f face_norm = target->face[f].cN();
-      //if the face can't be seen, then continue
-      if(face_norm * line_dir > 0) continue;
-
-      //the line cross the point: pos, and line vector is viewray_iter 
-      double tmp = face_norm * line_dir;
+  //rays are traced in parallel by the caller (one scanline per task), so the face loop
+  //stays serial. the SIMD kernel tests all the packed faces
+  float t_best = BIG;
+  int hit_face = faces.intersect(0, faces.size(), p, line_dir, t_best);
 
-      if (abs(tmp) < EPS_SUN)
-      continue;
-
-      double tmp2 = 1.0f / tmp;
-      double t = (v0 - p) * face_norm * tmp2;
-      Point3f intersect_point = p + line_dir * t;
-
-      if(GlobalFun::isPointInTriangle_3(v0, v1, v2, intersect_point)) 
-      {
-        Point3f d = intersect_point - p;
-        double dist_temp = d.SquaredNorm();
-        //get the visible point
-        if (dist_temp < min_dist)
-        {
-          min_dist = dist_temp;
-          result = intersect_point;
-          result_normal = face_norm;
-
-          //for visibility based NBV. classify the scanned points
-          //TODO: open for visibility
-          /*if (computeRealAngleOfTwoVertor(face_norm, -line_dir) > 60.0f)
-            is_barely_visible = true;*/
-        }
-      }
-    }
-  });
-#else
-  for (int f = 0; f < n_face; ++f)
+  if (hit_face >= 0)
   {
-    Point3f& v0 = target->face[f].V(0)->P();
-    Point3f& v1 = target->face[f].V(1)->P();
-    Point3f& v2 = target->face[f].V(2)->P();
-    Point3f e1 = v0 - v1;
-    Point3f e2 = v1 - v2;
-    Point3f face_norm = (e1 ^ e2).Normalize();
-    //if the face can't be seen, then continue
-    if(face_norm * line_dir > 0) continue;
-
-    //just choose one point and calculate the distance,if the triangle is too far from the line, then continue
-    /*double A = line_dir.Y();
-    double B = line_dir.Z() - line_dir.X();
-    double C = -line_dir.Y();
-    double D = line_dir.Y() * p.Z() + line_dir.X() * p.Y() - line_dir.Y() * p.X() - line_dir.Z() * p.Y();
-    double proj_dist = abs(A * v0.X() + B * v0.Y() + C * v0.Z() + D) / sqrt(A * A + B * B + C * C);
-    if (proj_dist < )
-    {
-    }*/
+    const CFace& face = target->face[hit_face];
+    result = p + line_dir * t_best;
+    result_normal = face.cN();
 
-    //the line cross the point: pos, and line vector is viewray_iter 
-    double t = ( (v0.X() - p.X()) * face_norm.X() 
-      + (v0.Y() - p.Y()) * face_norm.Y() 
-      + (v0.Z() - p.Z()) * face_norm.Z() ) 
-      / ( face_norm.X() * line_dir.X() + face_norm.Y() * line_dir.Y() + face_norm.Z() * line_dir.Z() ) ;
+    Point3f d = result - p;
+    min_dist = d.SquaredNorm();
 
-    Point3f intersect_point = p + line_dir * t;
-
-    if(GlobalFun::isPointInTriangle_3(v0, v1, v2, intersect_point)) 
-    {
-      Point3f d = intersect_point - p;
-      double dist_temp = d.SquaredNorm();
-      //get the visible point
-      if (dist_temp < min_dist)
-      {
-        min_dist = dist_temp;
-        result = intersect_point;
-        result_normal = face_norm;
-
-        //for visibility based NBV. classify the scanned point
-        if (computeRealAngleOfTwoVertor(face_norm, -line_dir) > 60)
-          is_barely_visible = true;
-      }
-    }else continue;
+    //for visibility based NBV. classify the scanned points
+    //TODO: open for visibility
+    /*if (computeRealAngleOfTwoVertor(result_normal, -line_dir) > 60.0f)
+      is_barely_visible = true;*/
   }
-#endif
-  
+
   return sqrt(min_dist);
 }
 
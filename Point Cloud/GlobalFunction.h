@@ -37,6 +37,8 @@ const double EPS_SUN = 1e-8;    //lion: 1e-8, dc: 1e-10, sphere: 1e-7, anno:1e-7
 const double EPS_VISIBILITY = 1e-4;
 const double BIG = 100000;
 
+class TriangleSoA;
+
 namespace GlobalFun
 {
   struct DesityAndIndex{
@@ -78,7 +80,8 @@ namespace GlobalFun
 	bool isTwoPoint3fOpposite(Point3f& v0, Point3f& v1);
   double computeTriangleArea_3(Point3f& v0, Point3f& v1, Point3f& v2);
   bool isPointInTriangle_3(Point3f& v0, Point3f& v1, Point3f& v2, Point3f& p);
-  double computeMeshLineIntersectPoint(const CMesh *target, const Point3f& p, const Point3f& line_dir, Point3f& result, Point3f& result_normal, bool& is_barely_visible);
+  //faces: the faces of target packed by TriangleSoA::setFaces, once per mesh rather than per ray
+  double computeMeshLineIntersectPoint(const CMesh *target, const TriangleSoA& faces, const Point3f& p, const Point3f& line_dir, Point3f& result, Point3f& result_normal, bool& is_barely_visible);
   Point3f scalar2color(double scalar);
   void normalizeConfidence(vector<CVertex>& vertexes, float delta);
 
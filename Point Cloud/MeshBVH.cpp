@@ -0,0 +1,316 @@
+#include "MeshBVH.h"
+#include "GlobalFunction.h"
+
+#include <algorithm>
+#include <iostream>
+using namespace std;
+using namespace vcg;
+
+static const int BVH_SAH_BINS = 16;
+static const int BVH_MAX_SAH_DEPTH = 32; //below that only median splits, keeps the depth bounded
+static const int BVH_MAX_STACK = 96;
+
+static double boxArea(const Box3f& box)
+{
+  if (box.IsNull()) return 0.0;
+  Point3f d = box.max - box.min;
+  return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static Point3f triangleCentroid(const MeshBVH::Triangle& tri)
+{
+  return (tri.v0 + tri.v1 + tri.v2) / 3.0f;
+}
+
+class CentroidBinLess {
+  public:
+  CentroidBinLess(int _axis, float _min, float _scale, int _split)
+    : axis(_axis), min(_min), scale(_scale), split(_split) {}
+  bool operator()(const MeshBVH::Triangle& tri) const {
+    int bin = (int)((triangleCentroid(tri)[axis] - min) * scale);
+    return std::min(bin, BVH_SAH_BINS - 1) <= split;
+  }
+  int axis;
+  float min, scale;
+  int split;
+};
+
+class CentroidAxisSort {
+  public:
+  CentroidAxisSort(int _axis) : axis(_axis) {}
+  bool operator()(const MeshBVH::Triangle& a, const MeshBVH::Triangle& b) const {
+    return triangleCentroid(a)[axis] < triangleCentroid(b)[axis];
+  }
+  int axis;
+};
+
+void MeshBVH::clear()
+{
+  mesh = NULL;
+  nodes.clear();
+  tris.clear();
+  packed.clear();
+}
+
+void MeshBVH::build(const CMesh *_mesh, int _max_leaf_size)
+{
+  clear();
+  if (_mesh == NULL || _mesh->face.empty())
+  {
+    cout << "MeshBVH::build empty mesh!" << endl;
+    return;
+  }
+
+  mesh = _mesh;
+  max_leaf_size = std::max(1, _max_leaf_size);
+
+  tris.resize(mesh->face.size());
+  for (int i = 0; i < tris.size(); ++i)
+    tris[i].face = i;
+  loadTriangles();
+
+  nodes.reserve(2 * tris.size() / max_leaf_size + 1);
+  nodes.push_back(Node());
+  buildNode(0, 0, tris.size(), 0);
+  packTriangles();
+
+  cout << "BVH built over " << tris.size() << " faces, " << nodes.size() << " nodes" << endl;
+}
+
+void MeshBVH::refit()
+{
+  if (mesh == NULL) return;
+
+  //the topology changed, the tree is useless
+  if (mesh->face.size() != tris.size())
+  {
+    build(mesh, max_leaf_size);
+    return;
+  }
+
+  loadTriangles();
+  packTriangles();
+  //children are always stored after their parent, so a backward sweep is bottom-up
+  for (int i = nodes.size() - 1; i >= 0; --i)
+  {
+    Node& node = nodes[i];
+    if (node.count > 0)
+    {
+      computeNodeBox(node);
+    }else
+    {
+      node.box = nodes[node.child].box;
+      node.box.Add(nodes[node.child + 1].box);
+    }
+  }
+}
+
+void MeshBVH::loadTriangles()
+{
+  for (int i = 0; i < tris.size(); ++i)
+  {
+    Triangle& tri = tris[i];
+    const CFace& face = mesh->face[tri.face];
+    tri.v0 = face.cV(0)->cP();
+    tri.v1 = face.cV(1)->cP();
+    tri.v2 = face.cV(2)->cP();
+  }
+}
+
+void MeshBVH::packTriangles()
+{
+  packed.resize(tris.size());
+  for (int i = 0; i < tris.size(); ++i)
+    packed.set(i, tris[i].v0, tris[i].v1, tris[i].v2);
+}
+
+void MeshBVH::computeNodeBox(Node& node) const
+{
+  node.box.SetNull();
+  for (int i = node.first; i < node.first + node.count; ++i)
+  {
+    node.box.Add(tris[i].v0);
+    node.box.Add(tris[i].v1);
+    node.box.Add(tris[i].v2);
+  }
+}
+
+void MeshBVH::buildNode(int node_id, int first, int count, int depth)
+{
+  nodes[node_id].first = first;
+  nodes[node_id].count = count;
+  nodes[node_id].child = -1;
+  computeNodeBox(nodes[node_id]);
+
+  if (count <= max_leaf_size) return;
+
+  Box3f centroid_box;
+  for (int i = first; i < first + count; ++i)
+    centroid_box.Add(triangleCentroid(tris[i]));
+
+  Point3f extent = centroid_box.max - centroid_box.min;
+  int axis = 0;
+  if (extent[1] > extent[axis]) axis = 1;
+  if (extent[2] > extent[axis]) axis = 2;
+
+  int mid = first;
+  if (extent[axis] > EPS_SUN && depth < BVH_MAX_SAH_DEPTH)
+  {
+    //binned surface area heuristic along the longest centroid axis
+    float scale = BVH_SAH_BINS / extent[axis];
+    int bin_count[BVH_SAH_BINS] = {0};
+    Box3f bin_box[BVH_SAH_BINS];
+    for (int i = first; i < first + count; ++i)
+    {
+      int bin = (int)((triangleCentroid(tris[i])[axis] - centroid_box.min[axis]) * scale);
+      bin = std::min(bin, BVH_SAH_BINS - 1);
+      bin_count[bin]++;
+      bin_box[bin].Add(tris[i].v0);
+      bin_box[bin].Add(tris[i].v1);
+      bin_box[bin].Add(tris[i].v2);
+    }
+
+    double right_cost[BVH_SAH_BINS];
+    Box3f right_box;
+    int right_count = 0;
+    for (int b = BVH_SAH_BINS - 1; b > 0; --b)
+    {
+      right_box.Add(bin_box[b]);
+      right_count += bin_count[b];
+      right_cost[b] = boxArea(right_box) * right_count;
+    }
+
+    double best_cost = BIG * BIG;
+    int best_split = -1;
+    Box3f left_box;
+    int left_count = 0;
+    for (int b = 0; b < BVH_SAH_BINS - 1; ++b)
+    {
+      left_box.Add(bin_box[b]);
+      left_count += bin_count[b];
+      if (left_count == 0 || left_count == count) continue;
+
+      double cost = boxArea(left_box) * left_count + right_cost[b + 1];
+      if (cost < best_cost)
+      {
+        best_cost = cost;
+        best_split = b;
+      }
+    }
+
+    if (best_split >= 0)
+    {
+      CentroidBinLess pred(axis, centroid_box.min[axis], scale, best_split);
+      mid = std::partition(tris.begin() + first, tris.begin() + first + count, pred) - tris.begin();
+    }
+  }
+
+  //all centroids in one bin, fall back to a median split
+  if (mid == first || mid == first + count)
+  {
+    mid = first + count / 2;
+    std::nth_element(tris.begin() + first, tris.begin() + mid, tris.begin() + first + count, CentroidAxisSort(axis));
+  }
+
+  int child = nodes.size();
+  nodes.push_back(Node());
+  nodes.push_back(Node());
+  nodes[node_id].child = child;
+  nodes[node_id].count = 0;
+
+  buildNode(child, first, mid - first, depth + 1);
+  buildNode(child + 1, mid, first + count - mid, depth + 1);
+}
+
+bool MeshBVH::intersectBox(const Box3f& box, const Point3f& p, const Point3f& inv_dir, double t_max, double& t_enter) const
+{
+  double t0 = 0.0;
+  double t1 = t_max;
+  for (int a = 0; a < 3; ++a)
+  {
+    double t_near = (box.min[a] - p[a]) * inv_dir[a];
+    double t_far  = (box.max[a] - p[a]) * inv_dir[a];
+    if (t_near > t_far) std::swap(t_near, t_far);
+
+    if (t_near > t0) t0 = t_near;
+    if (t_far < t1) t1 = t_far;
+    if (t0 > t1) return false;
+  }
+  t_enter = t0;
+  return true;
+}
+
+double MeshBVH::computeLineIntersectPoint(const Point3f& p, const Point3f& line_dir,
+                                          Point3f& result, Point3f& result_normal, double max_dist) const
+{
+  if (nodes.empty()) return BIG;
+
+  double dir_len = line_dir.Norm();
+  if (dir_len < EPS_SUN) return BIG;
+
+  Point3f inv_dir;
+  for (int a = 0; a < 3; ++a)
+  {
+    if (fabs(line_dir[a]) > EPS_SUN) inv_dir[a] = 1.0f / line_dir[a];
+    else inv_dir[a] = line_dir[a] < 0 ? -1e30f : 1e30f;
+  }
+
+  double t_best = max_dist / dir_len;
+  int hit = -1;
+
+  //pending nodes along with their entry distance
+  int    stack_node[BVH_MAX_STACK];
+  double stack_t[BVH_MAX_STACK];
+  int top = 0;
+
+  double t_root;
+  if (!intersectBox(nodes[0].box, p, inv_dir, t_best, t_root)) return BIG;
+  stack_node[top] = 0;
+  stack_t[top++] = t_root;
+
+  while (top > 0)
+  {
+    --top;
+    if (stack_t[top] > t_best) continue;
+    const Node& node = nodes[stack_node[top]];
+
+    if (node.count > 0)
+    {
+      float t_leaf = t_best;
+      int leaf_hit = packed.intersect(node.first, node.count, p, line_dir, t_leaf);
+      if (leaf_hit >= 0)
+      {
+        t_best = t_leaf;
+        hit = leaf_hit;
+      }
+      continue;
+    }
+
+    double t_left, t_right;
+    bool is_left_hit = intersectBox(nodes[node.child].box, p, inv_dir, t_best, t_left);
+    bool is_right_hit = intersectBox(nodes[node.child + 1].box, p, inv_dir, t_best, t_right);
+
+    //push the farther child first so that the nearer one is visited next
+    if (is_left_hit && is_right_hit && t_left < t_right)
+    {
+      stack_node[top] = node.child + 1; stack_t[top++] = t_right;
+      stack_node[top] = node.child;     stack_t[top++] = t_left;
+    }else
+    {
+      if (is_left_hit)
+      {
+        stack_node[top] = node.child;     stack_t[top++] = t_left;
+      }
+      if (is_right_hit)
+      {
+        stack_node[top] = node.child + 1; stack_t[top++] = t_right;
+      }
+    }
+  }
+
+  if (hit < 0) return BIG;
+
+  result = p + line_dir * t_best;
+  result_normal = mesh->face[tris[hit].face].cN();
+  return t_best * dir_len;
+}
@@ -0,0 +1,54 @@
+#ifndef MESH_BVH_H
+#define MESH_BVH_H
+
+#include <vector>
+#include "cmesh.h"
+#include "RayTriangle.h"
+using namespace std;
+
+// bounding volume hierarchy over the faces of a CMesh, used by the virtual scanner
+// to find the nearest visible face along a ray without testing every face.
+// build() once after loading, refit() whenever the vertex positions change.
+class MeshBVH {
+  public:
+    struct Node {
+      vcg::Box3f box;
+      int        child;   // index of the left child, the right one is child + 1
+      int        first;   // first triangle of a leaf in tris
+      int        count;   // triangles in the leaf, 0 for inner nodes
+    };
+
+    struct Triangle {
+      Point3f v0, v1, v2;
+      int     face;       // index of the face in the source mesh
+    };
+
+    MeshBVH() : mesh(NULL), max_leaf_size(4) {}
+
+    void build(const CMesh *_mesh, int _max_leaf_size = 4);
+    void refit();
+    void clear();
+    bool isEmpty() const { return nodes.empty(); }
+    const CMesh* getMesh() const { return mesh; }
+
+    // same contract as GlobalFun::computeMeshLineIntersectPoint: returns the distance
+    // to the nearest front facing face along line_dir (BIG if there is none closer than max_dist)
+    double computeLineIntersectPoint(const Point3f& p, const Point3f& line_dir,
+                                     Point3f& result, Point3f& result_normal, double max_dist) const;
+
+  private:
+    void loadTriangles();
+    void packTriangles();
+    void buildNode(int node_id, int first, int count, int depth);
+    void computeNodeBox(Node& node) const;
+    bool intersectBox(const vcg::Box3f& box, const Point3f& p, const Point3f& inv_dir, double t_max, double& t_enter) const;
+
+  private:
+    const CMesh       *mesh;
+    int                max_leaf_size;
+    vector<Node>       nodes;
+    vector<Triangle>   tris;
+    TriangleSoA        packed;  // same order as tris, read by the leaf kernel
+};
+
+#endif
@@ -0,0 +1,461 @@
+#include "NeighborSearch.h"
+#include "GlobalFunction.h"
+
+#include <algorithm>
+#include <iostream>
+#include <tbb/parallel_for.h>
+using namespace std;
+using namespace vcg;
+
+static const int KD_MAX_STACK = 128;
+static const int KD_MAX_LOOSE = 256;
+
+//keeps idx/dist2 sorted ascending and at most k long
+static inline void insertNeighbor(int* idx, float* dist2, int& found, int k, int id, float d)
+{
+  int i = found < k ? found++ : k - 1;
+  while (i > 0 && dist2[i - 1] > d)
+  {
+    idx[i] = idx[i - 1];
+    dist2[i] = dist2[i - 1];
+    --i;
+  }
+  idx[i] = id;
+  dist2[i] = d;
+}
+
+void PointKdTree::clear()
+{
+  nodes.clear();
+  points.clear();
+  ids.clear();
+  loose_points.clear();
+  tree_size = 0;
+}
+
+void PointKdTree::build(const vector<CVertex>& pts, int _max_leaf_size)
+{
+  vector<Point3f> positions(pts.size());
+  for (int i = 0; i < positions.size(); ++i)
+    positions[i] = pts[i].cP();
+  build(positions, _max_leaf_size);
+}
+
+void PointKdTree::build(const vector<Point3f>& pts, int _max_leaf_size)
+{
+  clear();
+  max_leaf_size = std::max(1, _max_leaf_size);
+  tree_size = pts.size();
+  if (tree_size == 0) return;
+
+  vector<int> order(tree_size);
+  for (int i = 0; i < tree_size; ++i)
+    order[i] = i;
+
+  nodes.reserve(2 * tree_size / max_leaf_size + 1);
+  nodes.push_back(Node());
+  buildNode(0, 0, tree_size, order, pts);
+
+  points.resize(tree_size);
+  for (int i = 0; i < tree_size; ++i)
+    points[i] = pts[order[i]];
+  ids.swap(order);
+}
+
+void PointKdTree::buildNode(int node_id, int first, int count, vector<int>& order, const vector<Point3f>& pts)
+{
+  Node& node = nodes[node_id];
+  node.first = first;
+  node.count = count;
+  node.child = -1;
+  for (int a = 0; a < 3; ++a)
+  {
+    node.lo[a] = pts[order[first]][a];
+    node.hi[a] = node.lo[a];
+  }
+  for (int i = first + 1; i < first + count; ++i)
+  {
+    const Point3f& p = pts[order[i]];
+    for (int a = 0; a < 3; ++a)
+    {
+      node.lo[a] = std::min(node.lo[a], p[a]);
+      node.hi[a] = std::max(node.hi[a], p[a]);
+    }
+  }
+
+  if (count <= max_leaf_size) return;
+
+  //median split along the longest side keeps the depth at log2(n)
+  int axis = 0;
+  for (int a = 1; a < 3; ++a)
+    if (node.hi[a] - node.lo[a] > node.hi[axis] - node.lo[axis]) axis = a;
+
+  int mid = first + count / 2;
+  std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count,
+    [&](int i, int j) { return pts[i][axis] < pts[j][axis]; });
+
+  //nodes may reallocate below, don't keep the reference
+  int child = nodes.size();
+  nodes[node_id].child = child;
+  nodes[node_id].count = 0;
+  nodes.push_back(Node());
+  nodes.push_back(Node());
+
+  buildNode(child, first, mid - first, order, pts);
+  buildNode(child + 1, mid, first + count - mid, order, pts);
+}
+
+void PointKdTree::append(const vector<CVertex>& pts)
+{
+  int n = pts.size();
+  if (n <= size()) return;
+
+  //the loose points are scanned by every query, past a few hundred a rebuild is cheaper
+  if (n - tree_size > KD_MAX_LOOSE)
+  {
+    build(pts, max_leaf_size);
+    return;
+  }
+
+  for (int i = size(); i < n; ++i)
+    loose_points.push_back(pts[i].cP());
+}
+
+float PointKdTree::boxDistance2(const Node& node, const Point3f& q)
+{
+  float d2 = 0.0f;
+  for (int a = 0; a < 3; ++a)
+  {
+    float d = 0.0f;
+    if (q[a] < node.lo[a]) d = node.lo[a] - q[a];
+    else if (q[a] > node.hi[a]) d = q[a] - node.hi[a];
+    d2 += d * d;
+  }
+  return d2;
+}
+
+int PointKdTree::knn(const Point3f& q, int k, int* idx, float* dist2) const
+{
+  if (k <= 0) return 0;
+
+  int found = 0;
+  for (int i = 0; i < loose_points.size(); ++i)
+  {
+    float d = (loose_points[i] - q).SquaredNorm();
+    if (found < k || d < dist2[k - 1])
+      insertNeighbor(idx, dist2, found, k, tree_size + i, d);
+  }
+  if (nodes.empty()) return found;
+
+  int   stack_node[KD_MAX_STACK];
+  float stack_d2[KD_MAX_STACK];
+  int top = 0;
+  stack_node[top] = 0;
+  stack_d2[top++] = boxDistance2(nodes[0], q);
+
+  while (top > 0)
+  {
+    --top;
+    if (found == k && stack_d2[top] >= dist2[k - 1]) continue;
+    const Node& node = nodes[stack_node[top]];
+
+    if (node.count > 0)
+    {
+      for (int i = node.first; i < node.first + node.count; ++i)
+      {
+        float d = (points[i] - q).SquaredNorm();
+        if (found < k || d < dist2[k - 1])
+          insertNeighbor(idx, dist2, found, k, ids[i], d);
+      }
+      continue;
+    }
+
+    float d_left = boxDistance2(nodes[node.child], q);
+    float d_right = boxDistance2(nodes[node.child + 1], q);
+
+    //push the farther child first so that the nearer one is visited next
+    if (d_left <= d_right)
+    {
+      stack_node[top] = node.child + 1; stack_d2[top++] = d_right;
+      stack_node[top] = node.child;     stack_d2[top++] = d_left;
+    }else
+    {
+      stack_node[top] = node.child;     stack_d2[top++] = d_left;
+      stack_node[top] = node.child + 1; stack_d2[top++] = d_right;
+    }
+  }
+  return found;
+}
+
+void PointKdTree::radius(const Point3f& q, double radius, vector<int>& idx) const
+{
+  idx.clear();
+  float radius2 = radius * radius;
+
+  for (int i = 0; i < loose_points.size(); ++i)
+  {
+    if ((loose_points[i] - q).SquaredNorm() < radius2)
+      idx.push_back(tree_size + i);
+  }
+  if (nodes.empty()) return;
+
+  int stack_node[KD_MAX_STACK];
+  int top = 0;
+  stack_node[top++] = 0;
+
+  while (top > 0)
+  {
+    const Node& node = nodes[stack_node[--top]];
+    if (boxDistance2(node, q) >= radius2) continue;
+
+    if (node.count > 0)
+    {
+      for (int i = node.first; i < node.first + node.count; ++i)
+      {
+        if ((points[i] - q).SquaredNorm() < radius2)
+          idx.push_back(ids[i]);
+      }
+      continue;
+    }
+
+    stack_node[top++] = node.child;
+    stack_node[top++] = node.child + 1;
+  }
+}
+
+void NeighborGraph::clear()
+{
+  offsets.clear();
+  indices.clear();
+  distances.clear();
+}
+
+void NeighborGraph::copyTo(vector<CVertex>& pts, bool to_original, const vector<CVertex>* searched) const
+{
+  for (int i = 0; i < pts.size() && i < size(); ++i)
+  {
+    vector<int>& result = to_original ? pts[i].original_neighbors : pts[i].neighbors;
+    if (searched == NULL)
+    {
+      result.assign(indices.begin() + offsets[i], indices.begin() + offsets[i + 1]);
+      continue;
+    }
+
+    result.resize(count(i));
+    for (int j = 0; j < result.size(); ++j)
+      result[j] = (*searched)[neighbor(i, j)].m_index;
+  }
+}
+
+const PointKdTree* NeighborSearch::getTree(const CMesh* mesh)
+{
+  if (mesh == NULL) return NULL;
+  const vector<CVertex>& pts = mesh->vert;
+  int n = pts.size();
+
+  map<const CMesh*, Entry>::iterator it = trees.find(mesh);
+  if (it != trees.end())
+  {
+    Entry& entry = it->second;
+    entry.last_use = ++use_count;
+    if (n >= entry.tree.size())
+    {
+      entry.tree.append(pts);
+      return &entry.tree;
+    }
+  }
+  else if (trees.size() >= MAX_TREES)
+  {
+    map<const CMesh*, Entry>::iterator oldest = trees.begin();
+    for (it = trees.begin(); it != trees.end(); ++it)
+    {
+      if (it->second.last_use < oldest->second.last_use)  oldest = it;
+    }
+    trees.erase(oldest);
+  }
+
+  Entry& entry = trees[mesh];
+  entry.tree.build(pts);
+  entry.last_use = ++use_count;
+  return &entry.tree;
+}
+
+void NeighborSearch::invalidate(const CMesh* mesh)
+{
+  trees.erase(mesh);
+}
+
+void NeighborSearch::clear()
+{
+  trees.clear();
+}
+
+void NeighborSearch::knnGraph(const PointKdTree& tree, const vector<CVertex>& querypts, int knn,
+                              NeighborGraph& graph, bool with_distances)
+{
+  int n = querypts.size();
+  graph.clear();
+  graph.offsets.assign(n + 1, 0);
+  if (knn <= 0) return;
+
+  //every query gets a slot of knn, the short ones are compacted afterwards
+  vector<int>   slot_idx(size_t(n) * knn);
+  vector<float> slot_dist2(with_distances ? size_t(n) * knn : 0);
+
+  //one more than asked for, the closest hit is dropped below
+  int k = knn + 1;
+  auto query = [&](size_t begin, size_t end)
+  {
+    vector<int>   idx(k);
+    vector<float> dist2(k);
+    for (size_t i = begin; i < end; ++i)
+    {
+      int found = tree.knn(querypts[i].cP(), k, &idx[0], &dist2[0]);
+      int count = std::max(0, found - 1);
+      std::copy(idx.begin() + 1, idx.begin() + 1 + count, slot_idx.begin() + i * knn);
+      if (with_distances)
+        std::copy(dist2.begin() + 1, dist2.begin() + 1 + count, slot_dist2.begin() + i * knn);
+      graph.offsets[i + 1] = count;
+    }
+  };
+
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n),
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    query(r.begin(), r.end());
+  });
+#else
+  query(0, n);
+#endif
+
+  for (int i = 0; i < n; ++i)
+    graph.offsets[i + 1] += graph.offsets[i];
+
+  if (graph.offsets[n] == size_t(n) * knn)
+  {
+    graph.indices.swap(slot_idx);
+    graph.distances.swap(slot_dist2);
+    return;
+  }
+
+  graph.indices.resize(graph.offsets[n]);
+  if (with_distances) graph.distances.resize(graph.offsets[n]);
+  for (int i = 0; i < n; ++i)
+  {
+    int count = graph.count(i);
+    std::copy(slot_idx.begin() + size_t(i) * knn, slot_idx.begin() + size_t(i) * knn + count, graph.indices.begin() + graph.offsets[i]);
+    if (with_distances)
+      std::copy(slot_dist2.begin() + size_t(i) * knn, slot_dist2.begin() + size_t(i) * knn + count, graph.distances.begin() + graph.offsets[i]);
+  }
+}
+
+void NeighborSearch::computeKnnGraph(const CMesh* data, const vector<CVertex>& querypts, int knn,
+                                     NeighborGraph& graph, bool with_distances)
+{
+  if (data == NULL)
+  {
+    cout << "NeighborSearch::computeKnnGraph data == NULL!" << endl;
+    graph.clear();
+    return;
+  }
+  knnGraph(*getTree(data), querypts, knn, graph, with_distances);
+}
+
+void NeighborSearch::computeBallGraph(const CMesh* goal_set, const CMesh* search_set, double radius,
+                                      NeighborGraph& graph, bool with_distances)
+{
+  graph.clear();
+  if (radius < 0.0001)
+  {
+    cout << "too small grid!!" << endl;
+    return;
+  }
+
+  const CMesh* data = search_set != NULL ? search_set : goal_set;
+  const PointKdTree* tree = getTree(data);
+  int n = goal_set->vert.size();
+  graph.offsets.assign(n + 1, 0);
+
+  //results are gathered per block of queries and concatenated in block order,
+  //so the graph doesn't depend on the scheduling
+  const int block_size = 1024;
+  int n_blocks = (n + block_size - 1) / block_size;
+  vector<vector<int> >   block_idx(n_blocks);
+  vector<vector<float> > block_dist2(n_blocks);
+
+  auto query = [&](size_t block_begin, size_t block_end)
+  {
+    vector<int> idx;
+    for (size_t b = block_begin; b < block_end; ++b)
+    {
+      int end = std::min(n, int(b + 1) * block_size);
+      for (int i = b * block_size; i < end; ++i)
+      {
+        const Point3f& p = goal_set->vert[i].cP();
+        tree->radius(p, radius, idx);
+        int count = 0;
+        for (int j = 0; j < idx.size(); ++j)
+        {
+          if (search_set == NULL && idx[j] == i) continue;
+          block_idx[b].push_back(idx[j]);
+          if (with_distances)
+            block_dist2[b].push_back((data->vert[idx[j]].cP() - p).SquaredNorm());
+          ++count;
+        }
+        graph.offsets[i + 1] = count;
+      }
+    }
+  };
+
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n_blocks),
+    [&](const tbb::blocked_range<size_t>& r)
+  {
+    query(r.begin(), r.end());
+  });
+#else
+  query(0, n_blocks);
+#endif
+
+  for (int i = 0; i < n; ++i)
+    graph.offsets[i + 1] += graph.offsets[i];
+
+  graph.indices.resize(graph.offsets[n]);
+  if (with_distances) graph.distances.resize(graph.offsets[n]);
+  for (int b = 0; b < n_blocks; ++b)
+  {
+    int first = graph.offsets[b * block_size];
+    std::copy(block_idx[b].begin(), block_idx[b].end(), graph.indices.begin() + first);
+    if (with_distances)
+      std::copy(block_dist2[b].begin(), block_dist2[b].end(), graph.distances.begin() + first);
+  }
+}
+
+void NeighborSearch::computeAnnNeighbors(CMesh* data, vector<CVertex>& querypts, int knn, QString purpose)
+{
+  cout << endl <<"Compute ANN for: " << purpose.toStdString() << endl;
+  if (data == NULL || knn <= 0)
+  {
+    cout << "NeighborSearch::computeAnnNeighbors nothing to search!" << endl;
+    return;
+  }
+
+  //computeAnnNeigbhors resets the data lists too, callers may rely on it
+  for (int i = 0; i < data->vert.size(); ++i)
+    data->vert[i].neighbors.clear();
+
+  NeighborGraph graph;
+  computeKnnGraph(data, querypts, knn, graph);
+  graph.copyTo(querypts);
+}
+
+void NeighborSearch::computeBallNeighbors(CMesh* goal_set, CMesh* search_set, double radius)
+{
+  NeighborGraph graph;
+  computeBallGraph(goal_set, search_set, radius, graph);
+  if (graph.size() != goal_set->vert.size()) return;
+
+  const CMesh* searched = (search_set != NULL) ? search_set : goal_set;
+  graph.copyTo(goal_set->vert, search_set != NULL, &searched->vert);
+}
@@ -0,0 +1,119 @@
+#ifndef NEIGHBOR_SEARCH_H
+#define NEIGHBOR_SEARCH_H
+
+#include <vector>
+#include <map>
+#include "cmesh.h"
+#include <QString>
+using namespace std;
+
+// static kd-tree over the positions of a point set. queries are const and keep no state
+// in the tree, so unlike ANN they can run from many threads at once.
+// points added to the end of the set after build() go to a small linear list through
+// append(), the tree is rebuilt once that list passes a few hundred points.
+class PointKdTree {
+  public:
+    struct Node {
+      float lo[3], hi[3]; // box of the points below the node
+      int   child;        // index of the left child, the right one is child + 1
+      int   first;        // first point of a leaf in points/ids
+      int   count;        // points in the leaf, 0 for inner nodes
+    };
+
+    PointKdTree() : tree_size(0), max_leaf_size(8) {}
+
+    void build(const vector<CVertex>& pts, int _max_leaf_size = 8);
+    void build(const vector<Point3f>& pts, int _max_leaf_size = 8);
+    void append(const vector<CVertex>& pts);  // adds pts[size()..]
+    void clear();
+    int  size() const { return tree_size + loose_points.size(); }
+    bool isEmpty() const { return size() == 0; }
+
+    // the k nearest points of q, ascending by distance. returns how many were found (<= k),
+    // idx and dist2 must have room for k values
+    int  knn(const Point3f& q, int k, int* idx, float* dist2) const;
+    // all points strictly closer than radius, in no particular order
+    void radius(const Point3f& q, double radius, vector<int>& idx) const;
+
+  private:
+    void buildNode(int node_id, int first, int count, vector<int>& order, const vector<Point3f>& pts);
+    static float boxDistance2(const Node& node, const Point3f& q);
+
+  private:
+    vector<Node>    nodes;
+    vector<Point3f> points;       // in leaf order
+    vector<int>     ids;          // index of points[i] in the source set
+    int             tree_size;
+    int             max_leaf_size;
+    vector<Point3f> loose_points; // appended after the build, ids start at tree_size
+};
+
+// neighbor lists of a whole point set in compressed sparse row form: the neighbors of point i
+// are indices[offsets[i] .. offsets[i + 1]), indices into the searched set. one allocation per
+// pass instead of one per vertex, and the kernels can read it from any thread.
+class NeighborGraph {
+  public:
+    void  clear();
+    int   size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    int   count(int i) const { return offsets[i + 1] - offsets[i]; }
+    int   neighbor(int i, int j) const { return indices[offsets[i] + j]; }
+    float dist2(int i, int j) const { return distances[offsets[i] + j]; } // only if asked for at query time
+    bool  hasDistances() const { return distances.size() == indices.size(); }
+
+    // fills CVertex::neighbors (or original_neighbors) for the code and the views that still read them.
+    // with a searched set the lists hold its m_index, as the ball neighbors of the CGrid always did
+    void  copyTo(vector<CVertex>& pts, bool to_original = false, const vector<CVertex>* searched = NULL) const;
+
+  public:
+    vector<int>   offsets;    // size() + 1 entries
+    vector<int>   indices;
+    vector<float> distances;  // squared, parallel to indices
+};
+
+// the neighbor queries of the algorithms, owned by DataMgr. a tree is cached per mesh and
+// trusted without looking at the positions again: when points were only added to the end of
+// the mesh (scan merges into original) they are appended, a smaller mesh is rebuilt, anything
+// else that moves or replaces points has to invalidate() the mesh. GLArea clears the cache
+// around each algorithm run, so it only has to be kept right within a run, and the UI
+// queries outside a run clear it when they are done. at most MAX_TREES are kept, the least
+// recently used goes first, and DataMgr drops the tree of a mesh it clears.
+// getTree() and the batch queries must be called from one thread, the batches themselves
+// run in parallel.
+class NeighborSearch {
+  public:
+    static const int MAX_TREES = 8;
+
+    NeighborSearch() : use_count(0) {}
+
+    const PointKdTree* getTree(const CMesh* mesh);
+    void invalidate(const CMesh* mesh);
+    void clear();
+
+    // knn indices into data->vert per query, ascending by distance. like GlobalFun::computeAnnNeigbhors
+    // the closest hit is dropped (it is the point itself when a set queries itself)
+    void computeKnnGraph(const CMesh* data, const vector<CVertex>& querypts, int knn,
+                         NeighborGraph& graph, bool with_distances = false);
+    // the search_set points strictly closer than radius, or the goal_set points without the point
+    // itself if search_set is NULL
+    void computeBallGraph(const CMesh* goal_set, const CMesh* search_set, double radius,
+                          NeighborGraph& graph, bool with_distances = false);
+
+    // the same queries written to the per-vertex lists, like the GlobalFun functions of the same name
+    void computeAnnNeighbors(CMesh* data, vector<CVertex>& querypts, int knn, QString purpose = "?_?");
+    void computeBallNeighbors(CMesh* goal_set, CMesh* search_set, double radius);
+
+    static void knnGraph(const PointKdTree& tree, const vector<CVertex>& querypts, int knn,
+                         NeighborGraph& graph, bool with_distances = false);
+
+  private:
+    struct Entry {
+      PointKdTree        tree;
+      unsigned long long last_use;
+    };
+
+  private:
+    map<const CMesh*, Entry> trees;
+    unsigned long long       use_count;
+};
+
+#endif
@@ -215,6 +215,8 @@ void ParameterMgr::initPoissonParameter()
 	poisson.addParam(new RichDouble("Current Z Slice Position", 0.5));
 	poisson.addParam(new RichDouble("Show Slice Percentage", 0.75));
 	poisson.addParam(new RichDouble("Poisson Disk Sample Number", 3000));
+	poisson.addParam(new RichBool("Extract ISO Points From Octree", false));
+	poisson.addParam(new RichBool("Generate Field Near ISO Points", true));
   poisson.addParam(new RichDouble("Original KNN", 251));
 
 	poisson.addParam(new RichBool("Use Confidence 1", false));
@@ -244,6 +246,8 @@ void ParameterMgr::initCameraParameter()
 	camera.addParam(new RichBool("Run Virtual Scan", false));
   camera.addParam(new RichBool("Is Init Camera Show", false));
   camera.addParam(new RichBool("Show Camera Border", true));
+  camera.addParam(new RichBool("Use BVH Ray Casting", true)); //false: brute force over all faces
+  camera.addParam(new RichInt("Ray Kernel ISA", 2)); //0: scalar, 1: SSE, 2: AVX, clamped to the cpu
 
 
   camera.addParam(new RichDouble("Camera Far Distance", 40.0f));   //cm anno 25
@@ -287,12 +291,18 @@ void ParameterMgr::initNBVParameter()
   nbv.addParam(new RichBool("Run Update View Directions", false));
   nbv.addParam(new RichBool("Run Compute View Candidate Index", false));
   nbv.addParam(new RichDouble("View Grid Resolution", 100.8f));
+  nbv.addParam(new RichBool("Use Sparse View Grid", false));
   nbv.addParam(new RichBool("Test Other Inside Segment", false));
+  nbv.addParam(new RichBool("Use Distance Transform Segment", false));
 
   nbv.addParam(new RichBool("Use Confidence Separation", false));
   //nbv.addParam(new RichBool("Use Average Confidence", false));
   nbv.addParam(new RichBool("Use NBV Test1", false));
   nbv.addParam(new RichBool("Use Max Propagation", true));
+  nbv.addParam(new RichBool("Run Incremental Propagation", false));
+  nbv.addParam(new RichDouble("Incremental Position Tolerance", 0.001));   // in grid steps
+  nbv.addParam(new RichDouble("Incremental Normal Tolerance", 2.5));      // in degrees
+  nbv.addParam(new RichDouble("Incremental Confidence Tolerance", 0.001));
   nbv.addParam(new RichDouble("Confidence Separation Value", 0.85));
   nbv.addParam(new RichDouble("Max Ray Steps Para", 1.5));
   nbv.addParam(new RichDouble("Ray Resolution Para", 0.511111111111111));
@@ -77,8 +77,10 @@ public:
 	  * in memory are no longer valid. */
 	void rollBack(void){
 		if(memory.size()){
-			for(size_t i=0;i<memory.size();i++){
-				for(int j=0;j<blockSize;j++){
+			// Only the blocks up to index have been handed out since the last roll back
+			for(int i=0;i<=index && i<int(memory.size());i++){
+				int used = i<index ? blockSize : blockSize-remains;
+				for(int j=0;j<used;j++){
 					memory[i][j].~T();
 					new(&memory[i][j]) T();
 				}
@@ -112,7 +114,7 @@ public:
 				remains=state.remains;
 			}
 			else{
-				for(int j=0;j<state.remains;j<remains){
+				for(int j=0;j<state.remains;j++){
 					memory[index][j].~T();
 					new(&memory[index][j]) T();
 				}
@@ -78,6 +78,8 @@ BSplineData<Degree,Real>::BSplineData( void )
 {
 	vvDotTable = dvDotTable = ddDotTable = NullPointer< Real >();
 	valueTables = dValueTables = NullPointer< Real >();
+	baseFunctions = NullPointer< PPolynomial< Degree > >();
+	baseBSplines = NullPointer< BSplineComponents >();
 	functionCount = sampleCount = 0;
 }
 
@@ -91,6 +93,8 @@ BSplineData< Degree , Real >::~BSplineData(void)
 		if( ddDotTable ) DeletePointer( ddDotTable );
 		if(  valueTables ) DeletePointer(  valueTables );
 		if( dValueTables ) DeletePointer( dValueTables );
+		if( baseFunctions ) DeletePointer( baseFunctions );
+		if( baseBSplines  ) DeletePointer( baseBSplines  );
 	}
 	functionCount = 0;
 }
@@ -105,6 +109,11 @@ void BSplineData<Degree,Real>::set( int maxDepth , bool useDotRatios , int bound
 	// [Warning] This assumes that the functions spacing is dual
 	functionCount = BinaryNode< double >::CumulativeCenterCount( depth );
 	sampleCount   = BinaryNode< double >::CenterCount( depth ) + BinaryNode< double >::CornerCount( depth );
+	// The tables are sized for the old functions
+	clearDotTables( VV_DOT_FLAG | DV_DOT_FLAG | DD_DOT_FLAG );
+	clearValueTables();
+	if( baseFunctions ) DeletePointer( baseFunctions );
+	if( baseBSplines  ) DeletePointer( baseBSplines  );
 	baseFunctions = NewPointer< PPolynomial< Degree > >( functionCount );
 	baseBSplines = NewPointer< BSplineComponents >( functionCount );
 
@@ -0,0 +1,144 @@
+#ifndef DISK_THINNING_INCLUDED
+#define DISK_THINNING_INCLUDED
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+// Dart throwing over given points: a point is kept unless one closer than the radius was kept before it. The points are
+// hashed to cells as wide as the radius, so the kept points a point has to be tested against lie in the 3x3x3 cells around
+// its own. "Before" is phase, then cell, then priority: the cells are thinned in 27 phases over their coordinates mod 3, and
+// within a cell the points go by ascending priority (by index without priorities). The cells of a phase share no neighbors,
+// so the caller may thin them in parallel, as long as the phases are run in order. The result only depends on the points
+// and their priorities, not on how the cells of a phase are split between threads.
+// Point is anything with p[0], p[1] and p[2].
+template< class Point >
+class DiskThinning
+{
+public:
+	static const int PHASES = 27;
+
+	// Hashes and sorts the points. They are referenced, not copied, and have to outlive the thinning
+	void set( const std::vector< Point >& points , double radius , const std::vector< float >* priorities=NULL );
+	int phaseSize( int phase ) const { return int( _phaseCells[phase].size() ); }
+	// Thins the cells [begin,end) of the phase
+	void thinCells( int phase , int begin , int end );
+	// kept[i] is set for the points kept
+	void getKept( std::vector< char >& kept ) const;
+
+	// All the phases in one thread
+	static void Thin( const std::vector< Point >& points , double radius , std::vector< char >& kept , const std::vector< float >* priorities=NULL );
+protected:
+	static const int CELL_BITS = 21;
+	static const long long CELL_MASK = ( 1<<CELL_BITS ) - 1;
+
+	struct _Candidate
+	{
+		long long cell;	// the x, y, z of the cell, CELL_BITS each
+		float priority;
+		int index;
+		bool operator < ( const _Candidate& c ) const
+		{
+			if( cell!=c.cell ) return cell<c.cell;
+			if( priority!=c.priority ) return priority<c.priority;
+			return index<c.index;
+		}
+	};
+	static long long _CellKey( int x , int y , int z ){ return (long long)x | ( (long long)y<<CELL_BITS ) | ( (long long)z<<(2*CELL_BITS) ); }
+
+	const std::vector< Point >* _points;
+	double _radius2;
+	std::vector< _Candidate > _candidates;
+	std::vector< long long > _cellKeys;	// the cells with points, ascending
+	std::vector< int > _cellStart;	// the points of cell c are _candidates[ _cellStart[c] .. _cellStart[c+1] )
+	std::vector< int > _phaseCells[PHASES];
+	std::vector< char > _sortedKept;
+};
+
+template< class Point >
+void DiskThinning< Point >::set( const std::vector< Point >& points , double radius , const std::vector< float >* priorities )
+{
+	int count = int( points.size() );
+	_points = &points;
+	_radius2 = radius * radius;
+	_candidates.resize( count );
+	_cellKeys.clear() , _cellStart.clear();
+	for( int p=0 ; p<PHASES ; p++ ) _phaseCells[p].clear();
+	_sortedKept.assign( count , radius<=0 ? 1 : 0 );
+	if( radius<=0 ){ for( int i=0 ; i<count ; i++ ) _candidates[i].index = i ; return; }
+	if( !count ) return;
+
+	double min[3] = { points[0][0] , points[0][1] , points[0][2] };
+	for( int i=1 ; i<count ; i++ ) for( int c=0 ; c<3 ; c++ ) min[c] = std::min< double >( min[c] , points[i][c] );
+	double iCell = 1. / radius;
+	for( int i=0 ; i<count ; i++ )
+	{
+		int cell[3];
+		for( int c=0 ; c<3 ; c++ ) cell[c] = std::max< int >( 0 , std::min< int >( int( CELL_MASK ) , int( floor( ( points[i][c]-min[c] ) * iCell ) ) ) );
+		_candidates[i].cell = _CellKey( cell[0] , cell[1] , cell[2] );
+		_candidates[i].priority = priorities ? (*priorities)[i] : 0.f;
+		_candidates[i].index = i;
+	}
+	std::sort( _candidates.begin() , _candidates.end() );
+
+	for( int i=0 ; i<count ; i++ )
+	{
+		if( i>0 && _candidates[i].cell==_candidates[i-1].cell ) continue;
+		long long key = _candidates[i].cell;
+		int x = int( key & CELL_MASK ) , y = int( ( key>>CELL_BITS ) & CELL_MASK ) , z = int( key>>(2*CELL_BITS) );
+		_phaseCells[ x%3 + 3*(y%3) + 9*(z%3) ].push_back( int( _cellKeys.size() ) );
+		_cellKeys.push_back( key );
+		_cellStart.push_back( i );
+	}
+	_cellStart.push_back( count );
+}
+
+template< class Point >
+void DiskThinning< Point >::thinCells( int phase , int begin , int end )
+{
+	const std::vector< Point >& points = *_points;
+	for( int c=begin ; c<end ; c++ )
+	{
+		int cell = _phaseCells[phase][c];
+		long long key = _cellKeys[cell];
+		int x = int( key & CELL_MASK ) , y = int( ( key>>CELL_BITS ) & CELL_MASK ) , z = int( key>>(2*CELL_BITS) );
+		for( int k=_cellStart[cell] ; k<_cellStart[cell+1] ; k++ )
+		{
+			const Point& p = points[ _candidates[k].index ];
+			bool keep = true;
+			for( int dx=-1 ; dx<=1 && keep ; dx++ ) for( int dy=-1 ; dy<=1 && keep ; dy++ ) for( int dz=-1 ; dz<=1 && keep ; dz++ )
+			{
+				if( x+dx<0 || y+dy<0 || z+dz<0 ) continue;
+				long long nKey = _CellKey( x+dx , y+dy , z+dz );
+				std::vector< long long >::const_iterator iter = std::lower_bound( _cellKeys.begin() , _cellKeys.end() , nKey );
+				if( iter==_cellKeys.end() || *iter!=nKey ) continue;
+				int neighbor = int( iter-_cellKeys.begin() );
+				for( int l=_cellStart[neighbor] ; l<_cellStart[neighbor+1] && keep ; l++ ) if( _sortedKept[l] )
+				{
+					const Point& q = points[ _candidates[l].index ];
+					double d2 = 0;
+					for( int a=0 ; a<3 ; a++ ) d2 += ( double(q[a])-double(p[a]) ) * ( double(q[a])-double(p[a]) );
+					if( d2<_radius2 ) keep = false;
+				}
+			}
+			_sortedKept[k] = keep;
+		}
+	}
+}
+
+template< class Point >
+void DiskThinning< Point >::getKept( std::vector< char >& kept ) const
+{
+	kept.resize( _candidates.size() );
+	for( size_t k=0 ; k<_candidates.size() ; k++ ) kept[ _candidates[k].index ] = _sortedKept[k];
+}
+
+template< class Point >
+void DiskThinning< Point >::Thin( const std::vector< Point >& points , double radius , std::vector< char >& kept , const std::vector< float >* priorities )
+{
+	DiskThinning< Point > thinning;
+	thinning.set( points , radius , priorities );
+	for( int p=0 ; p<PHASES ; p++ ) thinning.thinCells( p , 0 , thinning.phaseSize(p) );
+	thinning.getKept( kept );
+}
+#endif // DISK_THINNING_INCLUDED
@@ -73,6 +73,8 @@ DAMAGE.
 
 #include "Hash.h"
 #include "BSplineData.h"
+#include <algorithm>
+#include <float.h>
 typedef float Real;
 typedef float MatrixReal;
 
@@ -184,6 +186,67 @@ public:
 };
 
 
+// What a reconstruction leaves behind for the next one over a slightly changed point set:
+// the cube the tree was built in and the per-node coefficients it solved for. A new tree
+// over the same cube (same depth, degree and boundary) starts its solves from these
+// coefficients instead of from zero, and setTree2 (or setTreeSorted) keeps the cube as long as the new points
+// still fit in it and it is within half a finest cell of the cube they would get without a context.
+class PoissonContext
+{
+public:
+	PoissonContext( void ) { iters = 0 , coldIters = -1; clear(); }
+	void clear( void ) { valid = false , depth = boundaryType = degree = -1 , scale = 0 , coefficients.clear(); }
+
+	static long long NodeKey( int d , const int off[3] ) { return ( (long long)d<<60 ) | ( (long long)off[0]<<40 ) | ( (long long)off[1]<<20 ) | (long long)off[2]; }
+	// the stored coefficient of the node, 0 if there is none
+	Real coefficient( long long key ) const
+	{
+		std::vector< std::pair< long long , Real > >::const_iterator iter = std::lower_bound( coefficients.begin() , coefficients.end() , std::pair< long long , Real >( key , -FLT_MAX ) );
+		return ( iter!=coefficients.end() && iter->first==key ) ? iter->second : Real(0);
+	}
+
+	bool valid;
+	int depth , boundaryType , degree;
+	Real scale;
+	Point3D< Real > center;
+	std::vector< std::pair< long long , Real > > coefficients; // sorted by NodeKey
+
+	// statistics of the last solve
+	int iters;
+	int coldIters;	// of the last solve that started from zero, -1 if there was none
+};
+
+// What stays the same between reconstructions at the same depth, degree and boundary type: the B-spline functions
+// with their dot-product and value tables, and the pool the octree nodes are allocated from. A POctree constructed
+// over a cache uses its functions and leaves the tables it computes in them for the next tree, and setAllocator rolls
+// the nodes of the last tree back into the pool instead of freeing them and allocating new blocks. As the pool is
+// shared, only one tree over the cache can be alive at a time, and the cache has to outlive it.
+template< int Degree , bool OutputDensity >
+class PoissonSolverCache
+{
+public:
+	typedef OctNode< TreeNodeData< OutputDensity > , Real > TreeOctNode;
+	PoissonSolverCache( void ) { depth = boundaryType = -1 , blockSize = 0; }
+
+	// Sets the functions up to maxDepth for the boundary type, unless they already are. Returns true if they were kept.
+	bool set( int maxDepth , int boundaryType );
+	// Sets the allocator of the nodes to blocks of blockSize nodes, rolling back the pool of the last tree if it has the same block size
+	void setAllocator( int blockSize );
+
+	int depth , boundaryType;	// of the functions, -1 if they were never set
+	BSplineData< Degree , Real > fData;
+protected:
+	int blockSize;
+};
+
+// How one depth of LaplacianMatrixIteration went: the rows of its system, the conjugate gradient iterations
+// and the norms of the constraints and of the residual left
+struct SolverTrace
+{
+	int depth , rows , iters;
+	double bNorm , rNorm;
+};
+
 template< int Degree , bool OutputDensity >
 class POctree
 {
@@ -243,6 +306,29 @@ public:
 		void Function( const TreeOctNode* node1 , const TreeOctNode* node2 );
 	};
 
+	// Morton keys of cells: the three bits of each level, x in the lowest, with the coarsest level in the highest bits,
+	// so a child's key is its parent's shifted by three plus its index in the parent's children
+	static unsigned long long _MortonKey( int depth , const int off[3] );
+	static void _MortonOffset( unsigned long long key , int depth , int off[3] );
+	// Stable LSD radix sort of the keys (only their lowest bits), order is permuted along
+	void _SortByKey( std::vector< unsigned long long >& keys , std::vector< int >& order , int bits ) const;
+	// The nodes of each depth up to maxDepth and their keys, sorted by key
+	void _SetLevels( std::vector< std::vector< unsigned long long > >& keys , std::vector< std::vector< TreeOctNode* > >& nodes , int maxDepth );
+	// Splits the sorted keys into runs of equal keys>>shift (cells of the given depth) and sorts the runs into 27 colors by
+	// the cell offsets modulo 3. The 3x3x3 neighborhoods of two cells of the same color don't overlap
+	static void _ColorRuns( const std::vector< unsigned long long >& keys , int shift , int depth , std::vector< std::pair< int , int > > runs[27] );
+	// Creates the nodes NeighborKey3::setNeighbors would, called on each of the cells (cells[d] holds sorted, unique keys
+	// of depth d) and on their ancestors. The tree is refined a level at a time, so only the node creation is serial
+	void _RefineForNeighbors( const std::vector< std::vector< unsigned long long > >& cells );
+
+	bool _warmStart;
+	PoissonSolverCache< Degree , OutputDensity >* _cache;
+	BSplineData< Degree , Real > _fData;
+	// The tables of fData are kept with a cache, so only the missing ones are set and none are cleared
+	void _setDotTables( int flags );
+	void _clearDotTables( int flags );
+	bool _fitsFrame( const PoissonContext& context , const Point3D< Real >& min , const Point3D< Real >& max , const Point3D< Real >& center , Real scale ) const;
+
 	int _SolveFixedDepthMatrix( int depth , const SortedTreeNodes< OutputDensity >& sNodes , Real* subConstraints ,                     bool showResidual , int minIters , double accuracy , bool noSolve = false , int fixedIters=-1 );
 	int _SolveFixedDepthMatrix( int depth , const SortedTreeNodes< OutputDensity >& sNodes , Real* subConstraints , int startingDepth , bool showResidual , int minIters , double accuracy , bool noSolve = false , int fixedIters=-1 );
 
@@ -250,7 +336,9 @@ public:
 	int GetMatrixRowSize( const typename TreeOctNode::Neighbors5& neighbors5 ) const;
 	int GetMatrixRowSize( const typename TreeOctNode::Neighbors5& neighbors5 , int xStart , int xEnd , int yStart , int yEnd , int zStart , int zEnd ) const;
 	int SetMatrixRow( const typename TreeOctNode::Neighbors5& neighbors5 , Pointer( MatrixEntry< MatrixReal > ) row , int offset , const double stencil[5][5][5] ) const;
-	int SetMatrixRow( const typename TreeOctNode::Neighbors5& neighbors5 , Pointer( MatrixEntry< MatrixReal > ) row , int offset , const double stencil[5][5][5] , int xStart , int xEnd , int yStart , int yEnd , int zStart , int zEnd ) const;
+	// With fullRow all the (up to 125) entries of the row are set, rather than the half up to the diagonal of the symmetric matrix.
+	// The row is the one the half rows add up to, supported tells if the node itself is inset supported
+	int SetMatrixRow( const typename TreeOctNode::Neighbors5& neighbors5 , Pointer( MatrixEntry< MatrixReal > ) row , int offset , const double stencil[5][5][5] , int xStart , int xEnd , int yStart , int yEnd , int zStart , int zEnd , bool fullRow=false , bool supported=true ) const;
 	void SetDivergenceStencil( int depth , Point3D< double > stencil[5][5][5] , bool scatter ) const;
 	void SetLaplacianStencil( int depth , double stencil[5][5][5] ) const;
 	template< class C , int N > struct Stencil{ C values[N][N][N]; };
@@ -266,7 +354,9 @@ public:
 	void DownSampleFinerConstraints( int depth , SortedTreeNodes< OutputDensity >& sNodes ) const;
 	template< class C > void DownSample( int depth , const SortedTreeNodes< OutputDensity >& sNodes , C* constraints ) const;
 	template< class C > void   UpSample( int depth , const SortedTreeNodes< OutputDensity >& sNodes , C* coefficients ) const;
-	int GetFixedDepthLaplacian( SparseSymmetricMatrix< Real >& matrix , int depth , const SortedTreeNodes< OutputDensity >& sNodes , Real* subConstraints );
+	// The system of a depth is applied from the Laplacian stencil and only the rows near the boundary (or the points, when
+	// the values are constrained) are set explicitly
+	int GetFixedDepthLaplacian( StencilSymmetricMatrix< Real >& matrix , int depth , const SortedTreeNodes< OutputDensity >& sNodes , Real* subConstraints );
 	int GetRestrictedFixedDepthLaplacian( SparseSymmetricMatrix< Real >& matrix , int depth , const int* entries , int entryCount , const TreeOctNode* rNode, Real radius , const SortedTreeNodes< OutputDensity >& sNodes , Real* subConstraints );
 
 	void SetIsoCorners( Real isoValue , TreeOctNode* leaf , typename SortedTreeNodes< OutputDensity >::CornerTableData& cData , Pointer( char ) valuesSet , Pointer( Real ) values , typename TreeOctNode::ConstNeighborKey3& nKey , const Real* metSolution , const Stencil< Real , 3 > stencil1[8] , const Stencil< Real , 3 > stencil2[8][8] );
@@ -337,28 +427,49 @@ public:
 	static bool _IsInsetSupported( const TreeOctNode* node );
 public:
 	int threads;
+	int preconditioner;						// one of the PRECONDITIONER_* of SparseMatrix.h
+	std::vector< SolverTrace > solverTrace;	// per depth of the last LaplacianMatrixIteration, if it was asked to show the residuals
 	static double maxMemoryUsage;
 	static double MemoryUsage( void );
 	std::vector< Point3D<Real> >* normals;
 	Real postDerivativeSmooth;
 	TreeOctNode tree;
-	BSplineData< Degree , Real > fData;
-	POctree( void );
+	BSplineData< Degree , Real >& fData;	// that of the cache if there is one
+	POctree( PoissonSolverCache< Degree , OutputDensity >* cache=NULL );
 
 	void setBSplineData( int maxDepth , int boundaryType=BSplineElements< Degree >::NONE );
 	void finalize( int subdivisionDepth );
 	int refineBoundary( int subdivisionDepth );
 	Pointer( Real ) GetSolutionGrid( int& res , Real isoValue=0.f , int depth=-1 );
+	// The values of GetSolutionGrid in the bricks of 8^3 cells (aligned to multiples of 8) that have a cell center within radius
+	// of one of the points. cells are the indices into the full grid (ascending), values the matching values
+	void GetSolutionBand( const std::vector< Point3D< Real > >& points , Real radius , int& res , std::vector< int >& cells , std::vector< Real >& values , Real isoValue=0.f , int depth=-1 ) const;
+	// Points on the iso-surface, without extracting a mesh: every leaf whose corners straddle the iso-value gives the mean of the
+	// crossings on its edges, with the gradient of the field there as (outward, unit) normal, and of those the ones closer than
+	// radius to a kept one are dropped (DiskThinning, in leaf order within a cell). A radius<=0 is set to the Poisson-disk radius of sampleCount samples over the surface,
+	// whose area is estimated from the leaves it crosses. The points are in the coordinates the points were passed to setTree
+	// in, and the radius used is returned.
+	Real GetIsoPoints( Real isoValue , int sampleCount , std::vector< Point3D< Real > >& points , std::vector< Point3D< Real > >& normals , Real radius=0 );
 	int setTree( char* fileName , int maxDepth , int minDepth , int kernelDepth , Real samplesPerNode ,
 		Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm=XForm4x4< Real >::Identity );
 
-  int setTree2( std::vector<Point3D<Real> > &Pts, std::vector<Point3D<Real> > &Nor, int maxDepth , int minDepth , int kernelDepth , Real samplesPerNode ,
-    Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm=XForm4x4< Real >::Identity );
+  // with a context the cube of its last reconstruction is kept if all the points still fall in it and it is within half a finest cell of the cold cube
+  int setTree2( std::vector<Point3D<Real> > &Pts, std::vector<Point3D<Real> > &Nor, int maxDepth , int minDepth , int splatDepth , Real samplesPerNode ,
+    Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm=XForm4x4< Real >::Identity() , const PoissonContext* context=NULL );
+	// Builds the same nodes as setTree2, from the points sorted by Morton code instead of by inserting them one at a time.
+	// The density and the normals are splatted in parallel over runs of points falling in the same cell.
+	int setTreeSorted( const std::vector< Point3D< Real > >& Pts , const std::vector< Point3D< Real > >& Nor , int maxDepth , int minDepth , int splatDepth , Real samplesPerNode ,
+		Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm=XForm4x4< Real >::Identity() , const PoissonContext* context=NULL );
 
 	void SetLaplacianConstraints(void);
 	void ClipTree(void);
 	int LaplacianMatrixIteration( int subdivideDepth , bool showResidual , int minIters , double accuracy , int maxSolveDepth , int fixedIters );
 
+	// call after SetLaplacianConstraints, returns the number of nodes given an initial value (0 if the tree isn't over the context's cube)
+	int SetInitialSolution( const PoissonContext& context );
+	// call after LaplacianMatrixIteration, iters is what it returned
+	void GetSolution( PoissonContext& context , int iters ) const;
+
 	Real GetIsoValue( void );
 	template< class Vertex >
 	void GetMCIsoTriangles( Real isoValue , int subdivideDepth , CoredMeshData< Vertex >* mesh , int fullDepthIso=0 , int nonLinearFit=1 , bool addBarycenter=false , bool polygonMesh=false );
@@ -32,6 +32,7 @@ DAMAGE.
 //#include <ctime>
 #include "Poisson/PointStream.h"
 #include "Poisson/MAT.h"
+#include "Poisson/DiskThinning.h"
 
 #define ITERATION_POWER 1.0/3
 #define MEMORY_ALLOCATOR_BLOCK_SIZE 1<<12
@@ -516,13 +517,16 @@ template< int Degree , bool OutputDensity > double POctree< Degree , OutputDensi
 //}
 
 template< int Degree , bool OutputDensity >
-POctree< Degree , OutputDensity >::POctree(void)
+POctree< Degree , OutputDensity >::POctree( PoissonSolverCache< Degree , OutputDensity >* cache ) : fData( cache ? cache->fData : _fData )
 {
+	_cache = cache;
 	threads = 1;
 	radius = 0;
 	width = 0;
 	postDerivativeSmooth = 0;
 	_constrainValues = false;
+	_warmStart = false;
+	preconditioner = PRECONDITIONER_NONE;
 }
 
 template< int Degree , bool OutputDensity >
@@ -1290,8 +1294,8 @@ int POctree< Degree , OutputDensity >::setTree( char* fileName , int maxDepth ,
 
 template< int Degree , bool OutputDensity >
 int POctree< Degree , OutputDensity >::
-  setTree2( std::vector<Point3D<Real> > &Pts, std::vector<Point3D<Real> > &Nor, int maxDepth , int minDepth , int kernelDepth , Real samplesPerNode ,
-  Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm )
+  setTree2( std::vector<Point3D<Real> > &Pts, std::vector<Point3D<Real> > &Nor, int maxDepth , int minDepth , int splatDepth , Real samplesPerNode ,
+  Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm , const PoissonContext* context )
 {
   if( splatDepth<0 ) splatDepth = 0;
   this->samplesPerNode = samplesPerNode;
@@ -1340,6 +1344,7 @@ int POctree< Degree , OutputDensity >::
 
   _scale *= scaleFactor;
   for( i=0 ; i<DIMENSION ; i++ ) _center[i] -= _scale/2;
+  if( context && _fitsFrame( *context , min , max , _center , _scale ) ) _scale = context->scale , _center = context->center;
   if( splatDepth>0 )
   {
     //double t = Time(NULL);
@@ -1517,6 +1522,478 @@ int POctree< Degree , OutputDensity >::
 }
 
 
+template< int Degree , bool OutputDensity >
+int POctree< Degree , OutputDensity >::setTreeSorted( const std::vector< Point3D< Real > >& Pts , const std::vector< Point3D< Real > >& Nor , int maxDepth , int minDepth , int splatDepth , Real samplesPerNode ,
+	Real scaleFactor , int useConfidence , Real constraintWeight , int adaptiveExponent , XForm4x4< Real > xForm , const PoissonContext* context )
+{
+	if( splatDepth<0 ) splatDepth = 0;
+	this->samplesPerNode = samplesPerNode;
+	this->splatDepth = splatDepth;
+
+	XForm3x3< Real > xFormN;
+	for( int i=0 ; i<3 ; i++ ) for( int j=0 ; j<3 ; j++ ) xFormN(i,j) = xForm(i,j);
+	xFormN = xFormN.transpose().inverse();
+	if( _boundaryType==0 ) maxDepth++ , minDepth = std::max< int >( 1 , minDepth )+1;
+	else minDepth = std::max< int >( 0 , minDepth );
+	if( _boundaryType==0 && splatDepth>0 ) splatDepth++;
+	_minDepth = std::min< int >( minDepth , maxDepth );
+	_constrainValues = (constraintWeight>0);
+
+	tree.setFullDepth( _minDepth );
+	normals = new std::vector< Point3D<Real> >();
+	int count = int( Pts.size() );
+	if( !count ) return 0;
+
+	// Transform the points and get their bounding box
+	std::vector< Point3D< Real > > points( count ) , pointNormals( count ) , tMin( threads ) , tMax( threads );
+#pragma omp parallel for num_threads( threads )
+	for( int t=0 ; t<threads ; t++ )
+	{
+		int start = int( ( (long long)count*t )/threads ) , end = int( ( (long long)count*(t+1) )/threads );
+		for( int i=start ; i<end ; i++ )
+		{
+			points[i] = xForm * Pts[i] , pointNormals[i] = xFormN * Nor[i];
+			for( int c=0 ; c<DIMENSION ; c++ )
+			{
+				if( i==start || points[i][c]<tMin[t][c] ) tMin[t][c] = points[i][c];
+				if( i==start || points[i][c]>tMax[t][c] ) tMax[t][c] = points[i][c];
+			}
+		}
+	}
+	Point3D< Real > min , max;
+	for( int t=0 , first=1 ; t<threads ; t++ ) if( ( (long long)count*(t+1) )/threads>( (long long)count*t )/threads )
+	{
+		for( int c=0 ; c<DIMENSION ; c++ )
+		{
+			if( first || tMin[t][c]<min[c] ) min[c] = tMin[t][c];
+			if( first || tMax[t][c]>max[c] ) max[c] = tMax[t][c];
+		}
+		first = 0;
+	}
+
+	if( _boundaryType==0 ) _scale = std::max< Real >( max[0]-min[0] , std::max< Real >( max[1]-min[1] , max[2]-min[2] ) ) * 2;
+	else         _scale = std::max< Real >( max[0]-min[0] , std::max< Real >( max[1]-min[1] , max[2]-min[2] ) );
+	_center = ( max+min ) /2;
+	_scale *= scaleFactor;
+	for( int i=0 ; i<DIMENSION ; i++ ) _center[i] -= _scale/2;
+	if( context && _fitsFrame( *context , min , max , _center , _scale ) ) _scale = context->scale , _center = context->center;
+
+	// Sort the points in the cube by the key of the maxDepth cell CornerIndex walks them down to (a point on the face
+	// between two cells goes to the lower one). The points of a cell of any depth are then a run of the sorted order.
+	std::vector< char > inside( count );
+#pragma omp parallel for num_threads( threads )
+	for( int i=0 ; i<count ; i++ ) points[i] = ( points[i]-_center ) / _scale , inside[i] = _inBounds( points[i] );
+	std::vector< int > order;
+	for( int i=0 ; i<count ; i++ ) if( inside[i] ) order.push_back( i );
+	int inCount = int( order.size() ) , res = 1<<maxDepth;
+	std::vector< unsigned long long > keys( inCount );
+#pragma omp parallel for num_threads( threads )
+	for( int i=0 ; i<inCount ; i++ )
+	{
+		int off[3];
+		for( int c=0 ; c<3 ; c++ ) off[c] = std::min< int >( res-1 , std::max< int >( 0 , int( ceil( double( points[ order[i] ][c] ) * res ) )-1 ) );
+		keys[i] = _MortonKey( maxDepth , off );
+	}
+	_SortByKey( keys , order , 3*maxDepth );
+
+	std::vector< std::vector< unsigned long long > > levelKeys;
+	std::vector< std::vector< TreeOctNode* > > levelNodes;
+	std::vector< std::pair< int , int > > runs[27];
+	if( splatDepth>0 )
+	{
+		// The density: each point adds to the 3x3x3 nodes around the one it falls in, at every depth up to splatDepth
+		std::vector< std::vector< unsigned long long > > cells( splatDepth+1 );
+		for( int i=0 ; i<inCount ; i++ )
+		{
+			unsigned long long key = keys[i]>>( 3*(maxDepth-splatDepth) );
+			if( cells[splatDepth].empty() || cells[splatDepth].back()!=key ) cells[splatDepth].push_back( key );
+		}
+		_RefineForNeighbors( cells );
+		_SetLevels( levelKeys , levelNodes , splatDepth );
+		for( int d=0 ; d<=splatDepth ; d++ )
+		{
+			int shift = 3*(maxDepth-d);
+			_ColorRuns( keys , shift , d , runs );
+			for( int c=0 ; c<27 ; c++ )
+			{
+				const std::vector< std::pair< int , int > >& _runs = runs[c];
+#pragma omp parallel for num_threads( threads )
+				for( int t=0 ; t<threads ; t++ )
+				{
+					typename TreeOctNode::NeighborKey3 neighborKey;
+					neighborKey.set( maxDepth );
+					int runCount = int( _runs.size() );
+					for( int r=(runCount*t)/threads ; r<(runCount*(t+1))/threads ; r++ )
+					{
+						TreeOctNode* node = levelNodes[d][ std::lower_bound( levelKeys[d].begin() , levelKeys[d].end() , keys[ _runs[r].first ]>>shift ) - levelKeys[d].begin() ];
+						for( int i=_runs[r].first ; i<_runs[r].second ; i++ )
+							UpdateWeightContribution( node , points[ order[i] ] , neighborKey , useConfidence ? Real( Length( pointNormals[ order[i] ] ) ) : Real(1.) );
+					}
+				}
+			}
+		}
+	}
+
+	// Where each normal goes: one or two nodes at a depth set by the density (as in SplatOrientedPoint), or the maxDepth node
+	std::vector< int > splatDepths( 2*inCount , -1 );
+	std::vector< Point3D< Real > > splatNormals( 2*inCount );
+	std::vector< Real > pointWeights( inCount );
+	std::vector< char > splatted( inCount , 0 );
+#pragma omp parallel for num_threads( threads )
+	for( int t=0 ; t<threads ; t++ )
+	{
+		typename TreeOctNode::NeighborKey3 neighborKey;
+		neighborKey.set( maxDepth );
+		for( int i=(inCount*t)/threads ; i<(inCount*(t+1))/threads ; i++ )
+		{
+			const Point3D< Real >& p = points[ order[i] ];
+			Point3D< Real > n = pointNormals[ order[i] ] * Real(-1.);
+			Real l = Real( Length( n ) );
+			if( l!=l || l<=EPSILON ) continue;
+			if( !useConfidence ) n /= l;
+			splatted[i] = 1;
+
+			TreeOctNode* temp = NULL;
+			if( splatDepth ) temp = levelNodes[splatDepth][ std::lower_bound( levelKeys[splatDepth].begin() , levelKeys[splatDepth].end() , keys[i]>>( 3*(maxDepth-splatDepth) ) ) - levelKeys[splatDepth].begin() ];
+			if( samplesPerNode>0 && splatDepth )
+			{
+				Real weight , depth;
+				GetSampleDepthAndWeight( temp , p , neighborKey , samplesPerNode , depth , weight );
+				if( depth<_minDepth ) depth = Real(_minDepth);
+				if( depth>maxDepth ) depth = Real(maxDepth);
+				int topDepth = int(ceil(depth));
+				double dx = 1.0-(topDepth-depth);
+				if( topDepth<=_minDepth ) topDepth = _minDepth , dx = 1;
+				else if( topDepth>maxDepth ) topDepth = maxDepth , dx = 1;
+				splatDepths[2*i] = topDepth;
+				splatNormals[2*i] = n * weight / Real( pow( 1.0/(1<<topDepth) , 3 ) ) * Real( dx );
+				if( fabs(1.0-dx) > EPSILON )
+				{
+					splatDepths[2*i+1] = topDepth-1;
+					splatNormals[2*i+1] = n * weight / Real( pow( 1.0/(1<<(topDepth-1)) , 3 ) ) * Real( 1.0-dx );
+				}
+				pointWeights[i] = weight;
+			}
+			else
+			{
+				pointWeights[i] = splatDepth ? GetSampleWeight( temp , p , neighborKey ) : Real(1.);
+				splatDepths[2*i] = maxDepth , splatNormals[2*i] = n * pointWeights[i];
+			}
+		}
+	}
+	double pointWeightSum = 0;
+	int cnt = 0;
+	for( int i=0 ; i<inCount ; i++ ) if( splatted[i] ) pointWeightSum += pointWeights[i] , cnt++;
+
+	// The splats of each depth, still in sorted order, and the cells they go to
+	std::vector< std::vector< int > > splats( maxDepth+1 );
+	std::vector< std::vector< unsigned long long > > cells( maxDepth+1 ) , splatKeys( maxDepth+1 );
+	for( int s=0 ; s<2*inCount ; s++ ) if( splatDepths[s]>=0 )
+	{
+		int d = splatDepths[s];
+		unsigned long long key = keys[s/2]>>( 3*(maxDepth-d) );
+		splats[d].push_back( s ) , splatKeys[d].push_back( key );
+		if( cells[d].empty() || cells[d].back()!=key ) cells[d].push_back( key );
+	}
+	_RefineForNeighbors( cells );
+	_SetLevels( levelKeys , levelNodes , maxDepth );
+
+	// A splat (of order 2) adds to all of the 3x3x3 nodes around it. Give them their normals up front, in sorted order,
+	// so the splatting below only adds to existing ones
+	{
+		typename TreeOctNode::NeighborKey3 neighborKey;
+		neighborKey.set( maxDepth );
+		for( int d=0 ; d<=maxDepth ; d++ ) for( size_t i=0 ; i<cells[d].size() ; i++ )
+		{
+			TreeOctNode* node = levelNodes[d][ std::lower_bound( levelKeys[d].begin() , levelKeys[d].end() , cells[d][i] ) - levelKeys[d].begin() ];
+			typename TreeOctNode::Neighbors3& neighbors = neighborKey.setNeighbors( node );
+			for( int x=0 ; x<3 ; x++ ) for( int y=0 ; y<3 ; y++ ) for( int z=0 ; z<3 ; z++ )
+			{
+				TreeOctNode* _node = neighbors.neighbors[x][y][z];
+				if( !_node || _node->nodeData.normalIndex>=0 ) continue;
+				_node->nodeData.nodeIndex = 0;
+				_node->nodeData.normalIndex = int( normals->size() );
+				normals->push_back( Point3D< Real >() );
+			}
+		}
+	}
+	for( int d=0 ; d<=maxDepth ; d++ )
+	{
+		_ColorRuns( splatKeys[d] , 0 , d , runs );
+		for( int c=0 ; c<27 ; c++ )
+		{
+			const std::vector< std::pair< int , int > >& _runs = runs[c];
+#pragma omp parallel for num_threads( threads )
+			for( int t=0 ; t<threads ; t++ )
+			{
+				typename TreeOctNode::NeighborKey3 neighborKey;
+				neighborKey.set( maxDepth );
+				int runCount = int( _runs.size() );
+				for( int r=(runCount*t)/threads ; r<(runCount*(t+1))/threads ; r++ )
+				{
+					TreeOctNode* node = levelNodes[d][ std::lower_bound( levelKeys[d].begin() , levelKeys[d].end() , splatKeys[d][ _runs[r].first ] ) - levelKeys[d].begin() ];
+					for( int i=_runs[r].first ; i<_runs[r].second ; i++ )
+					{
+						int s = splats[d][i];
+						SplatOrientedPoint( node , points[ order[s/2] ] , splatNormals[s] , neighborKey );
+					}
+				}
+			}
+		}
+	}
+
+	if( _constrainValues )
+	{
+		// Unlike setTree2 the points are walked down the finished tree, so each one is in all the nodes it falls in
+		for( int i=0 ; i<inCount ; i++ ) if( splatted[i] )
+		{
+			const Point3D< Real >& p = points[ order[i] ];
+			TreeOctNode* temp = &tree;
+			Point3D< Real > myCenter( Real(0.5) , Real(0.5) , Real(0.5) );
+			Real myWidth = Real(1.0);
+			while( 1 )
+			{
+				int idx = temp->nodeData.pointIndex;
+				if( idx==-1 )
+				{
+					idx = int( _points.size() );
+					_points.push_back( PointData( p , Real(1.) ) );
+					temp->nodeData.pointIndex = idx;
+				}
+				else
+				{
+					_points[idx].weight += Real(1.);
+					_points[idx].position += p;
+				}
+
+				int cIndex = TreeOctNode::CornerIndex( myCenter , p );
+				if( !temp->children ) break;
+				temp = &temp->children[cIndex];
+				myWidth /= 2;
+				if( cIndex&1 ) myCenter[0] += myWidth/2;
+				else		   myCenter[0] -= myWidth/2;
+				if( cIndex&2 ) myCenter[1] += myWidth/2;
+				else		   myCenter[1] -= myWidth/2;
+				if( cIndex&4 ) myCenter[2] += myWidth/2;
+				else		   myCenter[2] -= myWidth/2;
+			}
+		}
+	}
+
+	if( _boundaryType==0 ) pointWeightSum *= Real(4.);
+	constraintWeight *= Real( pointWeightSum );
+	constraintWeight /= cnt;
+
+	if( _constrainValues )
+		for( TreeOctNode* node=tree.nextNode() ; node ; node=tree.nextNode(node) )
+			if( node->nodeData.pointIndex!=-1 )
+			{
+				int idx = node->nodeData.pointIndex;
+				_points[idx].position /= _points[idx].weight;
+				int e = ( _boundaryType==0 ? node->d-1 : node->d ) * adaptiveExponent - ( _boundaryType==0 ? maxDepth-1 : maxDepth ) * (adaptiveExponent-1);
+				if( e<0 ) _points[idx].weight /= Real( 1<<(-e) );
+				else      _points[idx].weight *= Real( 1<<  e  );
+				_points[idx].weight *= Real( constraintWeight );
+			}
+#if FORCE_NEUMANN_FIELD
+	if( _boundaryType==1 )
+		for( TreeOctNode* node=tree.nextNode() ; node ; node=tree.nextNode( node ) )
+		{
+			int d , off[3] , res;
+			node->depthAndOffset( d , off );
+			res = 1<<d;
+			if( node->nodeData.normalIndex<0 ) continue;
+			Point3D< Real >& normal = (*normals)[node->nodeData.normalIndex];
+			for( int d=0 ; d<3 ; d++ ) if( off[d]==0 || off[d]==res-1 ) normal[d] = 0;
+		}
+#endif // FORCE_NEUMANN_FIELD
+	return cnt;
+}
+
+template< int Degree , bool OutputDensity >
+unsigned long long POctree< Degree , OutputDensity >::_MortonKey( int depth , const int off[3] )
+{
+	unsigned long long key = 0;
+	for( int d=depth-1 ; d>=0 ; d-- ) key = ( key<<3 ) | ( (off[0]>>d)&1 ) | ( ( (off[1]>>d)&1 )<<1 ) | ( ( (off[2]>>d)&1 )<<2 );
+	return key;
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_MortonOffset( unsigned long long key , int depth , int off[3] )
+{
+	off[0] = off[1] = off[2] = 0;
+	for( int d=0 ; d<depth ; d++ , key>>=3 ) for( int c=0 ; c<3 ; c++ ) off[c] |= int( (key>>c)&1 )<<d;
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_SortByKey( std::vector< unsigned long long >& keys , std::vector< int >& order , int bits ) const
+{
+	const int RadixBits = 8 , Buckets = 1<<RadixBits;
+	int count = int( keys.size() );
+	std::vector< unsigned long long > _keys( count );
+	std::vector< int > _order( count ) , offsets( threads*Buckets );
+	for( int shift=0 ; shift<bits ; shift+=RadixBits )
+	{
+		std::fill( offsets.begin() , offsets.end() , 0 );
+#pragma omp parallel for num_threads( threads )
+		for( int t=0 ; t<threads ; t++ )
+			for( int i=int( ( (long long)count*t )/threads ) ; i<int( ( (long long)count*(t+1) )/threads ) ; i++ ) offsets[ t*Buckets + int( (keys[i]>>shift)&(Buckets-1) ) ]++;
+		// Digit by digit and, within a digit, thread by thread, so equal digits keep their order
+		for( int b=0 , sum=0 ; b<Buckets ; b++ ) for( int t=0 ; t<threads ; t++ )
+		{
+			int c = offsets[ t*Buckets+b ];
+			offsets[ t*Buckets+b ] = sum , sum += c;
+		}
+#pragma omp parallel for num_threads( threads )
+		for( int t=0 ; t<threads ; t++ )
+			for( int i=int( ( (long long)count*t )/threads ) ; i<int( ( (long long)count*(t+1) )/threads ) ; i++ )
+			{
+				int& o = offsets[ t*Buckets + int( (keys[i]>>shift)&(Buckets-1) ) ];
+				_keys[o] = keys[i] , _order[o] = order[i] , o++;
+			}
+		keys.swap( _keys ) , order.swap( _order );
+	}
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_SetLevels( std::vector< std::vector< unsigned long long > >& keys , std::vector< std::vector< TreeOctNode* > >& nodes , int maxDepth )
+{
+	keys.resize( maxDepth+1 ) , nodes.resize( maxDepth+1 );
+	keys[0].assign( 1 , 0 ) , nodes[0].assign( 1 , &tree );
+	for( int d=1 ; d<=maxDepth ; d++ )
+	{
+		keys[d].clear() , nodes[d].clear();
+		for( size_t i=0 ; i<nodes[d-1].size() ; i++ ) if( nodes[d-1][i]->children )
+			for( int c=0 ; c<Cube::CORNERS ; c++ ) keys[d].push_back( ( keys[d-1][i]<<3 ) | c ) , nodes[d].push_back( nodes[d-1][i]->children+c );
+	}
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_ColorRuns( const std::vector< unsigned long long >& keys , int shift , int depth , std::vector< std::pair< int , int > > runs[27] )
+{
+	for( int c=0 ; c<27 ; c++ ) runs[c].clear();
+	for( int start=0 , end ; start<int( keys.size() ) ; start=end )
+	{
+		unsigned long long key = keys[start]>>shift;
+		for( end=start+1 ; end<int( keys.size() ) && (keys[end]>>shift)==key ; end++ );
+		int off[3];
+		_MortonOffset( key , depth , off );
+		runs[ off[0]%3 + 3*(off[1]%3) + 9*(off[2]%3) ].push_back( std::pair< int , int >( start , end ) );
+	}
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_RefineForNeighbors( const std::vector< std::vector< unsigned long long > >& cells )
+{
+	int maxDepth = int( cells.size() )-1;
+	// The cells and all their ancestors
+	std::vector< std::vector< unsigned long long > > ancestors( maxDepth+1 );
+	for( int d=maxDepth ; d>0 ; d-- )
+	{
+		std::vector< unsigned long long >& a = ancestors[d];
+		if( d==maxDepth ) a = cells[d];
+		else
+		{
+			std::vector< unsigned long long > parents( ancestors[d+1].size() );
+			for( size_t i=0 ; i<parents.size() ; i++ ) parents[i] = ancestors[d+1][i]>>3;
+			a.resize( parents.size() + cells[d].size() );
+			std::merge( parents.begin() , parents.end() , cells[d].begin() , cells[d].end() , a.begin() );
+		}
+		a.erase( std::unique( a.begin() , a.end() ) , a.end() );
+	}
+
+	// setNeighbors on a node of depth d takes its 3x3x3 neighbors from the children of the (up to) 2x2x2 nodes of
+	// depth d-1 around it, after doing the same for its parent. Going down a level at a time, these nodes are already there.
+	std::vector< unsigned long long > levelKeys( 1 , 0 ) , nextKeys;
+	std::vector< TreeOctNode* > levelNodes( 1 , &tree ) , nextNodes;
+	for( int d=1 ; d<=maxDepth ; d++ )
+	{
+		const std::vector< unsigned long long >& a = ancestors[d];
+		std::vector< int > parents( Cube::CORNERS*a.size() , -1 );
+		int pRes = 1<<(d-1);
+#pragma omp parallel for num_threads( threads )
+		for( int i=0 ; i<int( a.size() ) ; i++ )
+		{
+			int off[3] , pOff[3][2];
+			_MortonOffset( a[i] , d , off );
+			for( int c=0 ; c<3 ; c++ ) pOff[c][0] = off[c]>>1 , pOff[c][1] = (off[c]&1) ? pOff[c][0]+1 : pOff[c][0]-1;
+			for( int j=0 ; j<Cube::CORNERS ; j++ )
+			{
+				int x , y , z;
+				Cube::FactorCornerIndex( j , x , y , z );
+				int p[] = { pOff[0][x] , pOff[1][y] , pOff[2][z] };
+				if( p[0]<0 || p[0]>=pRes || p[1]<0 || p[1]>=pRes || p[2]<0 || p[2]>=pRes ) continue;
+				unsigned long long key = _MortonKey( d-1 , p );
+				std::vector< unsigned long long >::const_iterator iter = std::lower_bound( levelKeys.begin() , levelKeys.end() , key );
+				if( iter!=levelKeys.end() && *iter==key ) parents[ Cube::CORNERS*i+j ] = int( iter-levelKeys.begin() );
+			}
+		}
+		for( size_t i=0 ; i<parents.size() ; i++ ) if( parents[i]>=0 && !levelNodes[ parents[i] ]->children ) levelNodes[ parents[i] ]->initChildren();
+		if( d==maxDepth ) break;
+
+		nextKeys.clear() , nextNodes.clear();
+		for( size_t i=0 ; i<levelNodes.size() ; i++ ) if( levelNodes[i]->children )
+			for( int c=0 ; c<Cube::CORNERS ; c++ ) nextKeys.push_back( ( levelKeys[i]<<3 ) | c ) , nextNodes.push_back( levelNodes[i]->children+c );
+		levelKeys.swap( nextKeys ) , levelNodes.swap( nextNodes );
+	}
+}
+
+template< int Degree , bool OutputDensity >
+bool POctree< Degree , OutputDensity >::_fitsFrame( const PoissonContext& context , const Point3D< Real >& min , const Point3D< Real >& max , const Point3D< Real >& center , Real scale ) const
+{
+	if( !context.valid || context.depth!=fData.depth || context.boundaryType!=_boundaryType || context.degree!=Degree ) return false;
+	// The old cube may be off the one a cold build would pick by half a finest cell at most, so a warm solve
+	// is over the same frame as a cold one up to that.
+	Real tolerance = scale / Real( 2<<fData.depth );
+	if( fabs( context.scale-scale )>tolerance ) return false;
+	for( int i=0 ; i<DIMENSION ; i++ ) if( fabs( context.center[i]-center[i] )>tolerance ) return false;
+	Point3D< Real > _min = ( min - context.center ) / context.scale , _max = ( max - context.center ) / context.scale;
+	return _inBounds( _min ) && _inBounds( _max );
+}
+
+template< int Degree , bool OutputDensity >
+int POctree< Degree , OutputDensity >::SetInitialSolution( const PoissonContext& context )
+{
+	_warmStart = false;
+	if( !context.valid || context.depth!=fData.depth || context.boundaryType!=_boundaryType || context.degree!=Degree ) return 0;
+	if( context.scale!=_scale || context.center[0]!=_center[0] || context.center[1]!=_center[1] || context.center[2]!=_center[2] ) return 0;
+
+	int count = 0;
+#pragma omp parallel for num_threads( threads ) reduction( + : count )
+	for( int i=_sNodes.nodeCount[_minDepth+1] ; i<_sNodes.nodeCount[_sNodes.maxDepth] ; i++ )
+	{
+		int d , off[3];
+		_sNodes.treeNodes[i]->depthAndOffset( d , off );
+		Real solution = context.coefficient( PoissonContext::NodeKey( d , off ) );
+		_sNodes.treeNodes[i]->nodeData.solution = solution;
+		if( solution!=0 ) count++;
+	}
+	_warmStart = count>0;
+	return count;
+}
+
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::GetSolution( PoissonContext& context , int iters ) const
+{
+	context.valid = true;
+	context.depth = fData.depth;
+	context.boundaryType = _boundaryType;
+	context.degree = Degree;
+	context.scale = _scale;
+	context.center = _center;
+	context.iters = iters;
+	if( !_warmStart ) context.coldIters = iters;
+
+	// Only the adaptive depths are kept. Up to _minDepth the solves start from the up-sampled
+	// coarser solution, an old solution there leaves smooth errors that CG doesn't remove
+	// before it meets the tolerance.
+	context.coefficients.clear();
+	for( int i=_sNodes.nodeCount[_minDepth+1] ; i<_sNodes.nodeCount[_sNodes.maxDepth] ; i++ )
+	{
+		const TreeOctNode* node = _sNodes.treeNodes[i];
+		if( node->nodeData.solution==0 ) continue;
+		int d , off[3];
+		node->depthAndOffset( d , off );
+		context.coefficients.push_back( std::pair< long long , Real >( PoissonContext::NodeKey( d , off ) , node->nodeData.solution ) );
+	}
+	std::sort( context.coefficients.begin() , context.coefficients.end() );
+}
+
 template< int Degree , bool OutputDensity >
 void POctree< Degree , OutputDensity >::setBSplineData( int maxDepth , int boundaryType )
 {
@@ -1527,7 +2004,39 @@ void POctree< Degree , OutputDensity >::setBSplineData( int maxDepth , int bound
 	radius = 0.5 + 0.5 * Degree;
 	width = int(double(radius+0.5-EPSILON)*2);
 	postDerivativeSmooth = Real(1.0)/(1<<maxDepth);
+	if( _cache ) _cache->set( maxDepth , boundaryType );
+	else         fData.set( maxDepth , true , boundaryType );
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_setDotTables( int flags )
+{
+	if( _cache )
+	{
+		if( fData.vvDotTable ) flags &= ~fData.VV_DOT_FLAG;
+		if( fData.dvDotTable ) flags &= ~fData.DV_DOT_FLAG;
+		if( fData.ddDotTable ) flags &= ~fData.DD_DOT_FLAG;
+	}
+	if( flags ) fData.setDotTables( flags , _boundaryType==0 );
+}
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::_clearDotTables( int flags ){ if( !_cache ) fData.clearDotTables( flags ); }
+
+///////////////////////
+// PoissonSolverCache //
+///////////////////////
+template< int Degree , bool OutputDensity >
+bool PoissonSolverCache< Degree , OutputDensity >::set( int maxDepth , int boundaryType )
+{
+	if( depth==maxDepth && this->boundaryType==boundaryType ) return true;
 	fData.set( maxDepth , true , boundaryType );
+	depth = maxDepth , this->boundaryType = boundaryType;
+	return false;
+}
+template< int Degree , bool OutputDensity >
+void PoissonSolverCache< Degree , OutputDensity >::setAllocator( int blockSize )
+{
+	if( blockSize>0 && blockSize==this->blockSize && TreeOctNode::UseAllocator() ) TreeOctNode::MyAllocator.rollBack();
+	else TreeOctNode::SetAllocator( blockSize ) , this->blockSize = blockSize;
 }
 
 template< int Degree , bool OutputDensity >
@@ -1662,7 +2171,7 @@ int POctree< Degree , OutputDensity >::SetMatrixRow( const typename TreeOctNode:
 }
 
 template< int Degree , bool OutputDensity >
-int POctree< Degree , OutputDensity >::SetMatrixRow( const typename TreeOctNode::Neighbors5& neighbors5 , Pointer( MatrixEntry< MatrixReal > ) row , int offset , const double stencil[5][5][5] , int xStart , int xEnd , int yStart , int yEnd , int zStart , int zEnd ) const
+int POctree< Degree , OutputDensity >::SetMatrixRow( const typename TreeOctNode::Neighbors5& neighbors5 , Pointer( MatrixEntry< MatrixReal > ) row , int offset , const double stencil[5][5][5] , int xStart , int xEnd , int yStart , int yEnd , int zStart , int zEnd , bool fullRow , bool supported ) const
 {
 	bool hasYZPoints[3] , hasZPoints[3][3];
 	Real diagonal = 0;
@@ -1752,22 +2261,37 @@ int POctree< Degree , OutputDensity >::SetMatrixRow( const typename TreeOctNode:
 				}
 	}
 	int minX , maxX , minY , maxY;
-	for( int x=xStart ; x<=2 ; x++ )
+	for( int x=xStart ; x<( fullRow ? xEnd : 3 ) ; x++ )
 	{
 		minX = std::max< int >( 0 , -2+x ) , maxX = std::min< int >( 2 , -2+x+2 );
 		int dX = 2-x+3*0;
 		for( int y=yStart ; y<yEnd ; y++ )
 		{
-			if( x==2 && y>2 ) continue;
+			if( !fullRow && x==2 && y>2 ) continue;
 			minY = std::max< int >( 0 , -2+y ) , maxY = std::min< int >( 2 , -2+y+2 );
 			int dY = 2-y+3*1;
 			for( int z=zStart ; z<zEnd ; z++ )
 			{
-				if( x==2 && y==2 && z>2 ) continue;
+				if( !fullRow && x==2 && y==2 && z>2 ) continue;
 				int dZ = 2-z+3*2;
 				if( neighbors5.neighbors[x][y][z] && neighbors5.neighbors[x][y][z]->nodeData.nodeIndex>=0 )
 				{
 					const TreeOctNode* _node = neighbors5.neighbors[x][y][z];
+					if( fullRow )
+					{
+						// The half rows keep a pair in the row of the later node, and a row that isn't supported
+						// only holds its unit diagonal, so such a pair only exists if the later node is supported.
+						// (That diagonal isn't halved, so the symmetric product counts it twice.)
+						bool inThisRow = x<2 || ( x==2 && ( y<2 || ( y==2 && z<2 ) ) );
+						if( x==2 && y==2 && z==2 && !supported )
+						{
+							row[count].N = _node->nodeData.nodeIndex-offset;
+							row[count].Value = Real(2);
+							count++;
+							continue;
+						}
+						if( inThisRow ? !supported : ( _boundaryType==0 && !_IsInsetSupported( _node ) ) ) continue;
+					}
 					Real temp;
 					if( isInterior ) temp = Real( stencil[x][y][z] );
 					else             temp = GetLaplacian( node , _node );
@@ -1779,7 +2303,7 @@ int POctree< Degree , OutputDensity >::SetMatrixRow( const typename TreeOctNode:
 							temp += pointValues[x][y][z];
 						}
 					}
-					if( x==2 && y==2 && z==2 ) temp /= 2;
+					if( x==2 && y==2 && z==2 && !fullRow ) temp /= 2;
 					if( fabs(temp)>MATRIX_ENTRY_EPSILON )
 					{
 						row[count].N = _node->nodeData.nodeIndex-offset;
@@ -2378,52 +2902,108 @@ Real POctree< Degree , OutputDensity >::WeightedCoarserFunctionValue( const type
 	return Real( pointValue * weight );
 }
 template< int Degree , bool OutputDensity >
-int POctree< Degree , OutputDensity >::GetFixedDepthLaplacian( SparseSymmetricMatrix< Real >& matrix , int depth , const SortedTreeNodes< OutputDensity >& sNodes , Real* metSolution )
+int POctree< Degree , OutputDensity >::GetFixedDepthLaplacian( StencilSymmetricMatrix< Real >& matrix , int depth , const SortedTreeNodes< OutputDensity >& sNodes , Real* metSolution )
 {
 	int start = sNodes.nodeCount[depth] , end = sNodes.nodeCount[depth+1] , range = end-start;
 	double stencil[5][5][5];
 	SetLaplacianStencil( depth , stencil );
 	Stencil< double , 5 > stencils[2][2][2];
 	SetLaplacianStencils( depth , stencils );
-	matrix.Resize( range );
+
+	// The nodes of a depth are sorted by parent, with the eight siblings next to each other
+	int siblings = depth ? 8 : 1 , blocks = range / siblings;
+	matrix.rows = range , matrix.threads = threads;
+	matrix.setStencil( stencil );
+	matrix.blockNeighbors.resize( 27*blocks );
+	matrix.blockStencils.resize( blocks );
+	std::vector< std::vector< int > > rows( threads ) , sizes( threads );
+	std::vector< std::vector< MatrixEntry< Real > > > entries( threads );
 #pragma omp parallel for num_threads( threads )
 	for( int t=0 ; t<threads ; t++ )
 	{
 		typename TreeOctNode::NeighborKey5 neighborKey5;
 		neighborKey5.set( depth );
-		for( int i=(range*t)/threads ; i<(range*(t+1))/threads ; i++ )
+		for( int b=(blocks*t)/threads ; b<(blocks*(t+1))/threads ; b++ )
 		{
-			TreeOctNode* node = sNodes.treeNodes[i+start];
-			neighborKey5.getNeighbors( node );
-			// Get the matrix row size
-			bool insetSupported = _boundaryType!=0 || _IsInsetSupported( node );
-			int count = insetSupported ? GetMatrixRowSize( neighborKey5.neighbors[depth] ) : 1;
-
-			// Allocate memory for the row
-#pragma omp critical (matrix_set_row_size)
+			unsigned char mask = 0;
+			for( int c=0 ; c<siblings ; c++ )
 			{
-				matrix.SetRowSize( i , count );
-			}
+				int i = b*siblings + c;
+				TreeOctNode* node = sNodes.treeNodes[i+start];
+				neighborKey5.getNeighbors( node );
+				const typename TreeOctNode::Neighbors5& neighbors5 = neighborKey5.neighbors[depth];
+				if( depth && !c )
+				{
+					const typename TreeOctNode::Neighbors5& pNeighbors5 = neighborKey5.neighbors[depth-1];
+					for( int x=0 ; x<3 ; x++ ) for( int y=0 ; y<3 ; y++ ) for( int z=0 ; z<3 ; z++ )
+					{
+						const TreeOctNode* pNode = pNeighbors5.neighbors[x+1][y+1][z+1];
+						matrix.blockNeighbors[27*b+9*x+3*y+z] = ( pNode && pNode->children ) ? pNode->children[0].nodeData.nodeIndex-start : -1;
+					}
+				}
 
-			// Set the row entries
-			if( insetSupported ) matrix.rowSizes[i] = SetMatrixRow( neighborKey5.neighbors[depth] , matrix[i] , start , stencil );
-			else
-			{
-				matrix[i][0] = MatrixEntry< Real >( i , Real(1) );
-				matrix.rowSizes[i] = 1;
-			}
+				bool insetSupported = _boundaryType!=0 || _IsInsetSupported( node );
+				// Rows away from the boundary are the Laplacian stencil, unless points constrain the values around them
+				int d , off[3];
+				node->depthAndOffset( d , off );
+				int o = _boundaryType==0 ? ( 1<<(d-2) ) : 0;
+				int mn = 2+o , mx = (1<<d)-2-o;
+				bool useStencil = depth && insetSupported && off[0]>=mn && off[0]<mx && off[1]>=mn && off[1]<mx && off[2]>=mn && off[2]<mx;
+				if( useStencil && _constrainValues )
+					for( int x=1 ; x<4 ; x++ ) for( int y=1 ; y<4 ; y++ ) for( int z=1 ; z<4 ; z++ )
+						if( neighbors5.neighbors[x][y][z] && neighbors5.neighbors[x][y][z]->nodeData.pointIndex!=-1 ) useStencil = false;
+				if( useStencil ) mask |= 1<<c;
+				else
+				{
+					std::vector< MatrixEntry< Real > >& _entries = entries[t];
+					size_t size = _entries.size();
+					_entries.resize( size + 125 );
+					int count = SetMatrixRow( neighbors5 , &_entries[size] , start , stencil , 0 , 5 , 0 , 5 , 0 , 5 , true , insetSupported );
+					_entries.resize( size + count );
+					rows[t].push_back( i ) , sizes[t].push_back( count );
+				}
 
-			// Offset the constraints using the solution from lower resolutions.
-			int x , y , z , c;
-			if( node->parent )
-			{
-				c = int( node - node->parent->children );
-				Cube::FactorCornerIndex( c , x , y , z );
+				// Offset the constraints using the solution from lower resolutions.
+				int x , y , z;
+				if( node->parent ) Cube::FactorCornerIndex( int( node - node->parent->children ) , x , y , z );
+				else x = y = z = 0;
+				if( insetSupported ) UpdateConstraintsFromCoarser( neighborKey5 , node , metSolution , stencils[x][y][z] );
 			}
-			else x = y = z = 0;
-			if( insetSupported ) UpdateConstraintsFromCoarser( neighborKey5 , node , metSolution , stencils[x][y][z] );
+			matrix.blockStencils[b] = mask;
 		}
 	}
+
+	// Color the blocks by the parity of their parent's offset
+	matrix.colorStarts.assign( 9 , 0 );
+	matrix.coloredBlocks.resize( blocks );
+	std::vector< unsigned char > colors( blocks , 0 );
+	for( int b=0 ; b<blocks ; b++ )
+	{
+		const TreeOctNode* parent = sNodes.treeNodes[ start + b*siblings ]->parent;
+		if( parent )
+		{
+			int d , off[3];
+			parent->depthAndOffset( d , off );
+			colors[b] = ( off[0]&1 ) | ( (off[1]&1)<<1 ) | ( (off[2]&1)<<2 );
+		}
+		matrix.colorStarts[ colors[b]+1 ]++;
+	}
+	for( int c=0 ; c<8 ; c++ ) matrix.colorStarts[c+1] += matrix.colorStarts[c];
+	std::vector< int > colorCounts( matrix.colorStarts.begin() , matrix.colorStarts.end()-1 );
+	for( int b=0 ; b<blocks ; b++ ) matrix.coloredBlocks[ colorCounts[ colors[b] ]++ ] = b;
+
+	// Concatenate the explicit rows of the threads
+	size_t explicitCount = 0 , entryCount = 0;
+	for( int t=0 ; t<threads ; t++ ) explicitCount += rows[t].size() , entryCount += entries[t].size();
+	matrix.explicitRows.resize( 0 ) , matrix.explicitRows.reserve( explicitCount );
+	matrix.explicitStarts.resize( 1 , 0 ) , matrix.explicitStarts.reserve( explicitCount+1 );
+	matrix.explicitEntries.resize( 0 ) , matrix.explicitEntries.reserve( entryCount );
+	for( int t=0 ; t<threads ; t++ )
+	{
+		for( size_t i=0 ; i<rows[t].size() ; i++ ) matrix.explicitRows.push_back( rows[t][i] ) , matrix.explicitStarts.push_back( matrix.explicitStarts.back() + sizes[t][i] );
+		matrix.explicitEntries.insert( matrix.explicitEntries.end() , entries[t].begin() , entries[t].end() );
+		std::vector< MatrixEntry< Real > >().swap( entries[t] );
+	}
 	return 1;
 }
 template< int Degree , bool OutputDensity >
@@ -2494,10 +3074,11 @@ template< int Degree , bool OutputDensity >
 int POctree< Degree , OutputDensity >::LaplacianMatrixIteration( int subdivideDepth , bool showResidual , int minIters , double accuracy , int maxSolveDepth , int fixedIters )
 {
 	int iter=0;
-	fData.setDotTables( fData.DD_DOT_FLAG | fData.DV_DOT_FLAG , _boundaryType==0 );
+	_setDotTables( fData.DD_DOT_FLAG | fData.DV_DOT_FLAG );
 	if( _boundaryType==0 ) subdivideDepth++ , maxSolveDepth++;
 
 	_sNodes.treeNodes[0]->nodeData.solution = 0;
+	solverTrace.clear();
 
 	std::vector< Real > metSolution( _sNodes.nodeCount[ _sNodes.maxDepth ] , 0 );
 	for( int d=(_boundaryType==0?2:0) ; d<_sNodes.maxDepth ; d++ )
@@ -2506,7 +3087,7 @@ int POctree< Degree , OutputDensity >::LaplacianMatrixIteration( int subdivideDe
 		if( subdivideDepth>0 ) iter += _SolveFixedDepthMatrix( d , _sNodes , &metSolution[0] , subdivideDepth , showResidual , minIters , accuracy , d>maxSolveDepth , fixedIters );
 		else                   iter += _SolveFixedDepthMatrix( d , _sNodes , &metSolution[0] ,                  showResidual , minIters , accuracy , d>maxSolveDepth , fixedIters );
 	}
-	fData.clearDotTables( fData.VV_DOT_FLAG | fData.DV_DOT_FLAG | fData.DD_DOT_FLAG );
+	_clearDotTables( fData.VV_DOT_FLAG | fData.DV_DOT_FLAG | fData.DD_DOT_FLAG );
 
 	return iter;
 }
@@ -2517,7 +3098,7 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 	maxMemoryUsage = 0;
 	int iter = 0;
 	Vector< Real > X , B;
-	SparseSymmetricMatrix< Real > M;
+	StencilSymmetricMatrix< Real > M;
 	double systemTime=0. , solveTime=0. , updateTime=0. ,  evaluateTime = 0.;
 	X.Resize( sNodes.nodeCount[depth+1]-sNodes.nodeCount[depth] );
 	if( depth<=_minDepth ) UpSampleCoarserSolution( depth , sNodes , X );
@@ -2537,6 +3118,11 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 		//evaluateTime = Time(NULL) - evaluateTime;
 	}
 
+	// Start from the coefficients of the previous reconstruction, see SetInitialSolution
+	if( _warmStart && depth>_minDepth )
+#pragma omp parallel for num_threads( threads )
+		for( int i=sNodes.nodeCount[depth] ; i<sNodes.nodeCount[depth+1] ; i++ ) X[i-sNodes.nodeCount[depth]] = sNodes.treeNodes[i]->nodeData.solution;
+
 	//systemTime = Time(NULL);
 	{
 		// Get the system matrix
@@ -2555,20 +3141,21 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 	Real _accuracy = Real( accuracy / 100000 ) * M.rows;
 	int res = 1<<depth;
 
-	MapReduceVector< Real > mrVector;
-	mrVector.resize( threads , M.rows );
 
 	if( _boundaryType==0 && depth>3 ) res -= 1<<(depth-2);
 	if( !noSolve )
-		if( fixedIters>=0 ) iter += SparseSymmetricMatrix< Real >::Solve( M , B , fixedIters                                                           , X , mrVector , Real(1e-10) , 0 , M.rows==res*res*res && !_constrainValues && _boundaryType!=-1 );
-		else                iter += SparseSymmetricMatrix< Real >::Solve( M , B , std::max< int >( int( pow( M.rows , ITERATION_POWER ) ) , minIters ) , X , mrVector ,_accuracy    , 0 , M.rows==res*res*res && !_constrainValues && _boundaryType!=-1 );
+		if( fixedIters>=0 ) iter += StencilSymmetricMatrix< Real >::Solve( M , B , fixedIters                                                           , X , Real(1e-10) , 0 , M.rows==res*res*res && !_constrainValues && _boundaryType!=-1 , false      , preconditioner );
+		else                iter += StencilSymmetricMatrix< Real >::Solve( M , B , std::max< int >( int( pow( M.rows , ITERATION_POWER ) ) , minIters ) , X , _accuracy    , 0 , M.rows==res*res*res && !_constrainValues && _boundaryType!=-1 , _warmStart , preconditioner );
 	//solveTime = Time(NULL)-solveTime;
 	if( showResidual )
 	{
-		double mNorm = 0;
-		for( int i=0 ; i<M.rows ; i++ ) for( int j=0 ; j<M.rowSizes[i] ; j++ ) mNorm += M[i][j].Value * M[i][j].Value;
-		double bNorm = B.Norm( 2 ) , rNorm = ( B - M * X ).Norm( 2 );
-		DumpOutput( "\tResidual: (%d %g) %g -> %g (%f) [%d]\n" , M.Entries() , sqrt(mNorm) , bNorm , rNorm , rNorm/bNorm , iter );
+		Vector< Real > MX( M.rows );
+		M.Multiply( X , MX );
+		double bNorm = B.Norm( 2 ) , rNorm = ( B - MX ).Norm( 2 );
+		DumpOutput( "\tResidual: (%d/%d %d) %g -> %g (%f) [%d]\n" , M.stencilRows() , M.rows , M.entries() , bNorm , rNorm , rNorm/bNorm , iter );
+		SolverTrace trace;
+		trace.depth = _boundaryType==0 ? depth-1 : depth , trace.rows = M.rows , trace.iters = iter , trace.bNorm = bNorm , trace.rNorm = rNorm;
+		solverTrace.push_back( trace );
 	}
 
 	// Copy the solution back into the tree (over-writing the constraints)
@@ -2645,6 +3232,8 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 	asf.adjacencies = new int[maxDimension];
 	MapReduceVector< Real > mrVector;
 	mrVector.resize( threads , maxDimension );
+	SolverTrace trace;
+	trace.depth = _boundaryType==0 ? depth-1 : depth , trace.rows = trace.iters = 0 , trace.bNorm = trace.rNorm = 0;
 	// Iterate through the coarse-level nodes
 	for( i=sNodes.nodeCount[d] ; i<sNodes.nodeCount[d+1] ; i++ )
 	{
@@ -2689,8 +3278,12 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 		//sTime=Time(NULL);
 		Real _accuracy = Real( accuracy / 100000 ) * _M.rows;
 		if( !noSolve )
-			if( fixedIters>=0 ) iter += SparseSymmetricMatrix< Real >::Solve( _M , _B , fixedIters                                                            , _X , mrVector ,  Real(1e-10) , 0 );
-			else                iter += SparseSymmetricMatrix< Real >::Solve( _M , _B , std::max< int >( int( pow( _M.rows , ITERATION_POWER ) ) , minIters ) , _X , mrVector , _accuracy    , 0 );
+			if( preconditioner!=PRECONDITIONER_NONE )
+				if( fixedIters>=0 ) iter += SparseSymmetricMatrix< Real >::SolvePreconditioned( _M , _B , fixedIters                                                            , _X , preconditioner , threads , Real(1e-10) , 0 );
+				else                iter += SparseSymmetricMatrix< Real >::SolvePreconditioned( _M , _B , std::max< int >( int( pow( _M.rows , ITERATION_POWER ) ) , minIters ) , _X , preconditioner , threads , _accuracy    , 0 , false , _warmStart );
+			else
+				if( fixedIters>=0 ) iter += SparseSymmetricMatrix< Real >::Solve( _M , _B , fixedIters                                                            , _X , mrVector ,  Real(1e-10) , 0 );
+				else                iter += SparseSymmetricMatrix< Real >::Solve( _M , _B , std::max< int >( int( pow( _M.rows , ITERATION_POWER ) ) , minIters ) , _X , mrVector , _accuracy    , 0 , false , false , _warmStart );
 		//sTime=Time(NULL)-sTime;
 
 		if( showResidual )
@@ -2699,6 +3292,7 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 			for( int i=0 ; i<_M.rows ; i++ ) for( int j=0 ; j<_M.rowSizes[i] ; j++ ) mNorm += _M[i][j].Value * _M[i][j].Value;
 			double bNorm = _B.Norm( 2 ) , rNorm = ( _B - _M * _X ).Norm( 2 );
 			DumpOutput( "\t\tResidual: (%d %g) %g -> %g (%f) [%d]\n" , _M.Entries() , sqrt(mNorm) , bNorm , rNorm , rNorm/bNorm , iter );
+			trace.rows += _M.rows , trace.iters += iter , trace.bNorm += bNorm * bNorm , trace.rNorm += rNorm * rNorm;
 		}
 
 		// Update the solution for all nodes in the sub-tree
@@ -2715,6 +3309,12 @@ int POctree< Degree , OutputDensity >::_SolveFixedDepthMatrix( int depth , const
 		tIter += iter;
 	}
 	delete[] asf.adjacencies;
+	if( showResidual )
+	{
+		// The blocks overlap, so rows (and the norms) count the shared nodes more than once
+		trace.bNorm = sqrt( trace.bNorm ) , trace.rNorm = sqrt( trace.rNorm );
+		solverTrace.push_back( trace );
+	}
 	//MemoryUsage();
 	DumpOutput("\tEvaluated / Got / Solved in: %6.3f / %6.3f / %6.3f\t(%.3f MB)\n" , evaluateTime , systemTime , solveTime , float( maxMemoryUsage ) );
 	maxMemoryUsage = std::max< double >( maxMemoryUsage , _maxMemoryUsage );
@@ -2750,7 +3350,7 @@ void POctree< Degree , OutputDensity >::SetLaplacianConstraints( void )
 	// divergence of the normal field with all the basis functions.
 	// Within the same depth: set directly as a gather
 	// Coarser depths 
-	fData.setDotTables( fData.VV_DOT_FLAG | fData.DV_DOT_FLAG , _boundaryType==0 );
+	_setDotTables( fData.VV_DOT_FLAG | fData.DV_DOT_FLAG );
 	int maxDepth = _sNodes.maxDepth-1;
 	Point3D< Real > zeroPoint;
 	zeroPoint[0] = zeroPoint[1] = zeroPoint[2] = 0;
@@ -2944,7 +3544,7 @@ void POctree< Degree , OutputDensity >::SetLaplacianConstraints( void )
 		}
 	}
 
-	fData.clearDotTables( fData.DV_DOT_FLAG );
+	_clearDotTables( fData.DV_DOT_FLAG );
 
 	// Set the point weights for evaluating the iso-value
 #pragma omp parallel for num_threads( threads )
@@ -3081,7 +3681,7 @@ template< int Degree , bool OutputDensity >
 template< class Vertex >
 void POctree< Degree , OutputDensity >::GetMCIsoTriangles( Real isoValue , int subdivideDepth , CoredMeshData< Vertex >* mesh , int fullDepthIso , int nonLinearFit , bool addBarycenter , bool polygonMesh )
 {
-	fData.setValueTables( fData.VALUE_FLAG | fData.D_VALUE_FLAG , 0 , postDerivativeSmooth );
+	if( !_cache || !fData.valueTables || !fData.dValueTables ) fData.setValueTables( fData.VALUE_FLAG | fData.D_VALUE_FLAG , 0 , postDerivativeSmooth );
 	// Ensure that the subtrees are self-contained
 	int sDepth = refineBoundary( subdivideDepth );
 
@@ -3424,7 +4024,7 @@ Real POctree< Degree , OutputDensity >::GetIsoValue( void )
 {
 	Real isoValue , weightSum;
 
-	fData.setValueTables( fData.VALUE_FLAG , 0 );
+	if( !_cache || !fData.valueTables ) fData.setValueTables( fData.VALUE_FLAG , 0 );
 
 	isoValue = weightSum = 0;
 #pragma omp parallel for num_threads( threads ) reduction( + : isoValue , weightSum )
@@ -4418,58 +5018,324 @@ Pointer( Real ) POctree< Degree , OutputDensity >::GetSolutionGrid( int& res , R
 {
 	int maxDepth = _boundaryType==0 ? tree.maxDepth()-1 : tree.maxDepth();
 	if( depth<=0 || depth>maxDepth ) depth = maxDepth;
-	BSplineData< Degree , Real > fData;
-	fData.set( _boundaryType==0 ? depth+1 : depth , true , _boundaryType );
+	// At the depth of the tree the functions are those of the tree, whose value tables GetIsoValue has already set
+	int nodeDepth = _boundaryType==0 ? depth+1 : depth;
+	bool treeFunctions = this->fData.depth==nodeDepth && this->fData.valueTables;
+	BSplineData< Degree , Real > gridData;
+	if( !treeFunctions )
+	{
+		gridData.set( nodeDepth , true , _boundaryType );
+		gridData.setValueTables( gridData.VALUE_FLAG );
+	}
+	const BSplineData< Degree , Real >& fData = treeFunctions ? this->fData : gridData;
 	res = 1<<depth;
-	fData.setValueTables( fData.VALUE_FLAG );
 	Pointer( Real ) values = NewPointer< Real >( res * res * res );
 	memset( values , 0 , sizeof( Real ) * res  * res * res );
 
+	// The grid is written slab by slab (in z), each slab by a single thread. Every slab gets the list of nodes
+	// whose support overlaps it in tree order, so the contributions to a value are summed in the same order
+	// as a serial traversal.
+	struct NodeSpan
+	{
+		Real coefficient;
+		int idx[3] , start[3] , end[3];
+	};
+	const int SlabSize = 4;
+	int slabs = ( res + SlabSize - 1 ) / SlabSize , offset = _boundaryType==0 ? res/2 : 0;
+	std::vector< NodeSpan > spans;
+	std::vector< std::vector< int > > slabSpans( slabs );
 	for( TreeOctNode* n=tree.nextNode() ; n ; n=tree.nextNode( n ) )
 	{
 		if( n->d>(_boundaryType==0?depth+1:depth) ) continue;
 		if( n->d<_minDepth ) continue;
-		int d , idx[3] , start[3] , end[3];
-		n->depthAndOffset( d , idx );
+		int d , off[3];
+		NodeSpan span;
+		n->depthAndOffset( d , off );
 		bool skip=false;
 		for( int i=0 ; i<3 ; i++ )
 		{
 			// Get the index of the functions
-			idx[i] = BinaryNode< double >::CenterIndex( d , idx[i] );
+			span.idx[i] = BinaryNode< double >::CenterIndex( d , off[i] );
 			// Figure out which samples fall into the range
-			fData.setSampleSpan( idx[i] , start[i] , end[i] );
+			fData.setSampleSpan( span.idx[i] , span.start[i] , span.end[i] );
 			// We only care about the odd indices
-			if( !(start[i]&1) ) start[i]++;
-			if( !(  end[i]&1) )   end[i]--;
+			if( !(span.start[i]&1) ) span.start[i]++;
+			if( !(  span.end[i]&1) )   span.end[i]--;
 			if( _boundaryType==0 )
 			{
 				// (start[i]-1)>>1 >=   res/2 
 				// (  end[i]-1)<<1 <  3*res/2
-				start[i] = std::max< int >( start[i] ,   res+1 );
-				end  [i] = std::min< int >( end  [i] , 3*res-1 );
+				span.start[i] = std::max< int >( span.start[i] ,   res+1 );
+				span.end  [i] = std::min< int >( span.end  [i] , 3*res-1 );
 			}
+			if( span.start[i]>span.end[i] ) skip = true;
 		}
 		if( skip ) continue;
-		Real coefficient = n->nodeData.solution;
-		for( int x=start[0] ; x<=end[0] ; x+=2 )
-			for( int y=start[1] ; y<=end[1] ; y+=2 )
-				for( int z=start[2] ; z<=end[2] ; z+=2 )
+		span.coefficient = n->nodeData.solution;
+		int s0 = ( ( (span.start[2]-1)>>1 ) - offset ) / SlabSize , s1 = ( ( (span.end[2]-1)>>1 ) - offset ) / SlabSize;
+		for( int s=s0 ; s<=s1 ; s++ ) slabSpans[s].push_back( int( spans.size() ) );
+		spans.push_back( span );
+	}
+
+#pragma omp parallel for num_threads( threads ) schedule( dynamic )
+	for( int s=0 ; s<slabs ; s++ )
+	{
+		// The odd samples whose values land in this slab
+		int zStart = 2*( s*SlabSize + offset ) + 1 , zEnd = 2*( std::min< int >( res , (s+1)*SlabSize ) - 1 + offset ) + 1;
+		for( size_t i=0 ; i<slabSpans[s].size() ; i++ )
+		{
+			const NodeSpan& span = spans[ slabSpans[s][i] ];
+			int z0 = std::max< int >( span.start[2] , zStart ) , z1 = std::min< int >( span.end[2] , zEnd );
+			for( int z=z0 ; z<=z1 ; z+=2 )
+			{
+				Real zValue = span.coefficient * fData.valueTables[ span.idx[2]+z*fData.functionCount ];
+				int zz = ( (z-1)>>1 ) - offset;
+				for( int y=span.start[1] ; y<=span.end[1] ; y+=2 )
 				{
-					int xx = (x-1)>>1 , yy=(y-1)>>1 , zz = (z-1)>>1;
-					if( _boundaryType==0 ) xx -= res/2 , yy -= res/2 , zz -= res/2;
-					values[ zz*res*res + yy*res + xx ] +=
-						coefficient *
-						fData.valueTables[ idx[0]+x*fData.functionCount ] *
-						fData.valueTables[ idx[1]+y*fData.functionCount ] *
-						fData.valueTables[ idx[2]+z*fData.functionCount ];
+					Real yzValue = zValue * fData.valueTables[ span.idx[1]+y*fData.functionCount ];
+					int yy = ( (y-1)>>1 ) - offset;
+					Real* row = values + zz*res*res + yy*res;
+					for( int x=span.start[0] ; x<=span.end[0] ; x+=2 ) row[ ( (x-1)>>1 ) - offset ] += yzValue * fData.valueTables[ span.idx[0]+x*fData.functionCount ];
 				}
+			}
+		}
 	}
-	if( _boundaryType==-1 ) for( int i=0 ; i<res*res*res ; i++ ) values[i] -= Real(0.5);
-	for( int i=0 ; i<res*res*res ; i++ ) values[i] -= isoValue;
+	Real shift = isoValue + ( _boundaryType==-1 ? Real(0.5) : Real(0) );
+#pragma omp parallel for num_threads( threads )
+	for( int i=0 ; i<res*res*res ; i++ ) values[i] -= shift;
 
 	return values;
 }
+template< int Degree , bool OutputDensity >
+void POctree< Degree , OutputDensity >::GetSolutionBand( const std::vector< Point3D< Real > >& points , Real radius , int& res , std::vector< int >& cells , std::vector< Real >& values , Real isoValue , int depth ) const
+{
+	int maxDepth = _boundaryType==0 ? tree.maxDepth()-1 : tree.maxDepth();
+	if( depth<=0 || depth>maxDepth ) depth = maxDepth;
+	res = 1<<depth;
+	// With Neumann boundaries the grid only covers the middle half of the cube
+	Real start = _boundaryType==0 ? Real(0.25) : Real(0) , width = _boundaryType==0 ? Real(0.5) : Real(1);
+	Real cellSize = width / res , r = radius / _scale;
+
+	cells.clear();
+	for( size_t i=0 ; i<points.size() ; i++ )
+	{
+		Point3D< Real > p = ( points[i] - _center ) / _scale;
+		int lo[3] , hi[3];
+		for( int c=0 ; c<3 ; c++ )
+		{
+			lo[c] = std::max< int >( 0     , int( ceil ( ( p[c]-r-start ) / cellSize - Real(0.5) ) ) );
+			hi[c] = std::min< int >( res-1 , int( floor( ( p[c]+r-start ) / cellSize - Real(0.5) ) ) );
+		}
+		for( int z=lo[2] ; z<=hi[2] ; z++ ) for( int y=lo[1] ; y<=hi[1] ; y++ ) for( int x=lo[0] ; x<=hi[0] ; x++ )
+		{
+			Real dx = start + ( x+Real(0.5) )*cellSize - p[0] , dy = start + ( y+Real(0.5) )*cellSize - p[1] , dz = start + ( z+Real(0.5) )*cellSize - p[2];
+			if( dx*dx + dy*dy + dz*dz<=r*r ) cells.push_back( z*res*res + y*res + x );
+		}
+	}
+
+	// Every brick with a cell in the band is evaluated whole, so all of its cells are returned
+	const int BrickSize = 8;
+	int bricks = ( res + BrickSize - 1 ) / BrickSize , offset = _boundaryType==0 ? res/2 : 0 , nodeDepth = _boundaryType==0 ? depth+1 : depth;
+	for( size_t i=0 ; i<cells.size() ; i++ )
+	{
+		int x = cells[i] % res , y = ( cells[i] / res ) % res , z = cells[i] / ( res*res );
+		cells[i] = ( (z/BrickSize)*bricks + y/BrickSize )*bricks + x/BrickSize;
+	}
+	std::sort( cells.begin() , cells.end() );
+	cells.erase( std::unique( cells.begin() , cells.end() ) , cells.end() );
+	std::vector< int > touched;
+	touched.swap( cells );
+	for( size_t b=0 ; b<touched.size() ; b++ )
+	{
+		int lo[] = { ( touched[b] % bricks )*BrickSize , ( ( touched[b] / bricks ) % bricks )*BrickSize , ( touched[b] / ( bricks*bricks ) )*BrickSize };
+		for( int z=lo[2] ; z<std::min< int >( res , lo[2]+BrickSize ) ; z++ ) for( int y=lo[1] ; y<std::min< int >( res , lo[1]+BrickSize ) ; y++ )
+			for( int x=lo[0] ; x<std::min< int >( res , lo[0]+BrickSize ) ; x++ ) cells.push_back( z*res*res + y*res + x );
+	}
+	std::sort( cells.begin() , cells.end() );
 
+	// Evaluate brick by brick the way GetSolutionGrid does, each brick by one thread. The nodes overlapping a brick are
+	// found by walking the tree and skipping the subtrees whose support misses it (the support of a child lies in that
+	// of its parent), so the values come out the same as those of the full grid
+	std::vector< std::pair< int , int > > brickCells( cells.size() );
+	for( size_t i=0 ; i<cells.size() ; i++ )
+	{
+		int x = cells[i] % res , y = ( cells[i] / res ) % res , z = cells[i] / ( res*res );
+		brickCells[i] = std::pair< int , int >( ( (z/BrickSize)*bricks + y/BrickSize )*bricks + x/BrickSize , int(i) );
+	}
+	std::sort( brickCells.begin() , brickCells.end() );
+	std::vector< int > brickStart;
+	for( size_t i=0 ; i<brickCells.size() ; i++ ) if( !i || brickCells[i].first!=brickCells[i-1].first ) brickStart.push_back( int(i) );
+	brickStart.push_back( int( brickCells.size() ) );
+
+	BSplineData< Degree , Real > sampleData;
+	sampleData.set( nodeDepth , true , _boundaryType );
+	sampleData.setValueTables( sampleData.VALUE_FLAG );
+	Real shift = isoValue + ( _boundaryType==-1 ? Real(0.5) : Real(0) );
+	values.resize( cells.size() );
+#pragma omp parallel for num_threads( threads ) schedule( dynamic )
+	for( int b=0 ; b<int(brickStart.size())-1 ; b++ )
+	{
+		int brick = brickCells[ brickStart[b] ].first;
+		int lo[] = { ( brick % bricks )*BrickSize , ( ( brick / bricks ) % bricks )*BrickSize , ( brick / ( bricks*bricks ) )*BrickSize };
+		int sStart[3] , sEnd[3];
+		for( int c=0 ; c<3 ; c++ ) sStart[c] = 2*( lo[c]+offset )+1 , sEnd[c] = 2*( std::min< int >( res , lo[c]+BrickSize ) - 1 + offset )+1;
+		Real brickValues[ BrickSize*BrickSize*BrickSize ];
+		memset( brickValues , 0 , sizeof( brickValues ) );
+
+		for( const TreeOctNode* n=tree.nextNode() ; n ; )
+		{
+			int d , off[3] , idx[3] , start[3] , end[3];
+			n->depthAndOffset( d , off );
+			bool overlaps = true;
+			for( int c=0 ; c<3 ; c++ )
+			{
+				idx[c] = BinaryNode< double >::CenterIndex( d , off[c] );
+				sampleData.setSampleSpan( idx[c] , start[c] , end[c] );
+				if( !(start[c]&1) ) start[c]++;
+				if( !(  end[c]&1) )   end[c]--;
+				start[c] = std::max< int >( start[c] , sStart[c] ) , end[c] = std::min< int >( end[c] , sEnd[c] );
+				if( start[c]>end[c] ) overlaps = false;
+			}
+			if( !overlaps ){ n = tree.nextBranch( n ) ; continue; }
+			if( d>=_minDepth )
+			{
+				Real coefficient = n->nodeData.solution;
+				for( int z=start[2] ; z<=end[2] ; z+=2 )
+				{
+					Real zValue = coefficient * sampleData.valueTables[ idx[2]+z*sampleData.functionCount ];
+					int zz = ( (z-sStart[2])>>1 );
+					for( int y=start[1] ; y<=end[1] ; y+=2 )
+					{
+						Real yzValue = zValue * sampleData.valueTables[ idx[1]+y*sampleData.functionCount ];
+						Real* row = brickValues + ( zz*BrickSize + ( (y-sStart[1])>>1 ) )*BrickSize;
+						for( int x=start[0] ; x<=end[0] ; x+=2 ) row[ (x-sStart[0])>>1 ] += yzValue * sampleData.valueTables[ idx[0]+x*sampleData.functionCount ];
+					}
+				}
+			}
+			n = d<nodeDepth ? tree.nextNode( n ) : tree.nextBranch( n );
+		}
+		for( int i=brickStart[b] ; i<brickStart[b+1] ; i++ )
+		{
+			int cell = cells[ brickCells[i].second ];
+			int x = cell % res - lo[0] , y = ( cell / res ) % res - lo[1] , z = cell / ( res*res ) - lo[2];
+			values[ brickCells[i].second ] = brickValues[ ( z*BrickSize + y )*BrickSize + x ] - shift;
+		}
+	}
+}
+
+template< int Degree , bool OutputDensity >
+Real POctree< Degree , OutputDensity >::GetIsoPoints( Real isoValue , int sampleCount , std::vector< Point3D< Real > >& points , std::vector< Point3D< Real > >& normals , Real radius )
+{
+	if( !_cache || !fData.valueTables || !fData.dValueTables ) fData.setValueTables( fData.VALUE_FLAG | fData.D_VALUE_FLAG , 0 , postDerivativeSmooth );
+	int maxDepth = tree.maxDepth();
+
+	// The corner values are those GetMCIsoTriangles computes, from the coarser solutions up-sampled to the parents
+	std::vector< Real > metSolution( _sNodes.nodeCount[maxDepth] , 0 );
+#pragma omp parallel for num_threads( threads )
+	for( int i=_sNodes.nodeCount[_minDepth] ; i<_sNodes.nodeCount[maxDepth] ; i++ ) metSolution[i] = _sNodes.treeNodes[i]->nodeData.solution;
+	for( int d=_minDepth ; d<maxDepth ; d++ ) UpSample( d , _sNodes , &metSolution[0] );
+
+	std::vector< const TreeOctNode* > leaves;
+	for( int i=0 ; i<_sNodes.nodeCount[maxDepth+1] ; i++ )
+	{
+		const TreeOctNode* node = _sNodes.treeNodes[i];
+		if( !node->children && ( _boundaryType!=0 || _IsInset( node ) ) ) leaves.push_back( node );
+	}
+	int leafCount = int( leaves.size() );
+
+	// One candidate per leaf the surface passes through, in the unit cube
+	std::vector< Point3D< Real > > leafPoints( leafCount ) , leafNormals( leafCount );
+	std::vector< char > crossed( leafCount , 0 );
+#pragma omp parallel for num_threads( threads )
+	for( int t=0 ; t<threads ; t++ )
+	{
+		typename TreeOctNode::ConstNeighborKey3 nKey3;
+		typename TreeOctNode::ConstNeighborKey5 nKey5;
+		nKey3.set( maxDepth ) , nKey5.set( maxDepth );
+		for( int i=(leafCount*t)/threads ; i<(leafCount*(t+1))/threads ; i++ )
+		{
+			const TreeOctNode* leaf = leaves[i];
+			Real values[ Cube::CORNERS ];
+			int inside = 0;
+			nKey3.getNeighbors( leaf );
+			for( int c=0 ; c<Cube::CORNERS ; c++ )
+			{
+				values[c] = getCornerValue( nKey3 , leaf , c , &metSolution[0] );
+				if( values[c]<isoValue ) inside++;
+			}
+			if( !inside || inside==Cube::CORNERS ) continue;
+
+			Point3D< Real > center , corners[ Cube::CORNERS ] , cornerNormals[ Cube::CORNERS ];
+			bool normalSet[ Cube::CORNERS ];
+			Real width;
+			leaf->centerAndWidth( center , width );
+			nKey5.getNeighbors( leaf );
+			for( int c=0 ; c<Cube::CORNERS ; c++ )
+			{
+				int x[3];
+				Cube::FactorCornerIndex( c , x[0] , x[1] , x[2] );
+				for( int dd=0 ; dd<3 ; dd++ ) corners[c][dd] = center[dd] + ( x[dd] ? width : -width )/2;
+				normalSet[c] = false;
+			}
+			Point3D< Real > p , n;
+			int crossings = 0;
+			for( int e=0 ; e<Cube::EDGES ; e++ )
+			{
+				int c1 , c2;
+				Cube::EdgeCorners( e , c1 , c2 );
+				if( ( values[c1]<isoValue )==( values[c2]<isoValue ) ) continue;
+				if( !normalSet[c1] ) cornerNormals[c1] = getCornerNormal( nKey5 , leaf , c1 , &metSolution[0] ) , normalSet[c1] = true;
+				if( !normalSet[c2] ) cornerNormals[c2] = getCornerNormal( nKey5 , leaf , c2 , &metSolution[0] ) , normalSet[c2] = true;
+				Real s = ( isoValue-values[c1] ) / ( values[c2]-values[c1] );
+				p += corners[c1] * ( Real(1)-s ) + corners[c2] * s;
+				n += cornerNormals[c1] * ( Real(1)-s ) + cornerNormals[c2] * s;
+				crossings++;
+			}
+			// The field is larger inside, so the outward normal is against the gradient
+			Real len = Real( Length( n ) );
+			leafPoints[i] = p / Real( crossings );
+			leafNormals[i] = len>0 ? n / (-len) : n;
+			crossed[i] = 1;
+		}
+	}
+	// A plane through a cube of width w cuts it in 2/3 w^2 on average, which is what the leaf adds to the area
+	std::vector< int > candidates;
+	double area = 0;
+	candidates.reserve( leafCount );
+	for( int i=0 ; i<leafCount ; i++ ) if( crossed[i] )
+	{
+		Real width = Real(1) / ( 1<<leaves[i]->d );
+		candidates.push_back( i ) , area += 2./3 * width * width;
+	}
+	int candidateCount = int( candidates.size() );
+	points.clear() , normals.clear();
+	if( !candidateCount ) return radius;
+
+	area *= _scale * _scale;
+	if( radius<=0 ) radius = Real( sqrt( area / ( 0.7 * PI * std::max< int >( sampleCount , 1 ) ) ) ); // as vcg's ComputePoissonDiskRadius
+	radius = std::max< Real >( radius , _scale / (1<<20) );
+
+	// Thinned by dart throwing in world space, the candidates of a cell in leaf order
+	std::vector< Point3D< Real > > positions( candidateCount );
+	for( int i=0 ; i<candidateCount ; i++ ) positions[i] = leafPoints[ candidates[i] ] * _scale + _center;
+	DiskThinning< Point3D< Real > > thinning;
+	thinning.set( positions , radius );
+	for( int p=0 ; p<DiskThinning< Point3D< Real > >::PHASES ; p++ )
+	{
+		int cellCount = thinning.phaseSize( p );
+#pragma omp parallel for num_threads( threads )
+		for( int c=0 ; c<cellCount ; c++ ) thinning.thinCells( p , c , c+1 );
+	}
+	std::vector< char > kept;
+	thinning.getKept( kept );
+
+	for( int i=0 ; i<candidateCount ; i++ ) if( kept[i] )
+	{
+		points.push_back( positions[i] );
+		normals.push_back( leafNormals[ candidates[i] ] );
+	}
+	return radius;
+}
 ////////////////
 // VertexData //
 ////////////////
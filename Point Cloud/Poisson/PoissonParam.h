@@ -21,6 +21,7 @@ public:
     FixedIters = -1;
     VoxelDepth = -1;
     Threads = 8;
+    Preconditioner = 0;
 
     NoResetSamples = false;
 		NoClipTree = false;
@@ -48,6 +49,7 @@ public:
   int FixedIters;
   int VoxelDepth;
   int Threads;
+  int Preconditioner; // PRECONDITIONER_NONE (0), _JACOBI (1) or _SYMMETRIC_GAUSS_SEIDEL (2) of SparseMatrix.h
 
   
   float constraintWeight;
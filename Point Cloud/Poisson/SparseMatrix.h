@@ -130,6 +130,15 @@ public:
 
 };
 
+// How the conjugate gradient solves are preconditioned: not at all, by the diagonal, or by a forward and a backward
+// Gauss-Seidel sweep (which takes fewer iterations, but the sweeps are serial)
+enum
+{
+	PRECONDITIONER_NONE ,
+	PRECONDITIONER_JACOBI ,
+	PRECONDITIONER_SYMMETRIC_GAUSS_SEIDEL
+};
+
 template< class T >
 class SparseSymmetricMatrix : public SparseMatrix< T >
 {
@@ -154,7 +163,8 @@ public:
 	static int Solve( const SparseSymmetricMatrix<T>& M , const Vector<T2>& b , int iters , Vector<T2>& solution , T2 eps=1e-8 , int reset=1 , int threads=0  , bool addDCTerm=false , bool solveNormal=false );
 
 	template< class T2 >
-	static int Solve( const SparseSymmetricMatrix<T>& M , const Vector<T2>& b , int iters , Vector<T2>& solution , MapReduceVector<T2>& scratch , T2 eps=1e-8 , int reset=1 , bool addDCTerm=false , bool solveNormal=false );
+	// with residualFromB the iterations stop once |r| <= eps |b| rather than eps |r_0|, so a good initial guess ends the solve early
+	static int Solve( const SparseSymmetricMatrix<T>& M , const Vector<T2>& b , int iters , Vector<T2>& solution , MapReduceVector<T2>& scratch , T2 eps=1e-8 , int reset=1 , bool addDCTerm=false , bool solveNormal=false , bool residualFromB=false );
 #ifdef WIN32
 	template< class T2 >
 	static int SolveAtomic( const SparseSymmetricMatrix<T>& M , const Vector<T2>& b , int iters , Vector<T2>& solution , T2 eps=1e-8 , int reset=1 , int threads=0  , bool solveNormal=false );
@@ -162,10 +172,57 @@ public:
 	template<class T2>
 	static int Solve( const SparseSymmetricMatrix<T>& M , const Vector<T2>& diagonal , const Vector<T2>& b , int iters , Vector<T2>& solution , int reset=1 );
 
+	// The preconditioned solve of StencilSymmetricMatrix, on the half rows expanded into full ones
+	template< class T2 >
+	static int SolvePreconditioned( const SparseSymmetricMatrix<T>& M , const Vector<T2>& b , int iters , Vector<T2>& solution , int preconditioner , int threads , T2 eps=1e-8 , int reset=1 , bool addDCTerm=false , bool residualFromB=false );
+
 	template< class T2 >
 	void getDiagonal( Vector< T2 >& diagonal ) const;
 };
 
+// A symmetric matrix whose rows come in blocks of 2x2x2 cells (the children of an octree node) and whose regular rows
+// all apply the same 5x5x5 stencil. The 5x5x5 neighborhoods of a block lie in the 3x3x3 blocks around it, so a block only
+// stores where those start (-1 if missing) and its rows are computed from the 6x6x6 values gathered from them. The
+// remaining rows are stored explicitly and in full, so the product only gathers and needs no scratch per thread.
+template< class T >
+class StencilSymmetricMatrix
+{
+	template< class T2 > void _gather( int block , const T2* in , T2 values[6][6][8] ) const;
+	template< class T2 > T2 _stencilRow( int c , const T2 values[6][6][8] ) const;
+	template< class T2 > void _gaussSeidel( int block , const T2* b , const T2* diagonal , T2* x , bool forward ) const;
+	template< class T2 > void _precondition( int preconditioner , const Vector< T2 >& diagonal , const Vector< T2 >& r , Vector< T2 >& z , Vector< T2 >& temp ) const;
+public:
+	int rows , threads;
+	T stencil[2][5][5][8];							// the 5x5x5 stencil, padded to rows of eight and shifted by the z of the row in its block
+	std::vector< int > blockNeighbors;				// 27 per block, the first row of the neighboring blocks
+	std::vector< unsigned char > blockStencils;		// per block, bit c is set if row c of the block applies the stencil
+	std::vector< int > coloredBlocks , colorStarts;	// the blocks sorted by the parity of their parent's offset, and where the 8 colors start
+	std::vector< int > explicitRows;				// the rows that don't
+	std::vector< int > explicitStarts;				// where their entries start (one more than there are explicit rows)
+	std::vector< MatrixEntry< T > > explicitEntries;
+
+	StencilSymmetricMatrix( void ) { rows = 0 , threads = 1; }
+	void setStencil( const double stencil[5][5][5] );
+	// All the rows explicit, the full rows the half rows of M add up to
+	void setRows( const SparseSymmetricMatrix< T >& M );
+	int stencilRows( void ) const;
+	int entries( void ) const;
+
+	template< class T2 >
+	void Multiply( const Vector<T2>& In , Vector<T2>& Out , bool addDCTerm=false ) const;
+	template< class T2 >
+	void getDiagonal( Vector< T2 >& diagonal ) const;
+	// A Gauss-Seidel sweep over the rows, in increasing order if forward and in decreasing order otherwise.
+	// With blocks the order is by color first, and the blocks of a color are swept in parallel
+	template< class T2 >
+	void gaussSeidel( const Vector< T2 >& diagonal , const Vector< T2 >& b , Vector< T2 >& x , bool forward ) const;
+
+	// The conjugate gradient solve of SparseSymmetricMatrix::Solve (without solveNormal), with the product parallel over the rows.
+	// The iterations still stop on the norm of the residual, whatever the preconditioner
+	template< class T2 >
+	static int Solve( const StencilSymmetricMatrix<T>& M , const Vector<T2>& b , int iters , Vector<T2>& solution , T2 eps=1e-8 , int reset=1 , bool addDCTerm=false , bool residualFromB=false , int preconditioner=PRECONDITIONER_NONE );
+};
+
 #include "SparseMatrix.inl"
 
 #endif
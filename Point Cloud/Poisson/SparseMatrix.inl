@@ -755,7 +755,7 @@ int SparseSymmetricMatrix< T >::SolveAtomic( const SparseSymmetricMatrix< T >& A
 #endif // WIN32
 template< class T >
 template< class T2 >
-int SparseSymmetricMatrix< T >::Solve( const SparseSymmetricMatrix<T>& A , const Vector<T2>& b , int iters , Vector<T2>& x , MapReduceVector< T2 >& scratch , T2 eps , int reset , bool addDCTerm , bool solveNormal )
+int SparseSymmetricMatrix< T >::Solve( const SparseSymmetricMatrix<T>& A , const Vector<T2>& b , int iters , Vector<T2>& x , MapReduceVector< T2 >& scratch , T2 eps , int reset , bool addDCTerm , bool solveNormal , bool residualFromB )
 {
 	int threads = scratch.threads();
 	eps *= eps;
@@ -780,6 +780,12 @@ int SparseSymmetricMatrix< T >::Solve( const SparseSymmetricMatrix<T>& A , const
 		for( int i=0 ; i<dim ; i++ ) _d[i] = _r[i] = _b[i] - _r[i] , delta_new += _r[i] * _r[i];
 	}
 	delta_0 = delta_new;
+	if( residualFromB && !solveNormal )
+	{
+		delta_0 = 0;
+#pragma omp parallel for num_threads( threads ) reduction( + : delta_0 )
+		for( int i=0 ; i<dim ; i++ ) delta_0 += _b[i] * _b[i];
+	}
 	if( delta_new<eps )
 	{
 		fprintf( stderr , "[WARNING] Initial residual too low: %g < %f\n" , delta_new , eps );
@@ -939,4 +945,354 @@ void SparseSymmetricMatrix< T >::getDiagonal( Vector< T2 >& diagonal ) const
 		diagonal[i] = 0.;
 		for( int j=0 ; j<SparseMatrix< T >::rowSizes[i] ; j++ ) if( SparseMatrix< T >::m_ppElements[i][j].N==i ) diagonal[i] += SparseMatrix< T >::m_ppElements[i][j].Value * 2;
 	}
-}
\ No newline at end of file
+}
+///////////////////////////
+// StencilSymmetricMatrix //
+///////////////////////////
+// The product of a full row with a vector, with AVX2 for float rows and vectors when the processor has it
+#if defined( _M_X64 ) || defined( __x86_64__ ) || defined( _M_IX86 ) || defined( __i386__ )
+#include <immintrin.h>
+#if defined( _MSC_VER )
+#include <intrin.h>
+#define SPARSE_MATRIX_AVX2
+#else // !_MSC_VER
+#include <cpuid.h>
+#define SPARSE_MATRIX_AVX2 __attribute__((target("avx2,fma")))
+#endif // _MSC_VER
+
+inline bool _CpuHasAVX2( void )
+{
+	unsigned int ecx , ebx;
+#if defined( _MSC_VER )
+	int info[4];
+	__cpuid( info , 1 );
+	ecx = info[2];
+	__cpuidex( info , 7 , 0 );
+	ebx = info[1];
+#else // !_MSC_VER
+	unsigned int a , b , d;
+	if( !__get_cpuid( 1 , &a , &b , &ecx , &d ) ) return false;
+	if( !__get_cpuid_count( 7 , 0 , &a , &ebx , &d , &b ) ) return false;
+#endif // _MSC_VER
+	// FMA, AVX and the OS saving the ymm registers (osxsave + xcr0 bits 1, 2), then AVX2
+	if( ( ecx & (1<<12) )==0 || ( ecx & (1<<27) )==0 || ( ecx & (1<<28) )==0 ) return false;
+#if defined( _MSC_VER )
+	unsigned long long xcr0 = _xgetbv( 0 );
+#else // !_MSC_VER
+	unsigned int xcr0_lo , xcr0_hi;
+	__asm__ __volatile__( "xgetbv" : "=a"( xcr0_lo ) , "=d"( xcr0_hi ) : "c"( 0 ) );
+	unsigned long long xcr0 = ( (unsigned long long)xcr0_hi<<32 ) | xcr0_lo;
+#endif // _MSC_VER
+	return ( xcr0 & 0x6 )==0x6 && ( ebx & (1<<5) )!=0;
+}
+// The check runs once, the first time a row product asks for it. A function-local static of an inline function is
+// the same object in every translation unit
+inline bool _SparseMatrixAVX2( void )
+{
+	static const bool avx2 = _CpuHasAVX2();
+	return avx2;
+}
+
+SPARSE_MATRIX_AVX2
+inline float _RowProductAVX2( const MatrixEntry< float >* row , int count , const float* in )
+{
+	// Eight entries are two registers of interleaved (index,value) pairs: de-interleave them and gather the inputs
+	const __m256i split = _mm256_setr_epi32( 0 , 2 , 4 , 6 , 1 , 3 , 5 , 7 );
+	__m256 sum = _mm256_setzero_ps();
+	int i = 0;
+	for( ; i+8<=count ; i+=8 )
+	{
+		__m256i lo = _mm256_permutevar8x32_epi32( _mm256_loadu_si256( (const __m256i*)( row+i   ) ) , split );
+		__m256i hi = _mm256_permutevar8x32_epi32( _mm256_loadu_si256( (const __m256i*)( row+i+4 ) ) , split );
+		__m256i indices = _mm256_permute2x128_si256( lo , hi , 0x20 );
+		__m256 values = _mm256_castsi256_ps( _mm256_permute2x128_si256( lo , hi , 0x31 ) );
+		sum = _mm256_fmadd_ps( values , _mm256_i32gather_ps( in , indices , 4 ) , sum );
+	}
+	__m128 _sum = _mm_add_ps( _mm256_castps256_ps128( sum ) , _mm256_extractf128_ps( sum , 1 ) );
+	_sum = _mm_add_ps( _sum , _mm_movehl_ps( _sum , _sum ) );
+	_sum = _mm_add_ss( _sum , _mm_shuffle_ps( _sum , _sum , 1 ) );
+	float result = _mm_cvtss_f32( _sum );
+	for( ; i<count ; i++ ) result += row[i].Value * in[ row[i].N ];
+	_mm256_zeroupper();
+	return result;
+}
+#endif // x86
+
+template< class T , class T2 >
+inline T2 RowProduct( const MatrixEntry< T >* row , int count , const T2* in )
+{
+	T2 sum = T2(0);
+	for( int i=0 ; i<count ; i++ ) sum += row[i].Value * in[ row[i].N ];
+	return sum;
+}
+#if defined( _M_X64 ) || defined( __x86_64__ ) || defined( _M_IX86 ) || defined( __i386__ )
+inline float RowProduct( const MatrixEntry< float >* row , int count , const float* in )
+{
+	if( _SparseMatrixAVX2() ) return _RowProductAVX2( row , count , in );
+	float sum = 0.f;
+	for( int i=0 ; i<count ; i++ ) sum += row[i].Value * in[ row[i].N ];
+	return sum;
+}
+#endif // x86
+
+template< class T >
+void StencilSymmetricMatrix< T >::setStencil( const double stencil[5][5][5] )
+{
+	memset( this->stencil , 0 , sizeof( this->stencil ) );
+	for( int c=0 ; c<2 ; c++ ) for( int x=0 ; x<5 ; x++ ) for( int y=0 ; y<5 ; y++ ) for( int z=0 ; z<5 ; z++ ) this->stencil[c][x][y][z+c] = T( stencil[x][y][z] );
+}
+template< class T >
+void StencilSymmetricMatrix< T >::setRows( const SparseSymmetricMatrix< T >& M )
+{
+	rows = M.rows;
+	blockNeighbors.clear() , blockStencils.clear() , coloredBlocks.clear() , colorStarts.clear();
+	explicitRows.resize( rows ) , explicitStarts.resize( rows+1 );
+	// An off-diagonal entry of a half row is in both full rows, a diagonal one counts twice in the symmetric product
+	std::vector< int > sizes( rows , 0 );
+	for( int i=0 ; i<rows ; i++ ) for( int j=0 ; j<M.rowSizes[i] ; j++ )
+	{
+		int n = M[i][j].N;
+		sizes[i]++;
+		if( n!=i ) sizes[n]++;
+	}
+	explicitStarts[0] = 0;
+	for( int i=0 ; i<rows ; i++ ) explicitRows[i] = i , explicitStarts[i+1] = explicitStarts[i] + sizes[i] , sizes[i] = explicitStarts[i];
+	explicitEntries.resize( explicitStarts[rows] );
+	for( int i=0 ; i<rows ; i++ ) for( int j=0 ; j<M.rowSizes[i] ; j++ )
+	{
+		int n = M[i][j].N;
+		T v = M[i][j].Value;
+		if( n==i ) explicitEntries[ sizes[i]++ ] = MatrixEntry< T >( i , v*2 );
+		else       explicitEntries[ sizes[i]++ ] = MatrixEntry< T >( n , v ) , explicitEntries[ sizes[n]++ ] = MatrixEntry< T >( i , v );
+	}
+}
+template< class T >
+int StencilSymmetricMatrix< T >::stencilRows( void ) const { return rows - int( explicitRows.size() ); }
+template< class T >
+int StencilSymmetricMatrix< T >::entries( void ) const { return int( explicitEntries.size() ); }
+template< class T >
+template< class T2 >
+void StencilSymmetricMatrix< T >::_gather( int block , const T2* in , T2 values[6][6][8] ) const
+{
+	// The 6x6x6 values around the block, x is the lowest bit of the row index in a block
+	memset( values , 0 , sizeof( T2 ) * 6 * 6 * 8 );
+	const int* neighbors = &blockNeighbors[27*block];
+	for( int i=0 ; i<3 ; i++ ) for( int j=0 ; j<3 ; j++ ) for( int k=0 ; k<3 ; k++ )
+	{
+		int n = neighbors[9*i+3*j+k];
+		if( n>=0 ) for( int c=0 ; c<8 ; c++ ) values[2*i+(c&1)][2*j+((c>>1)&1)][2*k+(c>>2)] = in[n+c];
+	}
+}
+template< class T >
+template< class T2 >
+T2 StencilSymmetricMatrix< T >::_stencilRow( int c , const T2 values[6][6][8] ) const
+{
+	// Rows of eight, so the inner products vectorize
+	int x = c&1 , y = (c>>1)&1 , z = c>>2;
+	T2 sums[8] = { T2(0) };
+	for( int i=0 ; i<5 ; i++ ) for( int j=0 ; j<5 ; j++ )
+	{
+		const T* _stencil = stencil[z][i][j];
+		const T2* _values = values[x+i][y+j];
+		for( int k=0 ; k<8 ; k++ ) sums[k] += _stencil[k] * _values[k];
+	}
+	T2 sum = T2(0);
+	for( int k=0 ; k<8 ; k++ ) sum += sums[k];
+	return sum;
+}
+template< class T >
+template< class T2 >
+void StencilSymmetricMatrix< T >::Multiply( const Vector< T2 >& In , Vector< T2 >& Out , bool addDCTerm ) const
+{
+	const T2* in = &In[0];
+	T2* out = &Out[0];
+	T2 dcTerm = T2(0);
+	if( addDCTerm )
+	{
+		double sum = 0;
+#pragma omp parallel for num_threads( threads ) reduction( + : sum )
+		for( int i=0 ; i<rows ; i++ ) sum += in[i];
+		dcTerm = T2( sum / rows );
+	}
+	int blocks = int( blockStencils.size() );
+#pragma omp parallel for num_threads( threads ) schedule( static )
+	for( int b=0 ; b<blocks ; b++ )
+	{
+		unsigned char mask = blockStencils[b];
+		if( !mask ) continue;
+		T2 values[6][6][8];
+		_gather( b , in , values );
+		for( int c=0 ; c<8 ; c++ ) if( mask & (1<<c) ) out[8*b+c] = _stencilRow( c , values ) + dcTerm;
+	}
+	int explicitCount = int( explicitRows.size() );
+#pragma omp parallel for num_threads( threads ) schedule( static )
+	for( int i=0 ; i<explicitCount ; i++ )
+		out[ explicitRows[i] ] = RowProduct( &explicitEntries[0] + explicitStarts[i] , explicitStarts[i+1]-explicitStarts[i] , in ) + dcTerm;
+}
+template< class T >
+template< class T2 >
+void StencilSymmetricMatrix< T >::getDiagonal( Vector< T2 >& diagonal ) const
+{
+	diagonal.Resize( rows );
+	int blocks = int( blockStencils.size() );
+	for( int b=0 ; b<blocks ; b++ ) for( int c=0 ; c<8 ; c++ ) if( blockStencils[b] & (1<<c) ) diagonal[8*b+c] = T2( stencil[c>>2][2][2][2+(c>>2)] );
+	for( int i=0 ; i<int( explicitRows.size() ) ; i++ )
+	{
+		T2 d = T2(0);
+		for( int j=explicitStarts[i] ; j<explicitStarts[i+1] ; j++ ) if( explicitEntries[j].N==explicitRows[i] ) d += explicitEntries[j].Value;
+		// An empty row would be left alone by the preconditioners
+		diagonal[ explicitRows[i] ] = d!=T2(0) ? d : T2(1);
+	}
+}
+template< class T >
+template< class T2 >
+void StencilSymmetricMatrix< T >::_gaussSeidel( int block , const T2* b , const T2* diagonal , T2* x , bool forward ) const
+{
+	int start = 8*block , end = std::min< int >( start+8 , rows );
+	unsigned char mask = blockStencils[block];
+	// The values around the block, updated along with the solution
+	T2 values[6][6][8];
+	if( mask ) _gather( block , x , values );
+	// The explicit rows are sorted
+	int e = int( std::lower_bound( explicitRows.begin() , explicitRows.end() , forward ? start : end ) - explicitRows.begin() ) - ( forward ? 0 : 1 );
+	for( int ii=start ; ii<end ; ii++ )
+	{
+		int i = forward ? ii : start+end-1-ii , c = i-start;
+		T2 sum;
+		if( mask & (1<<c) ) sum = _stencilRow( c , values );
+		else
+		{
+			sum = RowProduct( &explicitEntries[0] + explicitStarts[e] , explicitStarts[e+1]-explicitStarts[e] , x );
+			e += forward ? 1 : -1;
+		}
+		T2 dx = ( b[i] - sum ) / diagonal[i];
+		x[i] += dx;
+		if( mask ) values[2+(c&1)][2+((c>>1)&1)][2+(c>>2)] += dx;
+	}
+}
+template< class T >
+template< class T2 >
+void StencilSymmetricMatrix< T >::gaussSeidel( const Vector< T2 >& diagonal , const Vector< T2 >& b , Vector< T2 >& x , bool forward ) const
+{
+	const T2 *_b = &b[0] , *_diagonal = &diagonal[0];
+	T2* _x = &x[0];
+	if( blockStencils.size() )
+		// The blocks of a color don't read each other's rows, so they are swept in parallel
+		for( int cc=0 ; cc<8 ; cc++ )
+		{
+			int color = forward ? cc : 7-cc;
+#pragma omp parallel for num_threads( threads ) schedule( dynamic , 64 )
+			for( int i=colorStarts[color] ; i<colorStarts[color+1] ; i++ ) _gaussSeidel( coloredBlocks[ forward ? i : colorStarts[color]+colorStarts[color+1]-1-i ] , _b , _diagonal , _x , forward );
+		}
+	else
+	{
+		int explicitCount = int( explicitRows.size() );
+		for( int ii=0 ; ii<explicitCount ; ii++ )
+		{
+			int e = forward ? ii : explicitCount-1-ii , i = explicitRows[e];
+			T2 sum = RowProduct( &explicitEntries[0] + explicitStarts[e] , explicitStarts[e+1]-explicitStarts[e] , _x );
+			_x[i] += ( _b[i] - sum ) / _diagonal[i];
+		}
+	}
+}
+template< class T >
+template< class T2 >
+void StencilSymmetricMatrix< T >::_precondition( int preconditioner , const Vector< T2 >& diagonal , const Vector< T2 >& r , Vector< T2 >& z , Vector< T2 >& temp ) const
+{
+	// z = M^{-1} r, where M is the diagonal D or (D+L) D^{-1} (D+U)
+	int dim = int( r.Dimensions() );
+	const T2 *_r = &r[0] , *_diagonal = &diagonal[0];
+	T2* _z = &z[0];
+	if( preconditioner==PRECONDITIONER_JACOBI )
+#pragma omp parallel for num_threads( threads )
+		for( int i=0 ; i<dim ; i++ ) _z[i] = _r[i] / _diagonal[i];
+	else if( preconditioner==PRECONDITIONER_SYMMETRIC_GAUSS_SEIDEL )
+	{
+		T2* _temp = &temp[0];
+		memset( _temp , 0 , sizeof( T2 ) * dim );
+		gaussSeidel( diagonal , r , temp , true );
+#pragma omp parallel for num_threads( threads )
+		for( int i=0 ; i<dim ; i++ ) _temp[i] *= _diagonal[i] , _z[i] = T2(0);
+		gaussSeidel( diagonal , temp , z , false );
+	}
+}
+template< class T >
+template< class T2 >
+int StencilSymmetricMatrix< T >::Solve( const StencilSymmetricMatrix< T >& A , const Vector< T2 >& b , int iters , Vector< T2 >& x , T2 eps , int reset , bool addDCTerm , bool residualFromB , int preconditioner )
+{
+	int threads = A.threads;
+	eps *= eps;
+	int dim = int( b.Dimensions() );
+	Vector< T2 > r( dim ) , d( dim ) , q( dim ) , z , diagonal;
+	if( reset ) x.Resize( dim );
+	if( preconditioner!=PRECONDITIONER_NONE ) z.Resize( dim ) , A.getDiagonal( diagonal );
+	T2 *_x = &x[0] , *_r = &r[0] , *_d = &d[0] , *_q = &q[0] , *_z = preconditioner!=PRECONDITIONER_NONE ? &z[0] : _r;
+	const T2* _b = &b[0];
+
+	Vector< T2 > temp;
+	if( preconditioner==PRECONDITIONER_SYMMETRIC_GAUSS_SEIDEL ) temp.Resize( dim );
+
+	double delta_new = 0 , delta_0 , rDotZ = 0;
+	A.Multiply( x , r , addDCTerm );
+#pragma omp parallel for num_threads( threads ) reduction ( + : delta_new )
+	for( int i=0 ; i<dim ; i++ ) _r[i] = _b[i] - _r[i] , delta_new += _r[i] * _r[i];
+	delta_0 = delta_new;
+	if( residualFromB )
+	{
+		delta_0 = 0;
+#pragma omp parallel for num_threads( threads ) reduction( + : delta_0 )
+		for( int i=0 ; i<dim ; i++ ) delta_0 += _b[i] * _b[i];
+	}
+	if( delta_new<eps )
+	{
+		fprintf( stderr , "[WARNING] Initial residual too low: %g < %f\n" , delta_new , eps );
+		return 0;
+	}
+	A._precondition( preconditioner , diagonal , r , z , temp );
+#pragma omp parallel for num_threads( threads ) reduction ( + : rDotZ )
+	for( int i=0 ; i<dim ; i++ ) _d[i] = _z[i] , rDotZ += _r[i] * _z[i];
+	int ii;
+	for( ii=0 ; ii<iters && delta_new>eps*delta_0 ; ii++ )
+	{
+		A.Multiply( d , q , addDCTerm );
+		double dDotQ = 0;
+#pragma omp parallel for num_threads( threads ) reduction( + : dDotQ )
+		for( int i=0 ; i<dim ; i++ ) dDotQ += _d[i] * _q[i];
+		T2 alpha = T2( rDotZ / dDotQ );
+		delta_new = 0;
+		if( (ii%50)==(50-1) )
+		{
+#pragma omp parallel for num_threads( threads )
+			for( int i=0 ; i<dim ; i++ ) _x[i] += _d[i] * alpha;
+			A.Multiply( x , r , addDCTerm );
+#pragma omp parallel for num_threads( threads ) reduction( + : delta_new )
+			for( int i=0 ; i<dim ; i++ ) _r[i] = _b[i] - _r[i] , delta_new += _r[i] * _r[i];
+		}
+		else
+#pragma omp parallel for num_threads( threads ) reduction( + : delta_new )
+			for( int i=0 ; i<dim ; i++ ) _r[i] -= _q[i] * alpha , delta_new += _r[i] * _r[i] ,  _x[i] += _d[i] * alpha;
+
+		double rDotZ_old = rDotZ;
+		if( preconditioner==PRECONDITIONER_NONE ) rDotZ = delta_new;
+		else
+		{
+			A._precondition( preconditioner , diagonal , r , z , temp );
+			rDotZ = 0;
+#pragma omp parallel for num_threads( threads ) reduction( + : rDotZ )
+			for( int i=0 ; i<dim ; i++ ) rDotZ += _r[i] * _z[i];
+		}
+		T2 beta = T2( rDotZ / rDotZ_old );
+#pragma omp parallel for num_threads( threads )
+		for( int i=0 ; i<dim ; i++ ) _d[i] = _z[i] + _d[i] * beta;
+	}
+	return ii;
+}
+template< class T >
+template< class T2 >
+int SparseSymmetricMatrix< T >::SolvePreconditioned( const SparseSymmetricMatrix< T >& M , const Vector< T2 >& b , int iters , Vector< T2 >& x , int preconditioner , int threads , T2 eps , int reset , bool addDCTerm , bool residualFromB )
+{
+	StencilSymmetricMatrix< T > A;
+	A.threads = std::max< int >( threads , 1 );
+	A.setRows( M );
+	return StencilSymmetricMatrix< T >::Solve( A , b , iters , x , eps , reset , addDCTerm , residualFromB , preconditioner );
+}
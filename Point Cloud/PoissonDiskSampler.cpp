@@ -0,0 +1,128 @@
+#include "PoissonDiskSampler.h"
+#include "GlobalFunction.h"
+#include "Poisson/DiskThinning.h"
+
+#include <algorithm>
+#include <math.h>
+#include <tbb/parallel_for.h>
+using namespace std;
+
+double PoissonDiskSampler::computeRadius(const CMesh& mesh, int sample_num)
+{
+  double area = 0;
+  for (int i = 0; i < mesh.face.size(); i++)
+  {
+    const CFace& f = mesh.face[i];
+    if (!f.IsD()) area += ((f.cP(1) - f.cP(0)) ^ (f.cP(2) - f.cP(0))).Norm() / 2;
+  }
+  //a point cloud, half the area of the box
+  if (area == 0)
+    area = mesh.bbox.DimX() * mesh.bbox.DimY() + mesh.bbox.DimX() * mesh.bbox.DimZ() + mesh.bbox.DimY() * mesh.bbox.DimZ();
+  return sqrt(area / (0.7 * PI * sample_num)); // 0.7 is a density factor
+}
+
+float PoissonDiskSampler::random(unsigned int seed, unsigned int i, unsigned int draw)
+{
+  //a hash of (seed, i, draw) instead of a generator, so every candidate gets the same numbers whichever thread throws it
+  unsigned int h = seed * 0x9E3779B9u ^ (i * 0x85EBCA6Bu + draw * 0xC2B2AE35u);
+  h ^= h >> 16; h *= 0x7FEB352Du;
+  h ^= h >> 15; h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return (h >> 8) * (1.0f / (1 << 24));
+}
+
+void PoissonDiskSampler::sample(const CMesh& mesh, double radius, int candidate_num, CMesh* points) const
+{
+  points->vert.clear();
+  int face_num = mesh.face.size();
+  if (face_num == 0 || candidate_num <= 0 || radius <= 0) return;
+
+  vector<double> area_sum(face_num + 1, 0.0);
+  for (int i = 0; i < face_num; i++)
+  {
+    const CFace& f = mesh.face[i];
+    double area = f.IsD() ? 0.0 : ((f.cP(1) - f.cP(0)) ^ (f.cP(2) - f.cP(0))).Norm() / 2;
+    area_sum[i + 1] = area_sum[i] + area;
+  }
+  if (area_sum[face_num] <= 0) return;
+
+  vector<Point3f> positions(candidate_num);
+  vector<Point3f> normals(candidate_num);
+  vector<float>   priorities(candidate_num);
+  auto throwCandidates = [&](int begin, int end)
+  {
+    for (int i = begin; i < end; i++)
+    {
+      double target = random(seed, i, 0) * area_sum[face_num];
+      int face = std::upper_bound(area_sum.begin() + 1, area_sum.end(), target) - area_sum.begin() - 1;
+      face = std::min(face, face_num - 1);
+      const CFace& f = mesh.face[face];
+
+      //uniform in the triangle, folding the square onto it
+      float u = random(seed, i, 1), v = random(seed, i, 2);
+      if (u + v > 1)
+      {
+        u = 1 - u;
+        v = 1 - v;
+      }
+      float w = 1 - u - v;
+      positions[i] = f.cP(0) * w + f.cP(1) * u + f.cP(2) * v;
+      normals[i] = f.cV(0)->cN() * w + f.cV(1)->cN() * u + f.cV(2)->cN() * v;
+      priorities[i] = random(seed, i, 3);
+    }
+  };
+
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<int>(0, candidate_num),
+    [&](const tbb::blocked_range<int>& r)
+  {
+    throwCandidates(r.begin(), r.end());
+  });
+#else
+  throwCandidates(0, candidate_num);
+#endif
+
+  //the cells of a phase share no neighbors, the phases go in order
+  DiskThinning<Point3f> thinning;
+  thinning.set(positions, radius, &priorities);
+  for (int phase = 0; phase < DiskThinning<Point3f>::PHASES; phase++)
+  {
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<int>(0, thinning.phaseSize(phase)),
+      [&](const tbb::blocked_range<int>& r)
+    {
+      thinning.thinCells(phase, r.begin(), r.end());
+    });
+#else
+    thinning.thinCells(phase, 0, thinning.phaseSize(phase));
+#endif
+  }
+  vector<char> kept;
+  thinning.getKept(kept);
+
+  //the samples in the order the candidates were thrown
+  vector<int> samples;
+  for (int i = 0; i < candidate_num; i++)
+    if (kept[i]) samples.push_back(i);
+
+  points->vert.resize(samples.size());
+  auto copySamples = [&](int begin, int end)
+  {
+    for (int i = begin; i < end; i++)
+    {
+      CVertex& v = points->vert[i];
+      v.P() = positions[samples[i]];
+      v.N() = normals[samples[i]];
+    }
+  };
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<int>(0, samples.size()),
+    [&](const tbb::blocked_range<int>& r)
+  {
+    copySamples(r.begin(), r.end());
+  });
+#else
+  copySamples(0, samples.size());
+#endif
+  points->vn = points->vert.size();
+}
@@ -0,0 +1,30 @@
+#ifndef POISSON_DISK_SAMPLER_H
+#define POISSON_DISK_SAMPLER_H
+
+#include <vector>
+#include "cmesh.h"
+using namespace std;
+
+// blue-noise samples of a triangle mesh, at least a disk radius apart. uniform random candidates
+// are thrown over the faces (by area) and thinned by the dart throwing of Poisson/DiskThinning.h,
+// whose 27 phases of cells are thinned in parallel. the candidates and their order only depend on
+// the seed, never on the number of threads.
+class PoissonDiskSampler {
+  public:
+    PoissonDiskSampler(unsigned int _seed = 0) : seed(_seed) {}
+
+    // what vcg's ComputePoissonDiskRadius gives for sample_num samples of the mesh
+    static double computeRadius(const CMesh& mesh, int sample_num);
+
+    // replaces the vertices of points by the samples, with the vertex normals of the mesh
+    // interpolated at them. candidate_num candidates are thrown
+    void sample(const CMesh& mesh, double radius, int candidate_num, CMesh* points) const;
+
+  private:
+    static float random(unsigned int seed, unsigned int i, unsigned int draw); // in [0, 1)
+
+  private:
+    unsigned int seed;
+};
+
+#endif
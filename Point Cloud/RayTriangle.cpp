@@ -0,0 +1,310 @@
+#include "RayTriangle.h"
+
+#include <iostream>
+#include <xmmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RAY_TRIANGLE_AVX
+#else
+#include <cpuid.h>
+#define RAY_TRIANGLE_AVX __attribute__((target("avx")))
+#endif
+using namespace std;
+
+typedef int (*IntersectKernel)(const TriangleSoA& tris, int first, int count, const float o[3], const float d[3], float& t_best);
+
+//front faces only: det = e1 . (d ^ e2) = -d . normal must be positive
+static const float RAY_TRIANGLE_EPS = 1e-12f;
+
+void TriangleSoA::clear()
+{
+  n = 0;
+  v0x.clear(); v0y.clear(); v0z.clear();
+  e1x.clear(); e1y.clear(); e1z.clear();
+  e2x.clear(); e2y.clear(); e2z.clear();
+}
+
+void TriangleSoA::resize(int _n)
+{
+  n = _n;
+  int padded = n + PADDING;
+  v0x.assign(padded, 0.0f); v0y.assign(padded, 0.0f); v0z.assign(padded, 0.0f);
+  e1x.assign(padded, 0.0f); e1y.assign(padded, 0.0f); e1z.assign(padded, 0.0f);
+  e2x.assign(padded, 0.0f); e2y.assign(padded, 0.0f); e2z.assign(padded, 0.0f);
+}
+
+void TriangleSoA::set(int i, const Point3f& v0, const Point3f& v1, const Point3f& v2)
+{
+  Point3f e1 = v1 - v0;
+  Point3f e2 = v2 - v0;
+  v0x[i] = v0[0]; v0y[i] = v0[1]; v0z[i] = v0[2];
+  e1x[i] = e1[0]; e1y[i] = e1[1]; e1z[i] = e1[2];
+  e2x[i] = e2[0]; e2y[i] = e2[1]; e2z[i] = e2[2];
+}
+
+void TriangleSoA::setFaces(const CMesh& mesh)
+{
+  resize(mesh.face.size());
+  for (int i = 0; i < n; ++i)
+  {
+    const CFace& face = mesh.face[i];
+    set(i, face.cV(0)->cP(), face.cV(1)->cP(), face.cV(2)->cP());
+  }
+}
+
+static int intersectScalar(const TriangleSoA& tris, int first, int count, const float o[3], const float d[3], float& t_best)
+{
+  int hit = -1;
+  for (int i = first; i < first + count; ++i)
+  {
+    //p = d ^ e2
+    float px = d[1] * tris.e2z[i] - d[2] * tris.e2y[i];
+    float py = d[2] * tris.e2x[i] - d[0] * tris.e2z[i];
+    float pz = d[0] * tris.e2y[i] - d[1] * tris.e2x[i];
+    float det = tris.e1x[i] * px + tris.e1y[i] * py + tris.e1z[i] * pz;
+    if (det <= RAY_TRIANGLE_EPS) continue;
+    float inv_det = 1.0f / det;
+
+    float tx = o[0] - tris.v0x[i];
+    float ty = o[1] - tris.v0y[i];
+    float tz = o[2] - tris.v0z[i];
+    float u = (tx * px + ty * py + tz * pz) * inv_det;
+    if (u < 0.0f || u > 1.0f) continue;
+
+    //q = t ^ e1
+    float qx = ty * tris.e1z[i] - tz * tris.e1y[i];
+    float qy = tz * tris.e1x[i] - tx * tris.e1z[i];
+    float qz = tx * tris.e1y[i] - ty * tris.e1x[i];
+    float v = (d[0] * qx + d[1] * qy + d[2] * qz) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) continue;
+
+    float t = (tris.e2x[i] * qx + tris.e2y[i] * qy + tris.e2z[i] * qz) * inv_det;
+    if (t < 0.0f || t >= t_best) continue;
+
+    t_best = t;
+    hit = i;
+  }
+  return hit;
+}
+
+static int intersectSSE(const TriangleSoA& tris, int first, int count, const float o[3], const float d[3], float& t_best)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 eps = _mm_set1_ps(RAY_TRIANGLE_EPS);
+  const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+  const __m128 ox = _mm_set1_ps(o[0]), oy = _mm_set1_ps(o[1]), oz = _mm_set1_ps(o[2]);
+  const __m128 dx = _mm_set1_ps(d[0]), dy = _mm_set1_ps(d[1]), dz = _mm_set1_ps(d[2]);
+  __m128 t_max = _mm_set1_ps(t_best);
+
+  int hit = -1;
+  int end = first + count;
+  for (int i = first; i < end; i += 4)
+  {
+    __m128 e1x = _mm_loadu_ps(&tris.e1x[i]), e1y = _mm_loadu_ps(&tris.e1y[i]), e1z = _mm_loadu_ps(&tris.e1z[i]);
+    __m128 e2x = _mm_loadu_ps(&tris.e2x[i]), e2y = _mm_loadu_ps(&tris.e2y[i]), e2z = _mm_loadu_ps(&tris.e2z[i]);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+    //lanes past the end of the range are switched off here
+    __m128 mask = _mm_and_ps(_mm_cmpgt_ps(det, eps), _mm_cmplt_ps(lane, _mm_set1_ps((float)(end - i))));
+    if (_mm_movemask_ps(mask) == 0) continue;
+    __m128 inv_det = _mm_div_ps(one, det);
+
+    __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&tris.v0x[i]));
+    __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&tris.v0y[i]));
+    __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&tris.v0z[i]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, t_max)));
+
+    int bits = _mm_movemask_ps(mask);
+    if (bits == 0) continue;
+
+    float t_lane[4];
+    _mm_storeu_ps(t_lane, t);
+    for (int k = 0; k < 4; ++k)
+    {
+      if ((bits & (1 << k)) && t_lane[k] < t_best)
+      {
+        t_best = t_lane[k];
+        hit = i + k;
+      }
+    }
+    t_max = _mm_set1_ps(t_best);
+  }
+  return hit;
+}
+
+RAY_TRIANGLE_AVX
+static int intersectAVX(const TriangleSoA& tris, int first, int count, const float o[3], const float d[3], float& t_best)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 eps = _mm256_set1_ps(RAY_TRIANGLE_EPS);
+  const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+  const __m256 ox = _mm256_set1_ps(o[0]), oy = _mm256_set1_ps(o[1]), oz = _mm256_set1_ps(o[2]);
+  const __m256 dx = _mm256_set1_ps(d[0]), dy = _mm256_set1_ps(d[1]), dz = _mm256_set1_ps(d[2]);
+  __m256 t_max = _mm256_set1_ps(t_best);
+
+  int hit = -1;
+  int end = first + count;
+  for (int i = first; i < end; i += 8)
+  {
+    __m256 e1x = _mm256_loadu_ps(&tris.e1x[i]), e1y = _mm256_loadu_ps(&tris.e1y[i]), e1z = _mm256_loadu_ps(&tris.e1z[i]);
+    __m256 e2x = _mm256_loadu_ps(&tris.e2x[i]), e2y = _mm256_loadu_ps(&tris.e2y[i]), e2z = _mm256_loadu_ps(&tris.e2z[i]);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(det, eps, _CMP_GT_OQ),
+                                _mm256_cmp_ps(lane, _mm256_set1_ps((float)(end - i)), _CMP_LT_OQ));
+    if (_mm256_movemask_ps(mask) == 0) continue;
+    __m256 inv_det = _mm256_div_ps(one, det);
+
+    __m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(&tris.v0x[i]));
+    __m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(&tris.v0y[i]));
+    __m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(&tris.v0z[i]));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+                                             _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, t_max, _CMP_LT_OQ)));
+
+    int bits = _mm256_movemask_ps(mask);
+    if (bits == 0) continue;
+
+    float t_lane[8];
+    _mm256_storeu_ps(t_lane, t);
+    for (int k = 0; k < 8; ++k)
+    {
+      if ((bits & (1 << k)) && t_lane[k] < t_best)
+      {
+        t_best = t_lane[k];
+        hit = i + k;
+      }
+    }
+    t_max = _mm256_set1_ps(t_best);
+  }
+  _mm256_zeroupper();
+  return hit;
+}
+
+static bool cpuHasSSE()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 25)) != 0;
+#else
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+  return (d & (1 << 25)) != 0;
+#endif
+}
+
+static bool cpuHasAVX()
+{
+  unsigned int ecx;
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  ecx = info[2];
+#else
+  unsigned int a, b, d;
+  if (!__get_cpuid(1, &a, &b, &ecx, &d)) return false;
+#endif
+  //the cpu has avx and the os saves the ymm registers (osxsave + xcr0 bits 1, 2)
+  if ((ecx & (1 << 28)) == 0 || (ecx & (1 << 27)) == 0) return false;
+
+#if defined(_MSC_VER)
+  unsigned long long xcr0 = _xgetbv(0);
+#else
+  unsigned int xcr0_lo, xcr0_hi;
+  __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  unsigned long long xcr0 = ((unsigned long long)xcr0_hi << 32) | xcr0_lo;
+#endif
+  return (xcr0 & 0x6) == 0x6;
+}
+
+static RayTriangle::ISA detectISA()
+{
+  if (cpuHasAVX()) return RayTriangle::AVX;
+  if (cpuHasSSE()) return RayTriangle::SSE;
+  return RayTriangle::SCALAR;
+}
+
+static IntersectKernel kernelOf(RayTriangle::ISA isa)
+{
+  switch (isa)
+  {
+  case RayTriangle::AVX: return intersectAVX;
+  case RayTriangle::SSE: return intersectSSE;
+  default:               return intersectScalar;
+  }
+}
+
+//picked once at startup, before any scan thread exists
+static RayTriangle::ISA supported_isa = detectISA();
+static RayTriangle::ISA current_isa = supported_isa;
+static IntersectKernel current_kernel = kernelOf(supported_isa);
+
+RayTriangle::ISA RayTriangle::getISA()
+{
+  return current_isa;
+}
+
+RayTriangle::ISA RayTriangle::getSupportedISA()
+{
+  return supported_isa;
+}
+
+void RayTriangle::setISA(ISA isa)
+{
+  if (isa > supported_isa) isa = supported_isa;
+  if (isa == current_isa) return;
+
+  current_isa = isa;
+  current_kernel = kernelOf(isa);
+  cout << "ray triangle kernel: " << getISAName(isa) << endl;
+}
+
+const char* RayTriangle::getISAName(ISA isa)
+{
+  switch (isa)
+  {
+  case AVX: return "AVX";
+  case SSE: return "SSE";
+  default:  return "scalar";
+  }
+}
+
+int TriangleSoA::intersect(int first, int count, const Point3f& origin, const Point3f& dir, float& t_best) const
+{
+  float o[3] = {origin[0], origin[1], origin[2]};
+  float d[3] = {dir[0], dir[1], dir[2]};
+  return current_kernel(*this, first, count, o, d, t_best);
+}
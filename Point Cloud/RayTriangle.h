@@ -0,0 +1,43 @@
+#ifndef RAY_TRIANGLE_H
+#define RAY_TRIANGLE_H
+
+#include <vector>
+#include "cmesh.h"
+using namespace std;
+
+// triangles stored as structure of arrays: vertex 0 and the two edges leaving it,
+// one array per coordinate, which is what the SIMD Moller-Trumbore kernels load from.
+class TriangleSoA {
+  public:
+    enum { PADDING = 8 };  // the kernels read whole 4/8 lanes, so keep 8 spare zero triangles at the end
+
+    TriangleSoA() : n(0) {}
+
+    void resize(int _n);
+    void clear();
+    int  size() const { return n; }
+    void set(int i, const Point3f& v0, const Point3f& v1, const Point3f& v2);
+    void setFaces(const CMesh& mesh);  // one triangle per face, in face order
+
+    // nearest front facing triangle in [first, first + count) hit by origin + t * dir, 0 <= t < t_best.
+    // returns its index and shrinks t_best, or returns -1 and leaves t_best untouched
+    int  intersect(int first, int count, const Point3f& origin, const Point3f& dir, float& t_best) const;
+
+  public:
+    vector<float> v0x, v0y, v0z;
+    vector<float> e1x, e1y, e1z;
+    vector<float> e2x, e2y, e2z;
+    int n;
+};
+
+namespace RayTriangle
+{
+  enum ISA { SCALAR = 0, SSE = 1, AVX = 2 };
+
+  ISA         getISA();
+  ISA         getSupportedISA();
+  void        setISA(ISA isa);  // clamped to what the cpu supports, mainly for A/B testing
+  const char* getISAName(ISA isa);
+}
+
+#endif
@@ -568,13 +568,15 @@ void CameraParaDlg::mergeScannedMeshWithOriginalUsingHoleConfidence()
   CMesh* iso_points = area->dataMgr.getCurrentIsoPoints();
   assert(original != NULL);
   assert(iso_points != NULL);
+  NeighborSearch* neighbor_search = area->dataMgr.getNeighborSearch();
   vector<CMesh* > *scanned_results = area->dataMgr.getScannedResults();
   for (vector<CMesh* >::iterator it = scanned_results->begin(); it != scanned_results->end(); ++it) 
   {
     if ((*it)->vert.empty())
       continue;
 
-    GlobalFun::computeAnnNeigbhors(iso_points->vert, (*it)->vert, 1, false, "runComputeIsoSmoothnessConfidence");
+    NeighborGraph graph;
+    neighbor_search->computeKnnGraph(iso_points, (*it)->vert, 1, graph);
 
     (*it)->vert[0].is_scanned_visible = false;
     cout<<"Before merge with original: " << original->vert.size() <<endl;
@@ -586,10 +588,10 @@ void CameraParaDlg::mergeScannedMeshWithOriginalUsingHoleConfidence()
     for (int k = 0; k < (*it)->vert.size(); ++k)
     {
       CVertex& v = (*it)->vert[k];
-      if(v.neighbors.empty())
+      if(graph.count(k) == 0)
         continue;
 
-      double nei_confidence = iso_points->vert[v.neighbors[0]].eigen_confidence;
+      double nei_confidence = iso_points->vert[graph.neighbor(k, 0)].eigen_confidence;
       if(nei_confidence > skip_conf){
         v.is_ignore = true;
         skip_num ++;
@@ -608,6 +610,7 @@ void CameraParaDlg::mergeScannedMeshWithOriginalUsingHoleConfidence()
     cout<<"skip points num:" <<skip_num <<endl;
     cout<<"After merge with original: " << original->vert.size() <<endl <<endl;
   }
+  neighbor_search->clear();
 }
 
 void CameraParaDlg::mergeScannedMeshWithOriginalByHand()
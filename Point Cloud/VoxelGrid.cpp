@@ -0,0 +1,377 @@
+#include "VoxelGrid.h"
+#include "GlobalFunction.h"
+
+#include <algorithm>
+#include <tbb/parallel_for.h>
+using namespace std;
+using namespace vcg;
+
+static const int   NORMAL_BITS = 10;
+static const int   NORMAL_MASK = (1 << NORMAL_BITS) - 1;
+static const float NORMAL_SCALE = float((1 << (NORMAL_BITS - 1)) - 1); //511, zero maps to 512
+
+VoxelGrid::VoxelGrid()
+  : kind(FIELD_GRID), origin(0.0f, 0.0f, 0.0f), step(0.0f), res_x(0), res_y(0), res_z(0)
+{
+  brick_res[0] = brick_res[1] = brick_res[2] = 0;
+}
+
+void VoxelGrid::resize(Kind _kind, const Point3f& _origin, float _step, int _res_x, int _res_y, int _res_z)
+{
+  clear();
+  kind = _kind;
+  origin = _origin;
+  step = _step;
+  res_x = _res_x;
+  res_y = _res_y;
+  res_z = _res_z;
+  allocate(res_x * res_y * res_z);
+}
+
+void VoxelGrid::resizeSparse(Kind _kind, const Point3f& _origin, float _step, int _res_x, int _res_y, int _res_z,
+                             const vector<char>& keep_bricks)
+{
+  clear();
+  kind = _kind;
+  origin = _origin;
+  step = _step;
+  brick_res[0] = bricks(_res_x);
+  brick_res[1] = bricks(_res_y);
+  brick_res[2] = bricks(_res_z);
+  res_x = brick_res[0] * BRICK_SIZE;
+  res_y = brick_res[1] * BRICK_SIZE;
+  res_z = brick_res[2] * BRICK_SIZE;
+
+  int n_bricks = brick_res[0] * brick_res[1] * brick_res[2];
+  brick_slots.assign(n_bricks, -1);
+  for (int b = 0; b < n_bricks; ++b)
+  {
+    if (!keep_bricks[b]) continue;
+    brick_slots[b] = slot_bricks.size();
+    slot_bricks.push_back(b);
+  }
+  allocate(slot_bricks.size() << (3 * BRICK_BITS));
+}
+
+void VoxelGrid::allocate(int n)
+{
+  confidences.assign(n, 0.0f);
+  normals.assign(n, packNormal(Point3f(0.0f, 0.0f, 0.0f)));
+  for (int f = 0; f < FLAG_NUM; ++f)
+    flags[f].assign((n + 31) / 32, 0);
+  if (kind == VIEW_GRID)
+    iso_indices.assign(n, 0);
+}
+
+void VoxelGrid::clear()
+{
+  res_x = res_y = res_z = 0;
+  //swap to really give the memory back, the grids are large
+  vector<float>().swap(confidences);
+  vector<unsigned int>().swap(normals);
+  for (int f = 0; f < FLAG_NUM; ++f)
+    vector<unsigned int>().swap(flags[f]);
+  vector<int>().swap(iso_indices);
+  brick_res[0] = brick_res[1] = brick_res[2] = 0;
+  vector<int>().swap(brick_slots);
+  vector<int>().swap(slot_bricks);
+}
+
+Box3f VoxelGrid::getBox() const
+{
+  Box3f box;
+  if (empty()) return box;
+
+  box.Add(origin);
+  box.Add(position(res_x - 1, res_y - 1, res_z - 1));
+  return box;
+}
+
+void VoxelGrid::coords(int index, int& i, int& j, int& k) const
+{
+  if (!brick_slots.empty())
+  {
+    int brick = slot_bricks[index >> (3 * BRICK_BITS)];
+    int bk = brick % brick_res[2];
+    brick /= brick_res[2];
+    int bj = brick % brick_res[1];
+    int bi = brick / brick_res[1];
+    i = (bi << BRICK_BITS) | ((index >> (2 * BRICK_BITS)) & BRICK_MASK);
+    j = (bj << BRICK_BITS) | ((index >> BRICK_BITS) & BRICK_MASK);
+    k = (bk << BRICK_BITS) | (index & BRICK_MASK);
+    return;
+  }
+
+  k = index % res_z;
+  index /= res_z;
+  j = index % res_y;
+  i = index / res_y;
+}
+
+bool VoxelGrid::isInside(int i, int j, int k) const
+{
+  return i >= 0 && i < res_x && j >= 0 && j < res_y && k >= 0 && k < res_z;
+}
+
+Point3f VoxelGrid::position(int index) const
+{
+  int i, j, k;
+  coords(index, i, j, k);
+  return position(i, j, k);
+}
+
+Point3f VoxelGrid::position(int i, int j, int k) const
+{
+  return Point3f(origin[0] + i * step, origin[1] + j * step, origin[2] + k * step);
+}
+
+int VoxelGrid::nearestCell(const Point3f& p) const
+{
+  if (empty() || step <= 0) return -1;
+
+  int i = (int)floor((p[0] - origin[0]) / step + 0.5f);
+  int j = (int)floor((p[1] - origin[1]) / step + 0.5f);
+  int k = (int)floor((p[2] - origin[2]) / step + 0.5f);
+  if (!isInside(i, j, k)) return -1;
+
+  return index(i, j, k);
+}
+
+void VoxelGrid::getCellsInBall(const Point3f& p, double radius, vector<int>& cells) const
+{
+  cells.clear();
+  if (empty() || step <= 0) return;
+
+  int lo[3], hi[3];
+  int res[3] = {res_x, res_y, res_z};
+  for (int a = 0; a < 3; ++a)
+  {
+    lo[a] = std::max(0, (int)ceil((p[a] - radius - origin[a]) / step));
+    hi[a] = std::min(res[a] - 1, (int)floor((p[a] + radius - origin[a]) / step));
+  }
+
+  double radius2 = radius * radius;
+  for (int i = lo[0]; i <= hi[0]; ++i)
+  {
+    double dx = origin[0] + i * step - p[0];
+    for (int j = lo[1]; j <= hi[1]; ++j)
+    {
+      double dy = origin[1] + j * step - p[1];
+      for (int k = lo[2]; k <= hi[2]; ++k)
+      {
+        double dz = origin[2] + k * step - p[2];
+        if (dx * dx + dy * dy + dz * dz < radius2 && index(i, j, k) >= 0)
+          cells.push_back(index(i, j, k));
+      }
+    }
+  }
+}
+
+bool VoxelGrid::featureTransform(vector<int>& nearest) const
+{
+  //the passes sweep whole lines, the missing bricks of a sparse grid would need their cells too
+  if (isSparse()) return false;
+  if (empty()) return true;
+
+  int res[3] = {res_x, res_y, res_z};
+  int stride[3] = {res[1] * res[2], res[2], 1};
+  double infinity = GlobalFun::getDoubleMAXIMUM();
+  for (int axis = 2; axis >= 0; --axis)
+  {
+    int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+    int n = res[axis];
+
+    //one line along axis: every cell q holds the seed found over the axes done so far, at squared
+    //distance f(q) from it. the nearest seed of x is the one of the lowest parabola f(q) + (x - q)^2
+    auto transformLines = [&](int line_begin, int line_end)
+    {
+      vector<int>    line(n);
+      vector<double> f(n);
+      vector<int>    sites(n);      // the parabolas of the lower envelope
+      vector<double> bounds(n + 1); // parabola s is lowest in [bounds[s], bounds[s + 1]]
+      for (int l = line_begin; l < line_end; ++l)
+      {
+        int base = (l / res[a2]) * stride[a1] + (l % res[a2]) * stride[a2];
+        int top = -1;
+        for (int q = 0; q < n; ++q)
+        {
+          int c = base + q * stride[axis];
+          line[q] = nearest[c];
+          if (line[q] < 0) continue;
+
+          int ci = c / stride[0], cj = (c / stride[1]) % res[1], ck = c % res[2];
+          int si = line[q] / stride[0], sj = (line[q] / stride[1]) % res[1], sk = line[q] % res[2];
+          f[q] = double(ci - si) * (ci - si) + double(cj - sj) * (cj - sj) + double(ck - sk) * (ck - sk);
+
+          double s = 0;
+          while (top >= 0)
+          {
+            int v = sites[top];
+            s = ((f[q] + double(q) * q) - (f[v] + double(v) * v)) / (2.0 * (q - v));
+            if (s > bounds[top]) break;
+            --top;
+          }
+          ++top;
+          sites[top] = q;
+          bounds[top] = top == 0 ? -infinity : s;
+          bounds[top + 1] = infinity;
+        }
+        if (top < 0) continue;
+
+        for (int q = 0, s = 0; q < n; ++q)
+        {
+          while (bounds[s + 1] < q) ++s;
+          nearest[base + q * stride[axis]] = line[sites[s]];
+        }
+      }
+    };
+
+    int n_lines = res[a1] * res[a2];
+#ifdef LINKED_WITH_TBB
+    tbb::parallel_for(tbb::blocked_range<int>(0, n_lines),
+      [&](const tbb::blocked_range<int>& r)
+    {
+      transformLines(r.begin(), r.end());
+    });
+#else
+    transformLines(0, n_lines);
+#endif
+  }
+  return true;
+}
+
+void VoxelGrid::normalizeConfidence(float delta)
+{
+  float min_confidence = GlobalFun::getDoubleMAXIMUM();
+  float max_confidence = 0;
+  for (int i = 0; i < confidences.size(); i++)
+  {
+    min_confidence = (std::min)(min_confidence, confidences[i]);
+    max_confidence = (std::max)(max_confidence, confidences[i]);
+  }
+  float space = max_confidence - min_confidence;
+
+  for (int i = 0; i < confidences.size(); i++)
+  {
+    confidences[i] = (confidences[i] - min_confidence) / space;
+    confidences[i] += delta;
+  }
+}
+
+float VoxelGrid::interpolateConfidence(const Point3f& p, Point3f* gradient) const
+{
+  if (gradient != NULL) *gradient = Point3f(0.0f, 0.0f, 0.0f);
+  if (empty() || step <= 0) return 0.0f;
+
+  int lo[3], hi[3];
+  float t[3];
+  int res[3] = {res_x, res_y, res_z};
+  for (int a = 0; a < 3; ++a)
+  {
+    float x = (std::max)(0.0f, (std::min)(float(res[a] - 1), (p[a] - origin[a]) / step));
+    lo[a] = (std::min)((int)x, res[a] - 1);
+    hi[a] = (std::min)(lo[a] + 1, res[a] - 1);
+    t[a] = x - lo[a];
+  }
+
+  float c[2][2][2];
+  for (int i = 0; i < 2; ++i)
+    for (int j = 0; j < 2; ++j)
+      for (int k = 0; k < 2; ++k)
+      {
+        int cell = index(i ? hi[0] : lo[0], j ? hi[1] : lo[1], k ? hi[2] : lo[2]);
+        c[i][j][k] = cell >= 0 ? confidences[cell] : 0.0f;
+      }
+
+  //interpolate along z, then y, then x
+  float cz[2][2], cy[2];
+  for (int i = 0; i < 2; ++i)
+    for (int j = 0; j < 2; ++j)
+      cz[i][j] = c[i][j][0] + t[2] * (c[i][j][1] - c[i][j][0]);
+  for (int i = 0; i < 2; ++i)
+    cy[i] = cz[i][0] + t[1] * (cz[i][1] - cz[i][0]);
+  float value = cy[0] + t[0] * (cy[1] - cy[0]);
+
+  if (gradient != NULL)
+  {
+    float dz[2][2], dy[2], dzy[2];
+    for (int i = 0; i < 2; ++i)
+      for (int j = 0; j < 2; ++j)
+        dz[i][j] = c[i][j][1] - c[i][j][0];
+    for (int i = 0; i < 2; ++i)
+    {
+      dy[i] = cz[i][1] - cz[i][0];
+      dzy[i] = dz[i][0] + t[1] * (dz[i][1] - dz[i][0]);
+    }
+    (*gradient)[0] = (cy[1] - cy[0]) / step;
+    (*gradient)[1] = (dy[0] + t[0] * (dy[1] - dy[0])) / step;
+    (*gradient)[2] = (dzy[0] + t[0] * (dzy[1] - dzy[0])) / step;
+  }
+  return value;
+}
+
+void VoxelGrid::setFlag(Flag f, int index, bool value)
+{
+  unsigned int bit = 1u << (index & 31);
+  if (value) flags[f][index >> 5] |= bit;
+  else flags[f][index >> 5] &= ~bit;
+}
+
+void VoxelGrid::clearFlag(Flag f)
+{
+  std::fill(flags[f].begin(), flags[f].end(), 0u);
+}
+
+CVertex VoxelGrid::getVertex(int index) const
+{
+  CVertex v;
+  v.P() = position(index);
+  v.N() = normal(index);
+  v.m_index = index;
+  v.eigen_confidence = confidences[index];
+  v.is_view_grid = (kind == VIEW_GRID);
+  v.is_field_grid = (kind == FIELD_GRID);
+  v.is_ray_stop = flag(RAY_STOP, index);
+  v.is_ignore = flag(IGNORED, index);
+  if (kind == VIEW_GRID)
+    v.remember_iso_index = iso_indices[index];
+  return v;
+}
+
+CVertex VoxelGrid::getVertex(int i, int j, int k) const
+{
+  int cell = index(i, j, k);
+  if (cell >= 0) return getVertex(cell);
+
+  CVertex v;
+  v.P() = position(i, j, k);
+  v.N() = Point3f(0.0f, 0.0f, 0.0f);
+  v.m_index = -1;
+  v.eigen_confidence = 0.0f;
+  v.is_view_grid = (kind == VIEW_GRID);
+  v.is_field_grid = (kind == FIELD_GRID);
+  return v;
+}
+
+unsigned int VoxelGrid::packNormal(const Point3f& n)
+{
+  unsigned int packed = 0;
+  for (int a = 0; a < 3; ++a)
+  {
+    float c = (std::max)(-1.0f, (std::min)(1.0f, n[a]));
+    int q = (int)floor(c * NORMAL_SCALE + 0.5f) + (1 << (NORMAL_BITS - 1));
+    packed |= (unsigned int)q << (a * NORMAL_BITS);
+  }
+  return packed;
+}
+
+Point3f VoxelGrid::unpackNormal(unsigned int packed)
+{
+  Point3f n;
+  for (int a = 0; a < 3; ++a)
+  {
+    int q = (packed >> (a * NORMAL_BITS)) & NORMAL_MASK;
+    n[a] = (q - (1 << (NORMAL_BITS - 1))) / NORMAL_SCALE;
+  }
+  return n;
+}
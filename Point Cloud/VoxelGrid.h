@@ -0,0 +1,112 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <vector>
+#include "cmesh.h"
+using namespace std;
+
+// regular volume for the nbv view grid and the poisson field.
+// cell (i, j, k) sits at origin + step * (i, j, k) and is stored at i * res_y * res_z + j * res_z + k.
+// positions are implicit, a cell only costs a float confidence, a packed normal and one bit per flag,
+// instead of a whole CVertex.
+// a grid made by resizeSparse() only stores the bricks of BRICK_SIZE^3 cells it was asked for, brick by
+// brick: size() and the indices then only cover the stored cells, index() is -1 for the others, and
+// the table of bricks is the coarse level that rays skip the missing bricks with.
+class VoxelGrid {
+  public:
+    enum Kind { VIEW_GRID, FIELD_GRID };
+    enum Flag { RAY_STOP = 0, IGNORED = 1, FLAG_NUM = 2 };
+    static const int BRICK_BITS = 3;
+    static const int BRICK_SIZE = 1 << BRICK_BITS;
+    static const int BRICK_MASK = BRICK_SIZE - 1;
+
+    VoxelGrid();
+
+    // the view grid also keeps the iso point each cell was propagated from
+    void    resize(Kind _kind, const Point3f& _origin, float _step, int _res_x, int _res_y, int _res_z);
+    // only the bricks with keep_bricks[(bi * bricks(_res_y) + bj) * bricks(_res_z) + bk] set are stored,
+    // the resolutions are rounded up to whole bricks
+    void    resizeSparse(Kind _kind, const Point3f& _origin, float _step, int _res_x, int _res_y, int _res_z,
+                         const vector<char>& keep_bricks);
+    static int bricks(int res) { return (res + BRICK_SIZE - 1) >> BRICK_BITS; }
+    // zeroes the values and the flags, the cells stay where they are
+    void    reset() { allocate(size()); }
+    void    clear();
+    bool    empty() const { return confidences.empty(); }
+    int     size()  const { return confidences.size(); }
+
+    Kind    getKind()   const { return kind; }
+    int     resX()      const { return res_x; }
+    int     resY()      const { return res_y; }
+    int     resZ()      const { return res_z; }
+    float   getStep()   const { return step; }
+    Point3f getOrigin() const { return origin; }
+    vcg::Box3f getBox() const;  // box of the cell centers
+
+    bool    isSparse()  const { return !brick_slots.empty(); }
+    const vector<int>& getBrickSlots() const { return brick_slots; }
+    // the stored brick (bi, bj, bk), -1 if it is missing
+    int     brickSlot(int bi, int bj, int bk) const { return brick_slots[(bi * brick_res[1] + bj) * brick_res[2] + bk]; }
+
+    int     index(int i, int j, int k) const
+    {
+      if (brick_slots.empty()) return (i * res_y + j) * res_z + k;
+      int slot = brickSlot(i >> BRICK_BITS, j >> BRICK_BITS, k >> BRICK_BITS);
+      if (slot < 0) return -1;
+      return (slot << (3 * BRICK_BITS)) | (((i & BRICK_MASK) << (2 * BRICK_BITS)) | ((j & BRICK_MASK) << BRICK_BITS) | (k & BRICK_MASK));
+    }
+    void    coords(int index, int& i, int& j, int& k) const;
+    bool    isInside(int i, int j, int k) const;
+    Point3f position(int index) const;
+    Point3f position(int i, int j, int k) const;
+    int     nearestCell(const Point3f& p) const;  // -1 outside the grid
+    void    getCellsInBall(const Point3f& p, double radius, vector<int>& cells) const;
+    // exact euclidean feature transform: on input nearest[i] is i for the seed cells and -1 for the
+    // others, on output it is the seed cell nearest to i (-1 without seeds). separable lower envelopes
+    // of parabolas along z, y and x (Felzenszwalb and Huttenlocher), O(cells), lines run in parallel.
+    // dense grids only, a sparse one returns false and leaves nearest as it is
+    bool    featureTransform(vector<int>& nearest) const;
+
+    float&  confidence(int index)       { return confidences[index]; }
+    float   confidence(int index) const { return confidences[index]; }
+    void    normalizeConfidence(float delta);  // same as GlobalFun::normalizeConfidence
+    // trilinear interpolation of the confidences, p is clamped to the grid.
+    // gradient (optional) is the exact gradient of the interpolant
+    float   interpolateConfidence(const Point3f& p, Point3f* gradient = NULL) const;
+
+    Point3f normal(int index) const     { return unpackNormal(normals[index]); }
+    void    setNormal(int index, const Point3f& n) { normals[index] = packNormal(n); }
+
+    // cells share a word, so don't set flags of neighbouring cells from different threads
+    bool    flag(Flag f, int index) const { return (flags[f][index >> 5] >> (index & 31)) & 1; }
+    void    setFlag(Flag f, int index, bool value);
+    void    clearFlag(Flag f);
+
+    int     isoIndex(int index) const     { return iso_indices.empty() ? -1 : iso_indices[index]; }
+    void    setIsoIndex(int index, int iso_index) { iso_indices[index] = iso_index; }
+
+    // a CVertex copy of a cell, for the code that works on points (drawing, slices, candidates)
+    CVertex getVertex(int index) const;
+    CVertex getVertex(int i, int j, int k) const;  // an empty cell at the position if it is missing
+
+    static unsigned int packNormal(const Point3f& n);
+    static Point3f      unpackNormal(unsigned int packed);
+
+  private:
+    void    allocate(int n);
+
+  private:
+    Kind                  kind;
+    Point3f               origin;
+    float                 step;
+    int                   res_x, res_y, res_z;
+    vector<float>         confidences;
+    vector<unsigned int>  normals;     // 10 bits per component
+    vector<unsigned int>  flags[FLAG_NUM];
+    vector<int>           iso_indices; // view grid only
+    int                   brick_res[3];
+    vector<int>           brick_slots; // sparse only, per brick of the whole grid
+    vector<int>           slot_bricks; // the brick of each stored slot
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "VoxelTraversal.h"
+#include "GlobalFunction.h"
+
+#include <math.h>
+using namespace std;
+
+VoxelRay::VoxelRay(const VoxelGrid& _grid, const Point3f& origin, const Point3f& dir, double max_dist)
+  : grid(&_grid), sparse(_grid.isSparse())
+{
+  const VoxelGrid& grid = _grid;
+  res[0] = grid.resX(); res[1] = grid.resY(); res[2] = grid.resZ();
+  stride[0] = res[1] * res[2]; stride[1] = res[2]; stride[2] = 1;
+
+  double len = dir.Norm();
+  double cell_size = grid.getStep();
+  Point3f grid_origin = grid.getOrigin();
+
+  t_entry = 0.0;
+  t_limit = max_dist;
+  cell_index = 0;
+  for (int a = 0; a < 3; ++a)
+  {
+    //cell i covers [i - 0.5, i + 0.5) in grid units, its center is at origin + i * step
+    double u = (origin[a] - grid_origin[a]) / cell_size + 0.5;
+    cell[a] = (int)floor(u);
+
+    double d = len > 0 ? dir[a] / len : 0.0;
+    if (d > EPS_SUN)
+    {
+      step[a] = 1;
+      t_delta[a] = cell_size / d;
+      t_max[a] = (cell[a] + 1 - u) * t_delta[a];
+    }
+    else if (d < -EPS_SUN)
+    {
+      step[a] = -1;
+      t_delta[a] = -cell_size / d;
+      t_max[a] = (u - cell[a]) * t_delta[a];
+    }
+    else
+    {
+      step[a] = 0;
+      t_delta[a] = t_max[a] = BIG * BIG;
+    }
+    cell_index += cell[a] * stride[a];
+  }
+
+  inside = grid.isInside(cell[0], cell[1], cell[2]) && len > 0;
+  if (sparse)
+    cell_index = inside ? grid.index(cell[0], cell[1], cell[2]) : -1;
+}
+
+bool VoxelRay::next()
+{
+  if (!inside) return false;
+
+  while (true)
+  {
+    int a = 0;
+    if (t_max[1] < t_max[a]) a = 1;
+    if (t_max[2] < t_max[a]) a = 2;
+
+    t_entry = t_max[a];
+    if (t_entry > t_limit)
+    {
+      inside = false;
+      return false;
+    }
+
+    t_max[a] += t_delta[a];
+    cell[a] += step[a];
+    if (cell[a] < 0 || cell[a] >= res[a])
+    {
+      inside = false;
+      return false;
+    }
+
+    if (!sparse)
+    {
+      cell_index += step[a] * stride[a];
+      return true;
+    }
+
+    cell_index = grid->index(cell[0], cell[1], cell[2]);
+    if (cell_index >= 0) return true;
+
+    skipBrick();
+    if (!inside) return false;
+  }
+}
+
+void VoxelRay::skipBrick()
+{
+  //the boundary crossings left on each axis before the ray leaves the brick, the first exit is t_exit
+  int crossings[3];
+  double t_exit = BIG * BIG;
+  for (int a = 0; a < 3; ++a)
+  {
+    int local = cell[a] & VoxelGrid::BRICK_MASK;
+    crossings[a] = step[a] > 0 ? VoxelGrid::BRICK_MASK - local : (step[a] < 0 ? local : 0);
+    if (step[a] != 0)
+      t_exit = std::min(t_exit, t_max[a] + crossings[a] * t_delta[a]);
+  }
+  if (t_exit > t_limit)
+  {
+    inside = false;
+    return;
+  }
+
+  //take the crossings before t_exit at once, the next step then leaves the brick
+  for (int a = 0; a < 3; ++a)
+  {
+    if (step[a] == 0 || t_max[a] >= t_exit) continue;
+    int k = std::min(crossings[a], (int)ceil((t_exit - t_max[a]) / t_delta[a]));
+    cell[a] += k * step[a];
+    t_max[a] += k * t_delta[a];
+  }
+}
+
+bool VoxelRay::isVisible(const VoxelGrid& grid, const Point3f& from, const Point3f& to, VoxelGrid::Flag block)
+{
+  int target = grid.nearestCell(to);
+  Point3f dir = to - from;
+
+  VoxelRay ray(grid, from, dir, dir.Norm());
+  while (ray.next())
+  {
+    if (ray.index() == target) return true;
+    if (grid.flag(block, ray.index())) return false;
+  }
+  return true;
+}
+
+void RayDirectionTable::build(double _angle_delta)
+{
+  if (_angle_delta == angle_delta) return;
+
+  angle_delta = _angle_delta;
+  directions.clear();
+  if (angle_delta <= 0) return;
+
+  //same stepping as the loops it replaces, so the set of directions doesn't change
+  for (double a = 0.0f; a < PI; a += angle_delta)
+  {
+    double l = sin(a), y = cos(a);
+    for (double b = 0.0f; b < 2 * PI; b += angle_delta)
+    {
+      directions.push_back(Point3f(l * cos(b), y, l * sin(b)));
+    }
+  }
+}
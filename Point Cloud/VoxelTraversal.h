@@ -0,0 +1,97 @@
+#ifndef VOXEL_TRAVERSAL_H
+#define VOXEL_TRAVERSAL_H
+
+#include <vector>
+#include "cmesh.h"
+#include "VoxelGrid.h"
+using namespace std;
+
+// walks a ray through the cells of a VoxelGrid with the Amanatides-Woo 3D-DDA:
+// each cell the ray passes through is visited exactly once and in order, and the walk
+// stops as soon as it leaves the grid on either side. the start cell is the current
+// cell after construction, next() moves to the following one.
+// in a sparse grid only the stored cells are visited: a missing brick is crossed in one jump
+// to its exit, without looking at its cells.
+class VoxelRay {
+  public:
+    VoxelRay(const VoxelGrid& grid, const Point3f& origin, const Point3f& dir, double max_dist);
+
+    bool   next();                            // false once the ray leaves the grid or passes max_dist
+    int    index()    const { return cell_index; }
+    bool   isInside() const { return inside; }
+    double distance() const { return t_entry; } // along dir, where the current cell is entered
+
+    // true if no cell flagged with block lies strictly between the cells of from and to
+    static bool isVisible(const VoxelGrid& grid, const Point3f& from, const Point3f& to,
+                          VoxelGrid::Flag block = VoxelGrid::RAY_STOP);
+
+  private:
+    void   skipBrick();
+
+  private:
+    const VoxelGrid* grid;
+    bool   sparse;
+    int    cell[3];
+    int    res[3];
+    int    step[3];
+    int    stride[3];
+    double t_max[3];    // distance at which the ray crosses the next boundary on each axis
+    double t_delta[3];  // distance between two boundaries on each axis
+    double t_entry;
+    double t_limit;
+    int    cell_index;
+    bool   inside;
+};
+
+// the unit directions propagation shoots from every iso point: a in [0, PI) and b in [0, 2 PI)
+// stepped by angle_delta, so sin/cos are evaluated once per angle_delta and not per point
+class RayDirectionTable {
+  public:
+    RayDirectionTable() : angle_delta(-1.0) {}
+
+    void build(double _angle_delta);  // does nothing if the table is already built for it
+    int  size() const { return directions.size(); }
+    const Point3f& operator[](int i) const { return directions[i]; }
+    double getAngleDelta() const { return angle_delta; }
+
+  private:
+    double          angle_delta;
+    vector<Point3f> directions;
+};
+
+// f sampled at n + 1 evenly spaced x in [x_min, x_max] and read back with linear interpolation,
+// x outside the range is clamped. used for the exp() weights of propagation
+class WeightTable {
+  public:
+    WeightTable() : x_min(0.0), inv_dx(0.0) {}
+
+    template <class F>
+    void build(double _x_min, double _x_max, int n, F f)
+    {
+      x_min = _x_min;
+      inv_dx = n / (_x_max - _x_min);
+      values.resize(n + 2);
+      for (int i = 0; i <= n; ++i)
+        values[i] = f(x_min + i / inv_dx);
+      values[n + 1] = values[n];
+    }
+
+    float lookup(double x) const
+    {
+      double u = (x - x_min) * inv_dx;
+      if (u <= 0.0) return values[0];
+      int n = values.size() - 2;
+      if (u >= n) return values[n];
+
+      int i = (int)u;
+      float w = float(u - i);
+      return values[i] + (values[i + 1] - values[i]) * w;
+    }
+
+  private:
+    double        x_min;
+    double        inv_dx;
+    vector<float> values;
+};
+
+#endif
@@ -1,45 +1,24 @@
 #include "grid.h"
+#include "GlobalFunction.h"
 
 #include <algorithm>
 #include <iostream>
+#include <tbb/parallel_for.h>
 using namespace std;
 using namespace vcg;
 
-class XSort {
-  public:
-  bool operator()(const CVertex *a, const CVertex *b) {
-    return a->P()[0] < b->P()[0];
-  }
-};
-
-class YSort {
-  public:
-  bool operator()(const CVertex *a, const CVertex *b) {
-    return a->P()[1] < b->P()[1];
-  }
-};
+// cell coordinate along one axis, points outside the box go to the border cells
+static inline int clampCell(double u, int side) {
+  int c = (int)floor(u);
+  return c < 0 ? 0 : (c >= side ? side - 1 : c);
+}
 
-class ZSort {
-  public:
-  bool operator()(const CVertex *a, const CVertex *b) {
-    return a->P()[2] < b->P()[2];
-  }
-};
 // divid sample into some grids
 // and each grid has their points index in the index vector of sample.
 void CGrid::init(std::vector<CVertex> &vert, Box3f &box, double _radius) {
      
-//     cout << "enter grid::init"<<endl;
-     
   radius = _radius;
-
-  samples.resize(vert.size());
-  for(int i = 0; i < samples.size(); i++) {
-    samples[i] = &vert[i];
-	//// new
-	//samples[i]->m_index = i;
-  }
-
+  origin = box.min;
 
   Point3f min = box.min;
   Point3f max = box.max; 
@@ -48,58 +27,67 @@ void CGrid::init(std::vector<CVertex> &vert, Box3f &box, double _radius) {
   yside = (int)ceil((max[1] - min[1])/radius);
   zside = (int)ceil((max[2] - min[2])/radius);
   
-//  cout << "radius = "<<radius<<endl;
-//  cout << "xside, yside, zside "<<xside<<" "<<yside<<" "<<zside<<endl;
   xside = (xside > 0) ? xside : 1;
   yside = (yside > 0) ? yside : 1;
   zside = (zside > 0) ? zside : 1;
 
   assert(xside > 0 && yside > 0 && zside > 0);
-  
-  index.resize(xside*yside*zside+1, -1);  //x + xside*x + xside*yside*z
 
-  sort(samples.begin(), samples.end(), ZSort()); //this would be very slow 
+  // the cell of every point, independent per point
+  int n = vert.size();
+  vector<int> keys(n);
+  auto computeKeys = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const Point3f &p = vert[i].cP();
+      keys[i] = cell(clampCell((p[0] - min[0]) / radius, xside),
+                     clampCell((p[1] - min[1]) / radius, yside),
+                     clampCell((p[2] - min[2]) / radius, zside));
+    }
+  };
+#ifdef LINKED_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, n), 
+    [&](const tbb::blocked_range<size_t>& r) {
+    computeKeys(r.begin(), r.end());
+  });
+#else
+  computeKeys(0, n);
+#endif
+
+  // counting sort by cell key instead of the three nested comparison sorts,
+  // stable so the points of a cell keep their input order
+  index.assign(xside*yside*zside+1, 0);  //x + xside*x + xside*yside*z
+  for (int i = 0; i < n; i++)
+    index[keys[i] + 1]++;
+  for (int c = 0; c < xside*yside*zside; c++)
+    index[c + 1] += index[c];
+
+  vector<int> next(index.begin(), index.end() - 1);
+  samples.resize(n);
+  for (int i = 0; i < n; i++)
+    samples[next[keys[i]]++] = &vert[i];
+}
 
-  int startz = 0;
-  for(int z = 0; z < zside; z++) {
-    int endz = startz;
-    double maxz = min[2] + (z+1)*radius;
-    while(endz < samples.size() && samples[endz]->P()[2] < maxz)
-      ++endz; 
-    
-    sort(samples.begin()+startz, samples.begin()+endz, YSort());
-    
-    int starty = startz;
-    for(int y = 0; y < yside; y++) {
-      int endy = starty;        
-      double maxy = min[1] + (y+1)*radius;
-      while(endy < endz && samples[endy]->P()[1] < maxy)
-        ++endy;
-         
-      sort(samples.begin()+starty, samples.begin()+endy, XSort());
-      
-      int startx = starty;
-      for(int x = 0; x < xside; x++) {
-        int endx = startx;
-        index[x + xside*y + xside*yside*z] = endx;          
-        double maxx = min[0] + (x+1)*radius;
-        while(endx < endy && samples[endx]->P()[0] < maxx)
-          ++endx;
-        
-        startx = endx;
+void CGrid::gather(const Point3f &p, const CVertex *self, std::vector<int> &result) const {
+  double radius2 = radius * radius;
+  int cx = clampCell((p[0] - origin[0]) / radius, xside);
+  int cy = clampCell((p[1] - origin[1]) / radius, yside);
+  int cz = clampCell((p[2] - origin[2]) / radius, zside);
+
+  // cells are radius wide, so the ball never reaches past the 27 around p
+  for(int z = std::max(0, cz - 1); z <= std::min(zside - 1, cz + 1); z++) {
+    for(int y = std::max(0, cy - 1); y <= std::min(yside - 1, cy + 1); y++) {
+      for(int x = std::max(0, cx - 1); x <= std::min(xside - 1, cx + 1); x++) {
+        int c = cell(x, y, z);
+        for(int i = index[c]; i < index[c+1]; i++) {
+          const CVertex *t = samples[i];
+          if(t == self)
+            continue;
+          if((t->cP() - p).SquaredNorm() < radius2)
+            result.push_back(t->m_index);
+        }
       }
-      starty = endy;
-      
     }
-    startz = endz;
   }
-  index[xside*yside*zside] = startz;  // in order to compute the last grid's range
-
-// for debug..
-//   for (int i = 0; i < samples.size(); i++)
-//   {
-// 	  samples[i]->m_index = i;
-//   }
 }
 
 void CGrid::iterate(void (*self)(iterator starta, iterator enda, double radius),
@@ -13,6 +13,7 @@ class CGrid {
     std::vector<int> index;    // the start index of each grid in the sample points which is order by Zsort
     int xside, yside, zside;
     double radius;   
+    vcg::Point3f origin;       // min corner of the box the grid was built on
 
     typedef std::vector<CVertex *>::iterator iterator;
     
@@ -29,7 +30,11 @@ class CGrid {
                 void (*sample)(iterator starta, iterator enda, 
                                iterator startb, iterator endb, double radius));
                      
-    int cell(int x, int y, int z) { return x + xside*(y + yside*z); }
+    // the points strictly closer than radius to p go to result (their m_index), skipping self.
+    // only reads the grid, so any number of threads can gather at once
+    void gather(const vcg::Point3f &p, const CVertex *self, std::vector<int> &result) const;
+
+    int cell(int x, int y, int z) const { return x + xside*(y + yside*z); }
     bool isEmpty(int cell) { return index[cell+1] == index[cell]; }
     iterator startV(int origin) { return samples.begin() + index[origin]; }  
 	iterator endV(int origin) { return samples.begin() + index[origin+1]; }
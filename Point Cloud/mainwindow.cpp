@@ -603,10 +603,10 @@ void MainWindow::showViewGrids(bool _val)
 
   if (!area->dataMgr.isFieldPointsEmpty())
   {
-    CMesh* field_points = area->dataMgr.getCurrentFieldPoints();
-    for (int i = 0; i < 200; i++)
+    VoxelGrid* field_points = area->dataMgr.getCurrentFieldPoints();
+    for (int i = 0; i < 200 && i < field_points->size(); i++)
     {
-      cout << "eigen confidence:  "<< field_points->vert[i].eigen_confidence << endl;
+      cout << "eigen confidence:  "<< field_points->confidence(i) << endl;
     }
   }
 
@@ -1126,7 +1126,8 @@ void MainWindow::evaluationForDifferentModels()
   //CMesh *target = area->dataMgr.getCurrentOriginal();
   CMesh *model = area->dataMgr.getCurrentModel();
 
-  GlobalFun::computeAnnNeigbhors(target->vert, model->vert, 1, false, "runEvaluation");
+  area->dataMgr.getNeighborSearch()->computeAnnNeighbors(target, model->vert, 1, "runEvaluation");
+  area->dataMgr.getNeighborSearch()->clear();
   //GlobalFun::computeAnnNeigbhors(model->vert, target->vert, 1, false, "runEvaluation");
 
   double dist_sum = 0.0;